@@ -12,6 +12,18 @@
 
 // I hate this being here
 static SectorCacheEngine* fatfsSectorCache = nullptr;
+static SectorCacheMFM* mountedDrive = nullptr;
+static bool fatfsWriteBack = false;
+static void (*diskChangeCallback)(int diskInserted) = nullptr;
+static int driveCacheKb = -1;
+static bool driveCacheResident = false;
+static int driveIdleMs = -1;
+static int driveReadDeadlineMs = -1;
+static int driveReadRetries = -1;
+static bool driveReadFill = false;
+static std::string driveBadSectorFile;
+static bool driveRecover = false;
+static std::string driveDiskCacheDir;
 void setFatFSSectorCache(SectorCacheEngine* _fatfsSectorCache) {
   fatfsSectorCache = _fatfsSectorCache;
 }
@@ -35,13 +47,9 @@ DRESULT disk_read(BYTE pdrv, BYTE* buff, LBA_t sector, UINT count) {
   if (fatfsSectorCache && (pdrv == 0)) {
     if (!fatfsSectorCache->isDiskPresent()) return RES_NOTRDY;
 
-    while (count) {
-      if (!fatfsSectorCache->hybridReadData(sector, fatfsSectorCache->sectorSize(), buff))
-	return RES_ERROR;
-      count--;
-      sector++;
-      buff += fatfsSectorCache->hybridSectorSize();
-    }
+    // FatFs asks for whole runs of contiguous sectors, pass them on as one request
+    if (!fatfsSectorCache->hybridReadSectors(sector, count, fatfsSectorCache->hybridSectorSize(), buff))
+      return RES_ERROR;
     return RES_OK;
   }
   return RES_PARERR;
@@ -50,14 +58,8 @@ DRESULT disk_write(BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count) {
   if (fatfsSectorCache && (pdrv == 0)) {
     if (!fatfsSectorCache->isDiskPresent()) return RES_NOTRDY;
     if (fatfsSectorCache->isDiskWriteProtected()) return RES_WRPRT;
-    while (count) {
-      if (!fatfsSectorCache->writeData(sector, fatfsSectorCache->sectorSize(), buff))
-	return RES_ERROR;
-
-      count--;
-      sector++;
-      buff += fatfsSectorCache->sectorSize();
-    }
+    if (!fatfsSectorCache->writeSectors(sector, count, fatfsSectorCache->sectorSize(), buff))
+      return RES_ERROR;
     return RES_OK;
   }
   return RES_PARERR;
@@ -68,6 +70,8 @@ DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void* buff) {
 
     switch (cmd) {
     case CTRL_SYNC: // Complete pending write process (needed at FF_FS_READONLY == 0)
+      // Leave the tracks pending, sync_drive() will commit them later
+      if (fatfsWriteBack) return RES_OK;
       if (!fatfsSectorCache->flushWriteCache()) return RES_ERROR;
       return RES_OK;
 
@@ -97,8 +101,7 @@ uint32_t get_fattime(void) {
 int mount_drive (const char *floppyProfile) {
 
   auto* b = new SectorRW_FloppyBridge(floppyProfile, [](bool diskInserted, SectorType diskFormat) {
-    // push this in the main thread incase its not!
-    //    triggerRemount();
+    if (diskChangeCallback) diskChangeCallback(diskInserted ? 1 : 0);
   });
 
   if (!b->available()) {
@@ -107,6 +110,81 @@ int mount_drive (const char *floppyProfile) {
     return -1;
   }
 
+  if (driveCacheResident) b->setResidentMode(true);
+  else if (driveCacheKb >= 0) b->setCacheSize((uint32_t)driveCacheKb * 1024);
+  if (driveIdleMs >= 0) b->setMotorIdleTimeout((uint32_t)driveIdleMs);
+  b->setReadErrorPolicy((driveReadDeadlineMs >= 0) ? (uint32_t)driveReadDeadlineMs : (uint32_t)READ_DEADLINE,
+                        (driveReadRetries >= 0) ? (uint32_t)driveReadRetries : MAX_RETRIES, driveReadFill);
+  b->setBadSectorFile(driveBadSectorFile, driveRecover);
+  b->setDiskCacheDir(driveDiskCacheDir);
+
+  mountedDrive = b;
   setFatFSSectorCache(b);
   return 0;
-}
\ No newline at end of file
+}
+
+// Configure the sector cache, must be called before mount_drive
+void set_drive_cache(int cacheKb, int resident) {
+  driveCacheKb = cacheKb;
+  driveCacheResident = resident != 0;
+}
+
+// Configure the motor idle timeout, must be called before mount_drive
+void set_drive_idle(int idleMs) {
+  driveIdleMs = idleMs;
+}
+
+// Configure how reads give up on bad sectors, must be called before mount_drive
+void set_drive_read_policy(int deadlineMs, int retries, int fill) {
+  driveReadDeadlineMs = deadlineMs;
+  driveReadRetries = retries;
+  driveReadFill = fill > 0;
+}
+
+// Configure where bad sectors are remembered, must be called before mount_drive
+void set_drive_bad_sector_file(const char *filename, int recover) {
+  driveBadSectorFile = filename ? filename : "";
+  driveRecover = recover != 0;
+}
+
+// Configure where decoded tracks are kept, must be called before mount_drive
+void set_drive_disk_cache(const char *directory) {
+  driveDiskCacheDir = directory ? directory : "";
+}
+
+// Register who gets told about disk changes
+void set_disk_change_callback(void (*callback)(int diskInserted)) {
+  diskChangeCallback = callback;
+}
+
+// Enable or disable write-back mode
+void set_drive_writeback(int enable) {
+  fatfsWriteBack = enable != 0;
+}
+
+// Commit all pending tracks to the disk
+int sync_drive(void) {
+  if (!fatfsSectorCache) return -1;
+  if (!fatfsSectorCache->isDiskPresent()) return -1;
+  return fatfsSectorCache->flushWriteCache() ? 0 : -1;
+}
+
+// Head stepping counter, for the debug statistics
+unsigned long long drive_seek_distance(void) {
+  return mountedDrive ? mountedDrive->seekDistance() : 0;
+}
+
+// Cold read latency, for the debug statistics
+int drive_read_latency(unsigned long long *buckets, int count) {
+  if (!mountedDrive || count <= 0) return 0;
+  uint64_t histogram[READ_LATENCY_BUCKETS];
+  mountedDrive->readLatencyHistogram(histogram, READ_LATENCY_BUCKETS);
+  const int filled = std::min(count, READ_LATENCY_BUCKETS);
+  for (int i = 0; i < filled; i++) buckets[i] = histogram[i];
+  return filled;
+}
+
+// Sectors given up on, for the debug statistics
+unsigned int drive_bad_sectors(void) {
+  return mountedDrive ? mountedDrive->badSectorCount() : 0;
+}
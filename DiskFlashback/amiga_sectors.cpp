@@ -15,21 +15,20 @@
 #include "amiga_sectors.h"
 #include <cstddef>
 #include <cstring>
+#include <array>
+#include <bit>
 #include <safe_mem_lib.h>
 
+#define MFM_MASK64					0x5555555555555555ULL	// MFM_MASK over two longs
 #define NUM_SECTORS_PER_TRACK_DD	11			// Number of sectors per track
 #define NUM_SECTORS_PER_TRACK_HD	22			// Same but for HD disks
 #define SECTOR_BYTES DEFAULT_SECTOR_BYTES
 #define AMIGA_WORD_SYNC  0x4489							 // Disk SYNC code for the Amiga start of sector
-#define RAW_SECTOR_SIZE (8+56+SECTOR_BYTES+SECTOR_BYTES)      // Size of a sector, *Including* the sector sync word longs
 #define ADF_TRACK_SIZE_DD (SECTOR_BYTES*NUM_SECTORS_PER_TRACK_DD)   // Bytes required for a single track dd
 #define ADF_TRACK_SIZE_HD (SECTOR_BYTES*NUM_SECTORS_PER_TRACK_HD)   // Bytes required for a single track hd
 #define PRE_FILLER 1654
 
 
-typedef unsigned char RawEncodedSector[RAW_SECTOR_SIZE];
-
-
 typedef struct alignas(8) {
 	unsigned char trackFormat;        // This will be 0xFF for Amiga
 	unsigned char trackNumber;        // Current track number (this is actually (tracknumber*2) + side
@@ -79,27 +78,7 @@ void getTrackDetails_AMIGA(const bool isHD, uint32_t& sectorsPerTrack, uint32_t&
 
 // Copys the data from inTrack into outSector so that it is aligned to byte properly
 void extractRawSector(const unsigned char* inTrack, const uint32_t dataLengthInBits, const uint32_t bitPos, RawEncodedSector& outSector) {
-	unsigned char byteOut = 0;
-	unsigned int byteOutPosition = 0;
-
-	uint32_t realBitPos = bitPos;
-		
-	unsigned char* memOut = outSector;
-
-	// This is mis-aligned.  So we need to shift the data into byte boundarys
-	for (uint32_t byteOutPos=0; byteOutPos < RAW_SECTOR_SIZE; byteOutPos++) {
-		for (uint32_t bit=0; bit<=7; bit++) {
-			*memOut <<= 1;
-			const uint32_t trackBytePos = realBitPos >> 3;
-			const uint32_t trackBitPos = 7 - (realBitPos & 7);
-
-			if (inTrack[trackBytePos] & (1 << trackBitPos)) *memOut |= 1;
-			realBitPos = (realBitPos + 1) % dataLengthInBits;
-		}
-
-		// Move along and reset
-		memOut++;
-	}
+	extractTrackBits(inTrack, dataLengthInBits, bitPos, RAW_SECTOR_SIZE, outSector);
 }
 
 // MFM decoding algorithm
@@ -107,30 +86,50 @@ void extractRawSector(const unsigned char* inTrack, const uint32_t dataLengthInB
 // *output;	decoded data buffer (size == data_size) 
 // Returns the checksum calculated over the data
 uint32_t decodeMFMdata(const uint32_t* input, uint32_t* output, const unsigned int data_size) {
-	uint32_t odd_bits, even_bits;
-	uint32_t chksum = 0L;
-	unsigned int count;
-
-	// the decoding is made here long by long : with data_size/4 iterations 
-	for (count = 0; count < data_size / 4; count++) {
-		odd_bits = *input;					// longs with odd bits 
-		even_bits = *(uint32_t*)(((unsigned char*)input) + data_size);   // longs with even bits - located 'data_size' bytes after the odd bits
+	const unsigned char* inputOdd = (const unsigned char*)input;                 // longs with odd bits
+	const unsigned char* inputEven = inputOdd + data_size;                       // longs with even bits - located 'data_size' bytes after the odd bits
+	unsigned char* out = (unsigned char*)output;
+	uint64_t chksum = 0;
+	unsigned int count = 0;
+
+	// the decoding is made here two longs at a time. The mask keeps each long's bits to itself so this works whatever the byte order
+	for (; count + 8 <= data_size; count += 8) {
+		uint64_t odd_bits, even_bits;
+		memcpy(&odd_bits, inputOdd + count, 8);
+		memcpy(&even_bits, inputEven + count, 8);
+
+		chksum ^= odd_bits ^ even_bits;              // XOR Checksum
+
+		const uint64_t decoded = (even_bits & MFM_MASK64) | ((odd_bits & MFM_MASK64) << 1);
+		memcpy(out + count, &decoded, 8);
+	}
+	// And the odd one left over
+	for (; count + 4 <= data_size; count += 4) {
+		uint32_t odd_bits, even_bits;
+		memcpy(&odd_bits, inputOdd + count, 4);
+		memcpy(&even_bits, inputEven + count, 4);
 
-		chksum ^= odd_bits;              // XOR Checksum
-		chksum ^= even_bits;
+		chksum ^= odd_bits ^ even_bits;
 
-		*output = ((even_bits & MFM_MASK) | ((odd_bits & MFM_MASK) << 1));
-		input++;      /* next 'odd' long and 'even bits' long  */
-		output++;     /* next location of the future decoded long */
+		const uint32_t decoded = (even_bits & MFM_MASK) | ((odd_bits & MFM_MASK) << 1);
+		memcpy(out + count, &decoded, 4);
 	}
-	return chksum & MFM_MASK;
+	return ((uint32_t)chksum ^ (uint32_t)(chksum >> 32)) & MFM_MASK;
+}
+
+// Checks a sector laid out for fusion: the data checksum followed by the decoded data
+static bool amigaFusionCheck(const uint8_t* raw, const uint32_t size) {
+	const uint32_t* data = (const uint32_t*)raw;
+	uint32_t chksum = 0;
+	// The checksum is over the odd and even MFM longs, which decode to the data and the data shifted down one
+	for (uint32_t i = 1; i < size / 4; i++) chksum ^= data[i] ^ (data[i] >> 1);
+	return data[0] == (chksum & MFM_MASK);
 }
 
 // Decode the sector.  Returns the number of checksum/errors found
-void decodeSector(const RawEncodedSector& rawSector, const uint32_t trackNumber, const uint32_t expectedNumSectors, DecodedTrack& decodedTrack) {
-	DecodedSector sector;
+void decodeSector(const RawEncodedSector& rawSector, const uint32_t trackNumber, const uint32_t expectedNumSectors, DecodedTrack& decodedTrack, SectorFusion* fusion) {
+	uint32_t numErrors = 0;
 	SectorHeader header;
-	sector.numErrors = 0;
 
 	// Easier to operate on
 	const unsigned char* sectorData = rawSector;
@@ -145,50 +144,61 @@ void decodeSector(const RawEncodedSector& rawSector, const uint32_t trackNumber,
 	decodeMFMdata((uint32_t*)(sectorData + 40), (uint32_t*)&headerChecksum, 4);  // (computed on mfm longs, longs between offsets 8 and 44 == 2 * (1 + 4) longs)
 	
 	// If the header checksum fails we just cant trust anything we received
-	if (headerChecksum != headerChecksumCalculated) sector.numErrors+= 10;
+	if (headerChecksum != headerChecksumCalculated) numErrors += 10;
 
 	// Check if the header contains valid fields
 	if (header.trackFormat != 0xFF) return;  // this also blocks IBM sectors from being detected incorrectly
 	// Can't use this sector anyway
 	if (header.sectorNumber > (expectedNumSectors - 1)) return;
-	if (header.trackNumber > 166) sector.numErrors++;
-	if (header.sectorsRemaining > expectedNumSectors) sector.numErrors++;
-	if (header.sectorsRemaining < 1) sector.numErrors++;
+	if (header.trackNumber > 166) numErrors++;
+	if (header.sectorsRemaining > expectedNumSectors) numErrors++;
+	if (header.sectorsRemaining < 1) numErrors++;
 
 	// And is it from the track we expected?
-	if (header.trackNumber != trackNumber) sector.numErrors++;
+	if (header.trackNumber != trackNumber) numErrors++;
 
 	// Get the checksum for the data
 	uint32_t dataChecksum;
 	decodeMFMdata((uint32_t*)(sectorData + 48), (uint32_t*)&dataChecksum, 4);
 
 	// Decode the data and receive it's checksum
-	sector.data.resize(SECTOR_BYTES);
-	uint32_t dataChecksumCalculated = decodeMFMdata((uint32_t*)(sectorData + 56), (uint32_t*)&sector.data[0], SECTOR_BYTES); // (from 64 to 1088 == 2*512 bytes)
-
-	if (dataChecksum != dataChecksumCalculated) 
-		sector.numErrors++;
+	uint32_t raw[1 + (SECTOR_BYTES / 4)];
+	uint32_t* data = raw + 1;
+	uint32_t dataChecksumCalculated = decodeMFMdata((uint32_t*)(sectorData + 56), data, SECTOR_BYTES); // (from 64 to 1088 == 2*512 bytes)
+
+	if (dataChecksum != dataChecksumCalculated) {
+		// Only the data is bad, see if it can be rebuilt from the earlier bad copies
+		raw[0] = dataChecksum;
+		const bool repaired = (numErrors == 0) && fusion && fusion->fuse(header.sectorNumber, (const uint8_t*)raw, sizeof(raw), amigaFusionCheck, (uint8_t*)raw);
+		if (!repaired) numErrors++;
+	}
+	else if ((numErrors == 0) && fusion) fusion->discard(header.sectorNumber);
 
 	// Store the one with the least errors if there's duplicates
-	auto it = decodedTrack.sectors.find(header.sectorNumber);
-
-	if (it == decodedTrack.sectors.end())
-		decodedTrack.sectors.insert(std::make_pair(header.sectorNumber, sector));
-	else {
+	if (decodedTrack.has(header.sectorNumber)) {
 		// See which one has less errors and overwrite if needed
-		if (sector.numErrors < it->second.numErrors)
-			it->second = sector;
+		if ((numErrors < decodedTrack.numErrors[header.sectorNumber]) && (decodedTrack.sectorSize == SECTOR_BYTES)) {
+			decodedTrack.replace(header.sectorNumber, (const uint8_t*)data, numErrors);
+		}
 	}
+	else decodedTrack.set(header.sectorNumber, (const uint8_t*)data, SECTOR_BYTES, numErrors);
+}
+
+// For each byte, a bit set for every shift p where the sync pattern can end p bits before its end: (byte >> p) matches the low bits of it
+static constexpr std::array<uint8_t, 256> buildSyncPhases() {
+	std::array<uint8_t, 256> phases{};
+	for (uint32_t byte = 0; byte < 256; byte++)
+		for (uint32_t p = 0; p < 8; p++)
+			if ((byte >> p) == ((uint32_t)(AMIGA_WORD_SYNC & 0xFF) & (0xFFU >> p))) phases[byte] |= 1 << p;
+	return phases;
 }
+static constexpr std::array<uint8_t, 256> syncPhases = buildSyncPhases();
 
 // Search for sectors in the data supplied
-void findSectors_AMIGA(const uint8_t* track, const uint32_t dataLengthInBits, const bool isHD, const uint32_t trackNumber, const uint32_t expectedNumSectors, DecodedTrack& decodedTrack) {
+void findSectors_AMIGA(const uint8_t* track, const uint32_t dataLengthInBits, const bool isHD, const uint32_t trackNumber, const uint32_t expectedNumSectors, DecodedTrack& decodedTrack, SectorFusion* fusion) {
 	// Work out what we need to search for which is syncsync
 	const uint32_t search = (AMIGA_WORD_SYNC | (((uint32_t)AMIGA_WORD_SYNC) << 16));
 
-	// Prepare our test buffer
-	uint32_t decoded = 0;
-
 	// Search with an overlap of approx 3 raw sectors worth of data
 	const uint32_t totalBitsToSearch = dataLengthInBits + (RAW_SECTOR_SIZE * 8 * 3);
 	const uint32_t expectedSectors = expectedNumSectors ? expectedNumSectors : (isHD ? NUM_SECTORS_PER_TRACK_HD : NUM_SECTORS_PER_TRACK_DD);
@@ -196,43 +206,60 @@ void findSectors_AMIGA(const uint8_t* track, const uint32_t dataLengthInBits, co
 	int nextTrackBitCount = 0;
 
 	RawEncodedSector alignedSector;
+	if (fusion) fusion->begin(trackNumber);
+
+	// run the entire track length with some space to wrap around, a byte at a time. Only bytes that could end
+	// the sync pattern get a full compare, at just the shifts it could be at
+	uint64_t window = 0;
+	uint32_t start = 0;      // track bit the next byte starts at
+	const uint32_t totalBytesToSearch = (dataLengthInBits >= 32) ? totalBitsToSearch / 8 : 0;
+	for (uint32_t count = 0; count < totalBytesToSearch; count++) {
+		uint8_t next;
+		if (start + 8 <= dataLengthInBits) {
+			const uint32_t trackBytePos = start >> 3;
+			const uint32_t shift = start & 7;
+			next = shift ? (uint8_t)((track[trackBytePos] << shift) | (track[trackBytePos + 1] >> (8 - shift))) : track[trackBytePos];
+		}
+		else {
+			// Wraps around the end of the track
+			next = 0;
+			for (uint32_t bit = 0, realBitPos = start; bit < 8; bit++) {
+				next = (next << 1) | ((track[realBitPos >> 3] >> (7 - (realBitPos & 7))) & 1);
+				if (++realBitPos == dataLengthInBits) realBitPos = 0;
+			}
+		}
+		start += 8;
+		if (start >= dataLengthInBits) start -= dataLengthInBits;
+		window = (window << 8) | next;
 
-	// run the entire track length with some space to wrap around
-	for (uint32_t bit = 0; bit< totalBitsToSearch; bit++) {
-		const uint32_t realBitPos = bit % dataLengthInBits;
-		const uint32_t trackBytePos = realBitPos >> 3;
-		const uint32_t trackBitPos =  7- (realBitPos & 7);
-		decoded <<= 1;   // shift off one bit to make room for the new bit
-		if (track[trackBytePos] & (1 << trackBitPos)) decoded |= 1;
+		// Highest shift first, that's the earliest in the track
+		for (uint32_t phases = syncPhases[next]; phases; ) {
+			const uint32_t phase = std::bit_width(phases) - 1;
+			phases &= ~(1U << phase);
+			if ((uint32_t)(window >> phase) != search) continue;
 
-		if (decoded == search) {
-			// Extract the sector and skip past the data
-			extractRawSector(track, dataLengthInBits, (bit + 1) % dataLengthInBits, alignedSector);
+			// Extract the sector and skip past the data, it starts straight after the sync
+			extractRawSector(track, dataLengthInBits, (start >= phase) ? start - phase : start + dataLengthInBits - phase, alignedSector);
 
 			// Now see if there's a valid sector there.  We now only skip the sector if its valid, incase rogue data gets in there
-			decodeSector(alignedSector, trackNumber, expectedSectors, decodedTrack);			
+			decodeSector(alignedSector, trackNumber, expectedSectors, decodedTrack, fusion);
 		}
 	}
 
 	// Fill in the missing ones
 	decodedTrack.sectorsWithErrors = 0;
 	for (uint32_t sec = 0; sec < expectedSectors; sec++) {
-		auto it = decodedTrack.sectors.find(sec);
-
 		// Does a sector with this number exist?
-		if (it == decodedTrack.sectors.end()) {
+		if (!decodedTrack.has(sec)) {
 			if (expectedNumSectors) {
 				// No. Create a dummy one - VERY NOT IDEAL!
-				DecodedSector tmp;
-				tmp.data.resize(SECTOR_BYTES);
-				memset(&tmp.data[0], 0, sizeof(tmp));
-				tmp.numErrors = 0xFFFF;
-				decodedTrack.sectors.insert(std::make_pair(sec, tmp));
+				uint8_t* data = decodedTrack.add(sec, SECTOR_BYTES, 0xFFFF);
+				if (data) memset(data, 0, SECTOR_BYTES);
 				decodedTrack.sectorsWithErrors++;
 			}
 		}
 		else
-			if (it->second.numErrors) decodedTrack.sectorsWithErrors++;
+			if (decodedTrack.numErrors[sec]) decodedTrack.sectorsWithErrors++;
 	}
 }
 
@@ -241,33 +268,39 @@ void findSectors_AMIGA(const uint8_t* track, const uint32_t dataLengthInBits, co
 // *output;	MFM encoded buffer (size == data_size*2) 
 // Returns the checksum calculated over the data
 uint32_t encodeMFMdata(const uint32_t* input, uint32_t* output, const unsigned int data_size) {
-	uint32_t chksum = 0L;
-	unsigned int count;
-
-	uint32_t* outputOdd = output;
-	uint32_t* outputEven = (uint32_t*)(((unsigned char*)output) + data_size);
-
-	// Encode over two passes.  First split out the odd and even data, then encode the MFM values, the /4 is because we're working in longs, not bytes
-	for (count = 0; count < data_size / 4; count++) {
-		*outputEven = *input & MFM_MASK;
-		*outputOdd = ((*input) >> 1) & MFM_MASK;
-		outputEven++;
-		outputOdd++;
-		input++;
+	const unsigned char* in = (const unsigned char*)input;
+	unsigned char* outputOdd = (unsigned char*)output;
+	unsigned char* outputEven = outputOdd + data_size;
+	uint64_t chksum = 0;
+	unsigned int count = 0;
+
+	// Split out the odd and even data two longs at a time, the checksum is taken in the same pass. Bits shifted
+	// across into the other long are masked off so this works whatever the byte order
+	for (; count + 8 <= data_size; count += 8) {
+		uint64_t value;
+		memcpy(&value, in + count, 8);
+		const uint64_t even_bits = value & MFM_MASK64;
+		const uint64_t odd_bits = (value >> 1) & MFM_MASK64;
+		memcpy(outputEven + count, &even_bits, 8);
+		memcpy(outputOdd + count, &odd_bits, 8);
+		chksum ^= odd_bits ^ even_bits;
 	}
-
-	// Checksum calculator
-	// Encode over two passes.  First split out the odd and even data, then encode the MFM values, the /4 is because we're working in longs, not bytes
-	for (count = 0; count < (data_size / 4) * 2; count++) {
-		chksum ^= *output;
-		output++;
+	// And the odd one left over
+	for (; count + 4 <= data_size; count += 4) {
+		uint32_t value;
+		memcpy(&value, in + count, 4);
+		const uint32_t even_bits = value & MFM_MASK;
+		const uint32_t odd_bits = (value >> 1) & MFM_MASK;
+		memcpy(outputEven + count, &even_bits, 4);
+		memcpy(outputOdd + count, &odd_bits, 4);
+		chksum ^= odd_bits ^ even_bits;
 	}
 
-	return chksum & MFM_MASK;
+	return ((uint32_t)chksum ^ (uint32_t)(chksum >> 32)) & MFM_MASK;
 }
 
 // Encode a sector into the correct format for disk
-void encodeSector(const uint32_t trackNumber, const uint32_t sectorNumber, const uint32_t totalSectors, const RawDecodedSector& input, RawEncodedSector& encodedSector, unsigned char& lastByte) {
+void encodeSector(const uint32_t trackNumber, const uint32_t sectorNumber, const uint32_t totalSectors, const uint8_t* input, RawEncodedSector& encodedSector, unsigned char& lastByte) {
 	// Sector Start
 	encodedSector[0] = (lastByte & 1) ? 0x2A : 0xAA;
 	encodedSector[1] = 0xAA;
@@ -288,9 +321,6 @@ void encodeSector(const uint32_t trackNumber, const uint32_t sectorNumber, const
 	header.sectorNumber = sectorNumber;
 	header.sectorsRemaining = totalSectors - sectorNumber;  //1..11
 
-	// Shouldnt happen but important
-	if (input.size() != SECTOR_BYTES) return;
-
 	uint32_t sectorLabel[4] = { 0,0,0,0 };
 	uint32_t headerChecksumCalculated = encodeMFMdata((const uint32_t*)&header, (uint32_t*)&encodedSector[8], 4);
 	// Then theres the 16 bytes of the volume label that isnt used anyway
@@ -298,26 +328,22 @@ void encodeSector(const uint32_t trackNumber, const uint32_t sectorNumber, const
 	// Thats 40 bytes written as everything doubles (8+4+4+16+16). - Encode the header checksum
 	encodeMFMdata((const uint32_t*)&headerChecksumCalculated, (uint32_t*)&encodedSector[48], 4);
 	// And move on to the data section.  Next should be the checksum, but we cant encode that until we actually know its value!
-	uint32_t dataChecksumCalculated = encodeMFMdata((const uint32_t*)&input[0], (uint32_t*)&encodedSector[64], SECTOR_BYTES);
+	uint32_t dataChecksumCalculated = encodeMFMdata((const uint32_t*)input, (uint32_t*)&encodedSector[64], SECTOR_BYTES);
 	// And add the checksum
 	encodeMFMdata((const uint32_t*)&dataChecksumCalculated, (uint32_t*)&encodedSector[56], 4);
 
-	// Now fill in the MFM clock bits
-	bool lastBit = encodedSector[7] & (1 << 0);
-	bool thisBit = lastBit;
-
-	// Clock bits are bits 7, 5, 3 and 1
-	// Data is 6, 4, 2, 0
-	for (int count = 8; count < RAW_SECTOR_SIZE; count++) {
-		for (int bit = 7; bit >= 1; bit -= 2) {
-			lastBit = thisBit;
-			thisBit = encodedSector[count] & (1 << (bit - 1));
-
-			if (!(lastBit || thisBit)) {
-				// Encode a 1!
-				encodedSector[count] |= (1 << bit);
-			}
-		}
+	// Now fill in the MFM clock bits, a long at a time. Clock bits are bits 7, 5, 3 and 1, data is 6, 4, 2, 0.
+	// A clock bit is only set if the data bits either side of it are both 0
+	uint32_t lastBit = encodedSector[7] & 1;
+	for (int count = 8; count < RAW_SECTOR_SIZE; count += 4) {
+		unsigned char* mfm = &encodedSector[count];
+		const uint32_t data = (((uint32_t)mfm[0] << 24) | ((uint32_t)mfm[1] << 16) | ((uint32_t)mfm[2] << 8) | (uint32_t)mfm[3]) & MFM_MASK;
+		const uint32_t encoded = data | (~((data << 1) | (data >> 1) | (lastBit << 31)) & (MFM_MASK << 1));
+		lastBit = data & 1;
+		mfm[0] = (unsigned char)(encoded >> 24);
+		mfm[1] = (unsigned char)(encoded >> 16);
+		mfm[2] = (unsigned char)(encoded >> 8);
+		mfm[3] = (unsigned char)encoded;
 	}
 
 	lastByte = encodedSector[RAW_SECTOR_SIZE - 1];
@@ -330,20 +356,24 @@ uint32_t encodeSectorsIntoMFM_AMIGA(const bool isHD, const DecodedTrack& decoded
 	const uint32_t fillerSize = PRE_FILLER + (isHD ? PRE_FILLER : 0);
 
 	// Calculate total bytes we want to write - the extra 8 bytes is for post padding to clean up clock bits
-	const uint32_t bytesRequired = (uint32_t)((sizeof(RawEncodedSector) * decodedTrack.sectors.size()) + fillerSize + 8);
+	const uint32_t bytesRequired = (uint32_t)((sizeof(RawEncodedSector) * decodedTrack.count()) + fillerSize + 8);
 
 	// Not enough space?
 	if (mfmBufferSizeBytes < bytesRequired) return 0;
 
+	// Shouldnt happen but important
+	if (decodedTrack.count() && decodedTrack.sectorSize != SECTOR_BYTES) return 0;
+
 	unsigned char* output = (unsigned char*)memBuffer;
 	unsigned char lastByte = 0xAA;
 	memset(output, lastByte, fillerSize);
 	output += fillerSize;
 
 	// The order of the sectors does not matter
-	for (const auto& sec : decodedTrack.sectors) {
+	for (uint32_t sec = 0; sec < MAX_DECODED_SECTORS; sec++) {
+		if (!decodedTrack.has(sec)) continue;
 		RawEncodedSector* out = (RawEncodedSector*)output;			
-		encodeSector(trackNumber, (uint32_t)sec.first, (uint32_t)decodedTrack.sectors.size(), sec.second.data, *out, lastByte);
+		encodeSector(trackNumber, sec, decodedTrack.count(), decodedTrack.data(sec), *out, lastByte);
 		output += sizeof(RawEncodedSector);
 	}
 
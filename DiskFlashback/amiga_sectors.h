@@ -19,6 +19,11 @@
 #include <stdint.h>
 #include <unordered_map>
 #include "sectorCommon.h"
+#include "sectorFusion.h"
+
+#define RAW_SECTOR_SIZE (8+56+DEFAULT_SECTOR_BYTES+DEFAULT_SECTOR_BYTES)      // Size of a sector, *Including* the sector sync word longs
+
+typedef unsigned char RawEncodedSector[RAW_SECTOR_SIZE];
 
 // Grabs a copy of the bootblock for the system required.  target must be 1024 bytes in size
 void fetchBootBlockCode_AMIGA(bool ffs, uint8_t* target);
@@ -26,8 +31,24 @@ void fetchBootBlockCode_AMIGA(bool ffs, uint8_t* target);
 // Very simple 
 void getTrackDetails_AMIGA(const bool isID, uint32_t& sectorsPerTrack, uint32_t& bytesPerSector);
 
-// Searches for sectors - you can re-call this and it will update decodedTrack rather than replace it
-void findSectors_AMIGA(const uint8_t* track, const uint32_t dataLengthInBits, const bool isHD, const uint32_t trackNumber, const uint32_t expectedNumSectors, DecodedTrack& decodedTrack);
+// Searches for sectors - you can re-call this and it will update decodedTrack rather than replace it.
+// With fusion set, sectors that fail their checksum are voted on together with the bad copies from earlier calls
+void findSectors_AMIGA(const uint8_t* track, const uint32_t dataLengthInBits, const bool isHD, const uint32_t trackNumber, const uint32_t expectedNumSectors, DecodedTrack& decodedTrack, SectorFusion* fusion = nullptr);
+
+// Copys the sector starting bitPos bits into the track into outSector, byte aligned. The track wraps around at dataLengthInBits
+void extractRawSector(const unsigned char* inTrack, const uint32_t dataLengthInBits, const uint32_t bitPos, RawEncodedSector& outSector);
+
+// Splits the MFM odd and even longs back into data_size bytes of data and returns the checksum over the MFM longs
+uint32_t decodeMFMdata(const uint32_t* input, uint32_t* output, const unsigned int data_size);
+
+// Splits data_size bytes into the odd and even longs written to disk, without clock bits, and returns their checksum
+uint32_t encodeMFMdata(const uint32_t* input, uint32_t* output, const unsigned int data_size);
+
+// Encodes one sector with its sync, header and clock bits. lastByte is the byte before it on the track and is updated to its last byte
+void encodeSector(const uint32_t trackNumber, const uint32_t sectorNumber, const uint32_t totalSectors, const uint8_t* input, RawEncodedSector& encodedSector, unsigned char& lastByte);
+
+// Decode a sector found on the track into decodedTrack, a copy already there is only replaced by one with fewer errors
+void decodeSector(const RawEncodedSector& rawSector, const uint32_t trackNumber, const uint32_t expectedNumSectors, DecodedTrack& decodedTrack, SectorFusion* fusion);
 
 // Encodes all sectors into the buffer provided and returns the number of bytes that need to be written to disk 
 // mfmBufferSizeBytes needs to be at least 13542 or DD and 27076 for HD
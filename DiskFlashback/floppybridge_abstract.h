@@ -24,6 +24,8 @@
 
 #include "../fatfs/source/ff.h"
 #include <cstddef>
+#include <thread>
+#include <chrono>
 #include <functional>
 
 #ifdef _WIN32
@@ -191,6 +193,13 @@ public:
 
 	// Return TRUE if there is data ready to be committed to disk
 	virtual bool isReadyToWrite() = 0;
+
+	// Blocks until the drive state may have changed (motor ready, write complete, data available, disk change) or timeoutMs passes.
+	// Pass in the generation returned by the previous call, returns FALSE if it timed out. The default just waits
+	virtual bool waitForEvent(unsigned int& /*generation*/, unsigned int timeoutMs) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+		return false;
+	}
 };
 
 
@@ -130,6 +130,7 @@ typedef bool 			 (CALLING_CONVENSION* _DRIVER_isWritePending)(BridgeDriverHandle
 typedef bool 			 (CALLING_CONVENSION* _DRIVER_isWriteComplete)(BridgeDriverHandle bridgeDriverHandle);
 typedef bool 			 (CALLING_CONVENSION* _DRIVER_canTurboWrite)(BridgeDriverHandle bridgeDriverHandle);
 typedef bool 			 (CALLING_CONVENSION* _DRIVER_isReadyToWrite)(BridgeDriverHandle bridgeDriverHandle);
+typedef bool 			 (CALLING_CONVENSION* _DRIVER_waitForEvent)(BridgeDriverHandle bridgeDriverHandle, unsigned int* generation, unsigned int timeoutMs);
 typedef int 			 (CALLING_CONVENSION* _DRIVER_getTrack)(BridgeDriverHandle bridgeDriverHandle, bool side, unsigned int track, bool resyncRotation, int bufferSizeInBytes, void* data);
 typedef int 			 (CALLING_CONVENSION* _DRIVER_putTrack)(BridgeDriverHandle bridgeDriverHandle, bool side, unsigned int track, bool writeFromIndex, int bufferSizeInBytes, void* data);
 typedef int 			 (CALLING_CONVENSION* _DRIVER_setDirectMode)(BridgeDriverHandle bridgeDriverHandle, bool directMode);
@@ -207,6 +208,7 @@ _DRIVER_isWritePending	DRIVER_isWritePending = nullptr;
 _DRIVER_isWriteComplete	DRIVER_isWriteComplete = nullptr;
 _DRIVER_canTurboWrite	DRIVER_canTurboWrite = nullptr;
 _DRIVER_isReadyToWrite	DRIVER_isReadyToWrite = nullptr;
+_DRIVER_waitForEvent	DRIVER_waitForEvent = nullptr;
 _DRIVER_getTrack DRIVER_getTrack = nullptr;
 _DRIVER_putTrack DRIVER_putTrack = nullptr;
 _DRIVER_setDirectMode DRIVER_setDirectMode = nullptr;
@@ -304,6 +306,7 @@ void prepareBridge() {
 	DRIVER_isWriteComplete = (_DRIVER_isWriteComplete)GETFUNC(hBridgeDLLHandle, "DRIVER_isWriteComplete");
 	DRIVER_canTurboWrite = (_DRIVER_canTurboWrite)GETFUNC(hBridgeDLLHandle, "DRIVER_canTurboWrite");
 	DRIVER_isReadyToWrite = (_DRIVER_isReadyToWrite)GETFUNC(hBridgeDLLHandle, "DRIVER_isReadyToWrite");
+	DRIVER_waitForEvent = (_DRIVER_waitForEvent)GETFUNC(hBridgeDLLHandle, "DRIVER_waitForEvent");  // optional, older libraries don't have it
 	DRIVER_getTrack = (_DRIVER_getTrack)GETFUNC(hBridgeDLLHandle, "DRIVER_getTrack");
 	DRIVER_putTrack = (_DRIVER_putTrack)GETFUNC(hBridgeDLLHandle, "DRIVER_putTrack");
 	DRIVER_setDirectMode = (_DRIVER_setDirectMode)GETFUNC(hBridgeDLLHandle, "DRIVER_setDirectMode");
@@ -915,4 +918,8 @@ bool FloppyBridgeAPI::canTurboWrite() {
 }
 bool FloppyBridgeAPI::isReadyToWrite() {
 	return DRIVER_isReadyToWrite(m_handle);
+}
+bool FloppyBridgeAPI::waitForEvent(unsigned int& generation, unsigned int timeoutMs) {
+	if (!DRIVER_waitForEvent) return FloppyDiskBridge::waitForEvent(generation, timeoutMs);
+	return DRIVER_waitForEvent(m_handle, &generation, timeoutMs);
 }
\ No newline at end of file
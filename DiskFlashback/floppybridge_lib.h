@@ -303,6 +303,7 @@ public:
 	virtual bool isWriteComplete() override;
 	virtual bool canTurboWrite() override;
 	virtual bool isReadyToWrite() override;
+	virtual bool waitForEvent(unsigned int& generation, unsigned int timeoutMs) override;
 	const unsigned int getDriverTypeIndex() const;
 	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
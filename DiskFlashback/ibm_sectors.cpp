@@ -1,5 +1,6 @@
 
 #include <algorithm>
+#include <array>
 #include <cstdint>
 /* DiskFlashback, Copyright (C) 2021-2024 Robert Smith (@RobSmithDev)
  * https://robsmithdev.co.uk/diskflashback
@@ -21,10 +22,10 @@
 #include <iostream>
 #include <safe_mem_lib.h>
 #include <unordered_map>
-#include <vector>
 
 #define IBM_DD_SECTORS 9
 #define IBM_HD_SECTORS 18
+#define IBM_MAX_SECTOR_LENGTH 5         // 2^(5+7) = 4096 bytes, the largest sector we'll accept
 
 // IAM A1A1A1FC
 #define MFM_SYNC_TRACK_HEADER				0x5224522452245552ULL
@@ -78,7 +79,7 @@ typedef struct alignas(1)  {
 // IDAM data
 typedef struct {
   unsigned char dataMark[4]; // should be 0xA1A1A1FB
-  std::vector<unsigned char> data; // *should* be 512 but doesn't have to be
+  unsigned char data[128 << IBM_MAX_SECTOR_LENGTH]; // *should* be 512 but doesn't have to be
   unsigned char crc[2];
 } IBMSectorData;
 
@@ -123,75 +124,118 @@ void getMkFsParams(bool isHD, SectorType format, MKFS_PARM& params) {
   }
 }
 
-// Very nasty, I'm sure theres a better way than this
-uint32_t encodeMFMdata(const uint8_t* input, uint8_t* output, const uint32_t inputSize, uint8_t& lastByte, uint8_t* memOverflow) {
-
-  bool lastBit = lastByte & 1;
-  for (uint32_t b = 0; b < inputSize; b++) {
-    if (output >= memOverflow) return std::max(((int32_t)b) - 1, 0) << 1;
-
-    uint8_t byte = *input++;
+// MFM for each byte, clock bits included, as if the data bit before it was a 0. If it was a 1 the top clock bit is cleared
+static constexpr std::array<uint16_t, 256> buildMFMTable() {
+  std::array<uint16_t, 256> table{};
+  for (uint32_t byte = 0; byte < 256; byte++) {
+    uint32_t mfm = 0;
+    bool lastBit = false;
     for (uint32_t bit = 0; bit < 8; bit++) {
-      *output <<= 2;
-      if (byte & 0x80) {
-	*output |= 1;
-	lastBit = true;
-      }
-      else {
-	if (!lastBit) *output |= 2;
-	lastBit = false;
-      }
-      // Move to next bit
-      byte <<= 1;
-      if (bit == 3) {
-	output++;
-	if (output >= memOverflow) return b << 1;
-      }
+      const bool thisBit = byte & (0x80 >> bit);
+      mfm = (mfm << 2) | (thisBit ? 1 : (lastBit ? 0 : 2));
+      lastBit = thisBit;
     }
-    output++;
+    table[byte] = (uint16_t)mfm;
+  }
+  return table;
+}
+static constexpr std::array<uint16_t, 256> mfmTable = buildMFMTable();
+
+// Encode a byte following lastByte
+static inline uint16_t encodeMFMbyte(const uint8_t byte, const uint8_t lastByte) {
+  return mfmTable[byte] & ((lastByte & 1) ? 0x7FFF : 0xFFFF);
+}
+
+// Encodes as many whole bytes as fit before memOverflow, returns the number of MFM bytes written
+uint32_t encodeMFMdata(const uint8_t* input, uint8_t* output, const uint32_t inputSize, uint8_t& lastByte, uint8_t* memOverflow) {
+  if (output >= memOverflow) return 0;
+  const uint32_t size = std::min<uint32_t>(inputSize, (uint32_t)(memOverflow - output) / 2);
+  if (!size) return 0;
+
+  uint8_t last = lastByte;
+  for (uint32_t b = 0; b < size; b++) {
+    const uint16_t mfm = encodeMFMbyte(input[b], last);
+    output[b * 2] = (uint8_t)(mfm >> 8);
+    output[b * 2 + 1] = (uint8_t)mfm;
+    last = input[b];
   }
-  lastByte = *(input - 1);
-  return inputSize << 1;
+  lastByte = last;
+  return size << 1;
 }
 
-// CRC16
-uint16_t crc16(char* pData, int length, uint32_t wCrc = 0xFFFF) {
-  uint8_t i;
-  while (length--) {
-    wCrc ^= *(unsigned char*)pData++ << 8;
-    for (i = 0; i < 8; i++)
-      wCrc = wCrc & 0x8000 ? (wCrc << 1) ^ 0x1021 : wCrc << 1;
+// CRC16 (CCITT, 0x1021) tables for slice-by-8. Table k is the CRC of a byte followed by k zero bytes
+static constexpr std::array<std::array<uint16_t, 256>, 8> buildCrc16Tables() {
+  std::array<std::array<uint16_t, 256>, 8> tables{};
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i << 8;
+    for (uint32_t bit = 0; bit < 8; bit++)
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    tables[0][i] = (uint16_t)crc;
   }
-  return wCrc & 0xffff;
+  for (uint32_t k = 1; k < 8; k++)
+    for (uint32_t i = 0; i < 256; i++)
+      tables[k][i] = (uint16_t)((tables[k - 1][i] << 8) ^ tables[0][tables[k - 1][i] >> 8]);
+  return tables;
+}
+static constexpr std::array<std::array<uint16_t, 256>, 8> crc16Tables = buildCrc16Tables();
+
+// CRC16, 8 bytes at a time
+uint16_t crc16(char* pData, int length, uint32_t wCrc) {
+  const uint8_t* data = (const uint8_t*)pData;
+  uint32_t crc = wCrc & 0xFFFF;
+  for (; length >= 8; length -= 8, data += 8)
+    crc = crc16Tables[7][data[0] ^ (crc >> 8)] ^ crc16Tables[6][data[1] ^ (crc & 0xFF)] ^
+          crc16Tables[5][data[2]] ^ crc16Tables[4][data[3]] ^ crc16Tables[3][data[4]] ^
+          crc16Tables[2][data[5]] ^ crc16Tables[1][data[6]] ^ crc16Tables[0][data[7]];
+  while (length-- > 0)
+    crc = ((crc << 8) ^ crc16Tables[0][(crc >> 8) ^ *data++]) & 0xFFFF;
+  return (uint16_t)crc;
+}
+
+// Checks a sector laid out for fusion: data mark, data, then the CRC
+static bool ibmFusionCheck(const uint8_t* raw, const uint32_t size) {
+  return crc16((char*)raw, size - 2) == wordSwap(*(const uint16_t*)(raw + size - 2));
+}
+
+// Squeezes the data bits (every other bit, starting with the second) of 8 bytes of MFM into 4 bytes
+static inline uint32_t stripClockBits(const uint8_t* mfm) {
+  uint64_t value = ((uint64_t)mfm[0] << 56) | ((uint64_t)mfm[1] << 48) | ((uint64_t)mfm[2] << 40) | ((uint64_t)mfm[3] << 32) |
+                   ((uint64_t)mfm[4] << 24) | ((uint64_t)mfm[5] << 16) | ((uint64_t)mfm[6] << 8) | (uint64_t)mfm[7];
+  value &= 0x5555555555555555ULL;
+  value = (value | (value >> 1)) & 0x3333333333333333ULL;
+  value = (value | (value >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+  value = (value | (value >> 4)) & 0x00FF00FF00FF00FFULL;
+  value = (value | (value >> 8)) & 0x0000FFFF0000FFFFULL;
+  return (uint32_t)(value | (value >> 16));
 }
 
 // Extract the data, properly aligned into the output
 void extractMFMDecodeRaw(const unsigned char* inTrack, const uint32_t dataLengthInBits, const uint32_t bitPos, uint32_t outputBytes, uint8_t* output) {
-  unsigned char byteOut = 0;
-  unsigned int byteOutPosition = 0;
-
-  uint32_t realBitPos = bitPos+1;  // the +1 skips past the clock bit
+  if (!dataLengthInBits) return;
 
-  unsigned char* memOut = output;
+  // The MFM is pulled out byte aligned a block at a time and then the clock bits are dropped
+  uint8_t mfm[256 + 8];
+  uint32_t realBitPos = bitPos;
 
   while (outputBytes) {
-    for (uint32_t bit = 0; bit <= 7; bit++) {
-      *memOut <<= 1;
-      const uint32_t trackBytePos = realBitPos >> 3;
-      const uint32_t trackBitPos = 7 - (realBitPos & 7);
-      if (inTrack[trackBytePos] & (1 << trackBitPos)) *memOut |= 1;
-      realBitPos = (realBitPos + 2) % dataLengthInBits;  // skip those clock bits
+    const uint32_t blockBytes = std::min<uint32_t>(outputBytes, 256 / 2);
+    extractTrackBits(inTrack, dataLengthInBits, realBitPos, blockBytes * 2, mfm);
+    memset(mfm + blockBytes * 2, 0, 8);
+    for (uint32_t pos = 0; pos < blockBytes; pos += 4) {
+      const uint32_t data = stripClockBits(mfm + pos * 2);
+      for (uint32_t i = 0; (i < 4) && (pos + i < blockBytes); i++) output[pos + i] = (uint8_t)(data >> (24 - i * 8));
     }
-    // Move along and reset
-    memOut++;
-    outputBytes--;
+    realBitPos = (realBitPos + blockBytes * 16) % dataLengthInBits;
+    output += blockBytes;
+    outputBytes -= blockBytes;
   }
 }
 
 // Searches for sectors - you can re-call this and it will update decodedTrack rather than replace it
 // nonstandardTimings is set to true if this uses non-standard timings like those used by Atari etc
-void findSectors_IBM(const uint8_t* track, const uint32_t dataLengthInBits, const bool isHD, const uint32_t trackNumber, const uint32_t expectedNumSectors, DecodedTrack& decodedTrack, bool& nonstandardTimings) {
+void findSectors_IBM(const uint8_t* track, const uint32_t dataLengthInBits, const bool isHD, const uint32_t trackNumber, const uint32_t expectedNumSectors, DecodedTrack& decodedTrack, bool& nonstandardTimings, SectorFusion* fusion) {
   const uint32_t cylinder = trackNumber / 2;
+  if (fusion) fusion->begin(trackNumber);
   const bool upperSide = trackNumber & 1;
 
   // Prepare our test buffer
@@ -253,39 +297,50 @@ void findSectors_IBM(const uint8_t* track, const uint32_t dataLengthInBits, cons
     break;
     case MFM_SYNC_DELETED_SECTOR_DATA:
     case MFM_SYNC_SECTOR_DATA: {
-      if (headerFound) {
+      if (headerFound && (sector.header.length <= IBM_MAX_SECTOR_LENGTH)) {
 	const uint32_t sectorDataSize = 1 << (7 + sector.header.length);
-	if (sector.data.data.size() != sectorDataSize) sector.data.data.resize(sectorDataSize);
 	uint32_t bitStart = bit + 1 - 64;
 	// Extract the header section
 	extractMFMDecodeRaw(track, dataLengthInBits, bitStart, 4, (uint8_t*)&sector.data.dataMark);
 	// Extract the sector data
 	bitStart += 4 * 8 * 2;
-	extractMFMDecodeRaw(track, dataLengthInBits, bitStart, (uint32_t)sector.data.data.size(), (uint8_t*)&sector.data.data[0]);
+	extractMFMDecodeRaw(track, dataLengthInBits, bitStart, sectorDataSize, (uint8_t*)sector.data.data);
 	// Extract the sector CRC
 	bitStart += sectorDataSize * 8 * 2;
 	extractMFMDecodeRaw(track, dataLengthInBits, bitStart, 2, (uint8_t*)&sector.data.crc);
 	// Validate
 	uint16_t crc = crc16((char*)&sector.data.dataMark, 4);
-	crc = crc16((char*)sector.data.data.data(), (uint32_t)sector.data.data.size(), crc);
+	crc = crc16((char*)sector.data.data, sectorDataSize, crc);
 	sector.dataValid = crc == wordSwap(*(uint16_t*)sector.data.crc);
+	const uint32_t sec = sector.header.sector - 1;
+
+	// Only the data is bad, see if it can be rebuilt from the earlier bad copies
+	if (fusion && (!sector.headerErrors)) {
+	  if (sector.dataValid) fusion->discard(sec);
+	  else if (sectorDataSize + 6 <= FUSION_MAX_BYTES) {
+	    uint8_t raw[FUSION_MAX_BYTES];
+	    memcpy(raw, sector.data.dataMark, 4);
+	    memcpy(raw + 4, sector.data.data, sectorDataSize);
+	    memcpy(raw + 4 + sectorDataSize, sector.data.crc, 2);
+	    if (fusion->fuse(sec, raw, sectorDataSize + 6, ibmFusionCheck, raw)) {
+	      memcpy(sector.data.data, raw + 4, sectorDataSize);
+	      sector.dataValid = true;
+	    }
+	  }
+	}
 
 	// Standardize the sector
-	DecodedSector sec;
-	sec.data = sector.data.data;
-	sec.numErrors = sector.headerErrors + sector.dataValid ? 0 : 1;
+	const uint32_t numErrors = sector.headerErrors + (sector.dataValid ? 0 : 1);
 
 	// See if this already exists
-	auto it = decodedTrack.sectors.find(sector.header.sector - 1);
-	if (it == decodedTrack.sectors.end()) {
+	if (!decodedTrack.has(sec)) {
 	  if (sector.header.sector <= 22)
-	    decodedTrack.sectors.insert(std::make_pair(sector.header.sector - 1, sec));
+	    decodedTrack.set(sec, sector.data.data, sectorDataSize, numErrors);
 	}
 	else {
 	  // Does exist. Keep the better copy
-	  if (it->second.numErrors > sec.numErrors) {
-	    it->second.data = sec.data;
-	    it->second.numErrors = sec.numErrors;
+	  if ((decodedTrack.numErrors[sec] > numErrors) && (decodedTrack.sectorSize == sectorDataSize)) {
+	    decodedTrack.replace(sec, sector.data.data, numErrors);
 	  }
 	}
 
@@ -310,41 +365,50 @@ void findSectors_IBM(const uint8_t* track, const uint32_t dataLengthInBits, cons
   }
 
 
-  const uint32_t sectorDataSize = 1 << (7 + sector.header.length);
+  // Dummies match whatever the track already holds
+  const uint32_t sectorDataSize = decodedTrack.present ? decodedTrack.sectorSize :
+                                  (sector.header.length <= IBM_MAX_SECTOR_LENGTH) ? (1U << (7 + sector.header.length)) : DEFAULT_SECTOR_BYTES;
 
   // Add dummy sectors upto expectedSectors
   decodedTrack.sectorsWithErrors = 0;
   for (uint32_t sec = 0; sec <expectedSectors; sec++) {
-    auto it = decodedTrack.sectors.find(sec);
-
     // Does a sector with this number exist?
-    if (it == decodedTrack.sectors.end()) {
+    if (!decodedTrack.has(sec)) {
       if (expectedNumSectors) {
 	// No. Create a dummy one - VERY NOT IDEAL!
-	DecodedSector tmp;
-	tmp.data.resize(sectorDataSize);
-	memset(&tmp.data[0], 0, sizeof(tmp));
-	tmp.numErrors = 0xFFFF;
-	decodedTrack.sectors.insert(std::make_pair(sec, tmp));
+	uint8_t* data = decodedTrack.add(sec, sectorDataSize, 0xFFFF);
+	if (data) memset(data, 0, sectorDataSize);
 	decodedTrack.sectorsWithErrors++;
       }
     }
     else
-	if (it->second.numErrors) decodedTrack.sectorsWithErrors++;
+	if (decodedTrack.numErrors[sec]) decodedTrack.sectorsWithErrors++;
   }
 }
 // Find sectors (one less parameter)
-void findSectors_IBM(const uint8_t* track, const uint32_t dataLengthInBits, const bool isHD, const uint32_t trackNumber, const uint32_t expectedNumSectors, DecodedTrack& decodedTrack) {
+void findSectors_IBM(const uint8_t* track, const uint32_t dataLengthInBits, const bool isHD, const uint32_t trackNumber, const uint32_t expectedNumSectors, DecodedTrack& decodedTrack, SectorFusion* fusion) {
   bool tmp;
-  findSectors_IBM(track, dataLengthInBits, isHD, trackNumber, expectedNumSectors, decodedTrack, tmp);
+  findSectors_IBM(track, dataLengthInBits, isHD, trackNumber, expectedNumSectors, decodedTrack, tmp, fusion);
 }
 
 // The fill is 0x4E, which endoded as MFM is
 uint32_t gapFillMFM(uint8_t* mem, const uint32_t size, const uint8_t value, uint8_t& lastByte, uint8_t* memOverflow) {
-  std::vector<uint8_t> data;
   if (size < 1) return 0;
-  data.resize(size, value);
-  return encodeMFMdata(data.data(), mem, (uint32_t)data.size(), lastByte, memOverflow);
+  if (mem >= memOverflow) return 0;
+  const uint32_t fill = std::min<uint32_t>(size, (uint32_t)(memOverflow - mem) / 2);
+  if (!fill) return 0;
+
+  // Only the first byte depends on what came before, after that it's the same two bytes over and over
+  const uint16_t first = encodeMFMbyte(value, lastByte);
+  const uint16_t rest = encodeMFMbyte(value, value);
+  mem[0] = (uint8_t)(first >> 8);
+  mem[1] = (uint8_t)first;
+  for (uint32_t b = 1; b < fill; b++) {
+    mem[b * 2] = (uint8_t)(rest >> 8);
+    mem[b * 2 + 1] = (uint8_t)rest;
+  }
+  lastByte = value;
+  return fill << 1;
 }
 
 // The fill is 0x4E, which endoded as MFM is
@@ -392,7 +456,7 @@ uint32_t encodeSectorsIntoMFM_IBM(const bool isHD, bool forceAtariTiming, Decode
   uint8_t gap4bSize = 182;   // 0x4E - after all sectors
   bool writeTrackHeader = true;
 
-  if (decodedTrack->sectors.size() > 21) return 0;
+  if (decodedTrack->count() > 21) return 0;
 
   // NOTE: ALL OF THE ATARI TIMINGS NEED CHECKING!
   if (forceAtariTiming) {
@@ -402,7 +466,7 @@ uint32_t encodeSectorsIntoMFM_IBM(const bool isHD, bool forceAtariTiming, Decode
     gap4bSize = 60;
   }
 
-  switch (decodedTrack->sectors.size()) {
+  switch (decodedTrack->count()) {
   case 10: // double density atari
     gap3Size = 40;
     forceAtariTiming = true;
@@ -445,8 +509,9 @@ uint32_t encodeSectorsIntoMFM_IBM(const bool isHD, bool forceAtariTiming, Decode
     mem += writeMarkerMFM(mem, MFM_SYNC_TRACK_HEADER, lastByte, memOverflow);
   }
   mem += gapFillMFM(mem, gap1Size, 0x4E, lastByte, memOverflow);
-  for (uint32_t sec = 0; sec < decodedTrack->sectors.size(); sec++) {
-    const DecodedSector& sector = decodedTrack->sectors[sec];
+  const uint32_t sectorDataSize = decodedTrack->sectorSize;
+  for (uint32_t sec = 0; sec < decodedTrack->count(); sec++) {
+    const uint8_t* sectorData = decodedTrack->data(sec);
 
     mem += writeRawMFM(mem, 24, 0xAA, lastByte, memOverflow);
 
@@ -458,7 +523,7 @@ uint32_t encodeSectorsIntoMFM_IBM(const bool isHD, bool forceAtariTiming, Decode
     header.cylinder = cylinder;
     header.head = upperSide ? 1 : 0;
     header.sector = sec + 1;
-    header.length = (unsigned char)(std::max(0,(int)log2(sector.data.size()) - 7));
+    header.length = (unsigned char)(std::max(0,(int)log2(sectorDataSize) - 7));
     *((uint16_t*)header.crc) = wordSwap(crc16((char*)&header, sizeof(header) - 2));
 
     mem += writeMarkerMFM(mem, MFM_SYNC_SECTOR_HEADER, lastByte, memOverflow);
@@ -469,10 +534,10 @@ uint32_t encodeSectorsIntoMFM_IBM(const bool isHD, bool forceAtariTiming, Decode
     // Need this just for the CRC
     const uint8_t dataMark[4] = { 0xA1, 0xA1, 0xA1, 0xFB };
     uint16_t crc = crc16((char*)&dataMark, 4);
-    crc = wordSwap(crc16((char*)sector.data.data(), (int)sector.data.size(), crc));
+    crc = wordSwap(crc16((char*)sectorData, (int)sectorDataSize, crc));
 
     mem += writeMarkerMFM(mem, MFM_SYNC_SECTOR_DATA, lastByte, memOverflow);
-    mem += encodeMFMdata(sector.data.data(), mem, (uint32_t)sector.data.size(), lastByte, memOverflow);
+    mem += encodeMFMdata(sectorData, mem, sectorDataSize, lastByte, memOverflow);
     mem += encodeMFMdata((uint8_t*)&crc, mem, sizeof(crc), lastByte, memOverflow);
 
     mem += gapFillMFM(mem, gap3Size, 0x4E, lastByte, memOverflow);
@@ -510,10 +575,9 @@ bool getTrackDetails_IBM(const DecodedTrack* decodedTrack, uint32_t& serialNumbe
   serialNumber = 0;
 
   if (!decodedTrack) return false;
-  auto it = decodedTrack->sectors.find (0);
-  if (it == decodedTrack->sectors.end ()) return false;
-  if (it->second.data.size () < 128) return false;
-  return getTrackDetails_IBM (it->second.data.data (), serialNumber, numHeads, totalSectors, sectorsPerTrack, bytesPerSector);
+  if (!decodedTrack->has (0)) return false;
+  if (decodedTrack->sectorSize < 128) return false;
+  return getTrackDetails_IBM (decodedTrack->data (0), serialNumber, numHeads, totalSectors, sectorsPerTrack, bytesPerSector);
 }
 // Create the disk and return its memory. memSize is poulated with it's size. call free() on it when done
 uint8_t* createBasicDisk(const std::string& label, const uint32_t numTracks, const uint32_t numSectors, const uint32_t numHeads, uint32_t* memSize) {
@@ -18,6 +18,7 @@
 #include <stdint.h>
 #include <unordered_map>
 #include "sectorCommon.h"
+#include "sectorFusion.h"
 #include "sectorCache.h"
 #include <ff.h>
 
@@ -27,8 +28,21 @@ bool getTrackDetails_IBM(const DecodedTrack* decodedTrack, uint32_t& serialNumbe
 
 // Searches for sectors - you can re-call this and it will update decodedTrack rather than replace it
 // nonstandardTimings is set to true if this uses non-standard timings like those used by Atari etc
-void findSectors_IBM(const uint8_t* track, const uint32_t dataLengthInBits, const bool isHD, const uint32_t trackNumber, const uint32_t expectedNumSectors, DecodedTrack& decodedTrack, bool& nonstandardTimings);
-void findSectors_IBM(const uint8_t* track, const uint32_t dataLengthInBits, const bool isHD, const uint32_t trackNumber, const uint32_t expectedNumSectors, DecodedTrack& decodedTrack);
+// With fusion set, sectors that fail their CRC are voted on together with the bad copies from earlier calls
+void findSectors_IBM(const uint8_t* track, const uint32_t dataLengthInBits, const bool isHD, const uint32_t trackNumber, const uint32_t expectedNumSectors, DecodedTrack& decodedTrack, bool& nonstandardTimings, SectorFusion* fusion = nullptr);
+void findSectors_IBM(const uint8_t* track, const uint32_t dataLengthInBits, const bool isHD, const uint32_t trackNumber, const uint32_t expectedNumSectors, DecodedTrack& decodedTrack, SectorFusion* fusion = nullptr);
+
+// Decode outputBytes of MFM starting bitPos bits into the track, dropping the clock bits. The track wraps around at dataLengthInBits
+void extractMFMDecodeRaw(const unsigned char* inTrack, const uint32_t dataLengthInBits, const uint32_t bitPos, uint32_t outputBytes, uint8_t* output);
+
+// CRC16 (CCITT) as used by IBM sector headers and data, pass the result back in as wCrc to continue it
+uint16_t crc16(char* pData, int length, uint32_t wCrc = 0xFFFF);
+
+// MFM encode inputSize bytes following lastByte, as many whole bytes as fit before memOverflow. Returns the number of MFM bytes written
+uint32_t encodeMFMdata(const uint8_t* input, uint8_t* output, const uint32_t inputSize, uint8_t& lastByte, uint8_t* memOverflow);
+
+// MFM encode size copies of value, as encodeMFMdata would
+uint32_t gapFillMFM(uint8_t* mem, const uint32_t size, const uint8_t value, uint8_t& lastByte, uint8_t* memOverflow);
 
 // Encode the track supplied into a raw MFM bit-stream
 uint32_t encodeSectorsIntoMFM_IBM(const bool isHD, const bool forceAtariTiming, DecodedTrack* decodedTrack, const uint32_t trackNumber, uint32_t mfmBufferSizeBytes, void* trackData);
@@ -10,6 +10,44 @@ extern "C" {
 #endif
 int mount_drive(const char *floppyProfile);
 
+// Sector cache for the next mount_drive: cacheKb < 0 keeps the default, 0 disables it.
+// Resident keeps every sector of the disk in memory whatever the size
+void set_drive_cache(int cacheKb, int resident);
+
+// Milliseconds without access before pending tracks are flushed and the motor stops, < 0 keeps the default
+void set_drive_idle(int idleMs);
+
+// What a read does when a sector won't decode, must be called before mount_drive. It gives up after deadlineMs
+// (0 for no limit) or retries extra track reads, then fails with an I/O error or, with fill set, returns the
+// best copy it has with missing sectors zeroed. Negative values keep the defaults
+void set_drive_read_policy(int deadlineMs, int retries, int fill);
+
+// File the sectors that couldn't be read are remembered in, per disk, so they fail at once on the next mount.
+// NULL to not remember them. With recover set the entries of each disk inserted are cleared and bad sectors
+// are retried on every read
+void set_drive_bad_sector_file(const char *filename, int recover);
+
+// Directory the decoded tracks of each disk are kept in, so a disk seen before is ready after reading two tracks.
+// NULL to not keep them
+void set_drive_disk_cache(const char *directory);
+
+// Called from the drive monitor when a disk is inserted or removed
+void set_disk_change_callback(void (*callback)(int diskInserted));
+
+// In write-back mode FatFs syncs only reach the sector cache, sync_drive commits them to the disk
+void set_drive_writeback(int enable);
+int sync_drive(void);
+
+// Total number of cylinders the head has stepped since mounting
+unsigned long long drive_seek_distance(void);
+
+// Histogram of reads that had to go to the drive: bucket 0 is < 1ms, bucket n < 2^n ms, the last one anything longer.
+// Returns the number of buckets filled
+int drive_read_latency(unsigned long long *buckets, int count);
+
+// Number of sectors that couldn't be read on the current disk
+unsigned int drive_bad_sectors(void);
+
 #ifdef __cplusplus
 }
 #endif
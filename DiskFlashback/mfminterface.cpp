@@ -17,8 +17,23 @@
 #include "ibm_sectors.h"
 #include <csignal>
 #include <cstring>
+#include <cstdio>
+#include <cinttypes>
 #include <safe_mem_lib.h>
 #include <stdio.h>
+#include <bit>
+
+uint64_t GetTickCount64() {
+  using namespace std::chrono;
+  auto now = steady_clock::now();
+  auto duration = now.time_since_epoch();
+  return duration_cast<milliseconds>(duration).count();
+}
+
+// Fixed delays for the mechanics, such as letting the head settle after a seek
+static void delayMs(uint32_t milliseconds) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+}
 
 void SectorCacheMFM::releaseDrive() {
     if (m_diskInDrive) {
@@ -34,7 +49,7 @@ bool SectorCacheMFM::initDrive() {
     m_diskType = SectorType::stUnknown;
     m_motorTurnOnTime = 0;
     m_diskInDrive = false;
-    m_alwaysIgnore = false;
+    m_headCylinder = -1;
 
     if (!restoreDrive()) 
         return false;
@@ -47,20 +62,49 @@ void SectorCacheMFM::resetCache() {
     SectorCacheEngine::resetCache();
 
     std::lock_guard<std::mutex> bridgeLock(m_motorTimerProtect);
-    m_tracksToFlush.clear();
-    for (uint32_t systems = 0; systems < 2; systems++)
-        for (DecodedTrack& trk : m_trackCache[systems]) trk.sectors.clear();
+    {
+        std::lock_guard<std::mutex> pendingLock(m_pendingLock);
+        m_tracksToFlush.clear();
+        m_stagedWrites.clear();
+        m_writerFailed = false;
+    }
+    m_flushDone.notify_all();
+    for (uint32_t systems = 0; systems < 2; systems++) {
+        for (DecodedTrack& trk : m_trackCache[systems]) trk.clear();
+        m_fusion[systems].reset();
+    }
+    saveBadSectors();
+    saveDiskCache();
+    m_badSectors.clear();
+    m_diskFingerprint = 0;
 }
 
-// Flush changes to disk
+// Flush changes to disk, waits until the writer thread has committed everything pending
 bool SectorCacheMFM::flushWriteCache() {
-    std::lock_guard<std::mutex> bridgeLock(m_motorTimerProtect);
-    return flushPendingWrites();
+    std::future<bool> done;
+    {
+        std::unique_lock<std::mutex> pendingLock(m_pendingLock);
+        if (!m_writerRunning) {
+            pendingLock.unlock();
+            std::lock_guard<std::mutex> bridgeLock(m_motorTimerProtect);
+            return flushPendingWrites();
+        }
+        if (m_tracksToFlush.empty()) {
+            // Report a background flush that failed since the last time, once
+            const bool ok = !m_writerFailed;
+            m_writerFailed = false;
+            return ok;
+        }
+        m_flushWaiters.emplace_back();
+        done = m_flushWaiters.back().get_future();
+    }
+    m_writerSignal.notify_one();
+    return done.get();
 }
 
 // Constructor
 SectorCacheMFM::SectorCacheMFM(std::function<void(bool diskInserted, SectorType diskFormat)> diskChangeCallback) :
-    SectorCacheEngine(0), m_motorTurnOnTime(0), m_timer(0), m_diskChangeCallback(diskChangeCallback) {
+    SectorCacheEngine(DEFAULT_SECTOR_CACHE_MEM), m_motorTurnOnTime(0), m_timer(0), m_diskChangeCallback(diskChangeCallback) {
 
     m_mfmBuffer = malloc(MAX_TRACK_SIZE);
     if (!m_mfmBuffer) return;
@@ -71,21 +115,173 @@ void SectorCacheMFM::setReady() {
 
     if (isDiskInDrive()) identifyFileSystem();
 
-    // Force m_sectorsPerTrack to be populated
+    // The motor monitor, prefetch and writer threads
+    startWorkers();
+}
+
+// Start the background threads
+void SectorCacheMFM::startWorkers() {
     {
-        std::lock_guard<std::mutex> bridgeLock(m_motorTimerProtect);
+        std::lock_guard<std::mutex> lock(m_prefetchLock);
+        if (!m_prefetchThread.joinable()) {
+            m_prefetchQuit = false;
+            m_prefetchThread = std::thread(&SectorCacheMFM::prefetchThread, this);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> pendingLock(m_pendingLock);
+        if (!m_writerThread.joinable()) {
+            m_writerQuit = false;
+            m_writerRunning = true;
+            m_writerThread = std::thread(&SectorCacheMFM::writerThread, this);
+        }
+    }
+    std::lock_guard<std::mutex> lock(m_monitorLock);
+    if (!m_monitorThread.joinable())
+        m_monitorThread = std::jthread([this](std::stop_token stop) { monitorThread(stop); });
+}
+
+// Stop the background threads, safe to call more than once
+void SectorCacheMFM::stopWorkers() {
+    // The monitor first, it can flush and read the disk
+    if (m_monitorThread.joinable()) {
+        m_monitorThread.request_stop();
+        m_monitorThread.join();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_prefetchLock);
+        m_prefetchQuit = true;
+        m_prefetchQueue.clear();
+    }
+    m_prefetchSignal.notify_all();
+    if (m_prefetchThread.joinable()) m_prefetchThread.join();
+
+    {
+        std::lock_guard<std::mutex> pendingLock(m_pendingLock);
+        m_writerQuit = true;
+    }
+    m_writerSignal.notify_all();
+    if (m_writerThread.joinable()) m_writerThread.join();
+}
+
+// Wait until the motor could have gone idle or the disk needs checking, then run the monitor
+void SectorCacheMFM::monitorThread(std::stop_token stop) {
+    std::unique_lock<std::mutex> lock(m_monitorLock);
+    while (!stop.stop_requested()) {
+        uint64_t waitTime = DISK_CHANGE_POLL_TIME;
+        const uint64_t now = GetTickCount64();
+        for (const uint64_t lastUse : { (uint64_t)m_motorTurnOnTime, (uint64_t)m_lastStagedWrite }) {
+            if (!lastUse) continue;
+            const uint64_t idleAt = lastUse + m_motorIdleTimeout;
+            waitTime = std::min(waitTime, (idleAt > now) ? idleAt - now : 0);
+        }
+        // Wakes early if stopped or the idle timeout is changed
+        if (waitTime) m_monitorSignal.wait_for(lock, stop, std::chrono::milliseconds(waitTime), [&stop]() { return stop.stop_requested(); });
+        if (stop.stop_requested()) break;
+
+        lock.unlock();
+        motorMonitor();
+        lock.lock();
+    }
+}
+
+// Commit pending tracks in the background. A flush request from flushWriteCache writes the lot in one go,
+// otherwise the backlog is written in passes that let waiting reads in. Only the pass holds the bridge lock,
+// writers keep staging into m_stagedWrites while it runs
+void SectorCacheMFM::writerThread() {
+    std::unique_lock<std::mutex> pendingLock(m_pendingLock);
+    for (;;) {
+        m_writerSignal.wait(pendingLock, [this]() {
+            return m_writerQuit || !m_flushWaiters.empty() || ((m_tracksToFlush.size() >= FORCE_FLUSH_AT_TRACKS) && (!m_writerFailed));
+        });
+        if (m_writerQuit) break;
+
+        std::vector<std::promise<bool>> waiters;
+        waiters.swap(m_flushWaiters);
+        pendingLock.unlock();
+        bool ok;
+        {
+            std::lock_guard<std::mutex> bridgeLock(m_motorTimerProtect);
+            ok = flushPendingWrites(waiters.empty());
+        }
+        pendingLock.lock();
+
+        if (!waiters.empty()) {
+            m_writerFailed = false;
+            for (auto& waiter : waiters) waiter.set_value(ok);
+        }
+        else m_writerFailed = !ok;
+        m_flushDone.notify_all();
+
+        // Give waiting reads a chance at the drive before the next pass
+        pendingLock.unlock();
+        std::this_thread::yield();
+        pendingLock.lock();
+    }
+
+    m_writerRunning = false;
+    for (auto& waiter : m_flushWaiters) waiter.set_value(false);
+    m_flushWaiters.clear();
+    m_flushDone.notify_all();
+}
+
+// Returns TRUE if every sector of the track is cached without errors
+bool SectorCacheMFM::isTrackComplete(const uint32_t fileSystem, const uint32_t track) {
+    const DecodedTrack& trk = m_trackCache[fileSystem][track];
+    if (trk.count() < m_sectorsPerTrack[fileSystem]) return false;
+    for (uint32_t sec = 0; sec < MAX_DECODED_SECTORS; sec++)
+        if (trk.has(sec) && trk.numErrors[sec]) return false;
+    return true;
+}
+
+// Sequential access (same or next track as last time) reads ahead, anything else cancels the read-ahead
+void SectorCacheMFM::schedulePrefetch(const uint32_t fileSystem, const uint32_t track) {
+    const int64_t lastTrack = m_lastReadTrack[fileSystem];
+    m_lastReadTrack[fileSystem] = track;
+    if ((int64_t)track == lastTrack) return;
 
-//      	timer_t timerid;
-//	sigevent sev;
-//	if (timer_create(CLOCK_REALTIME, &sev, &timerid) == -1) {
-//	  perror("timer_create");
-//	  exit(EXIT_FAILURE);
-//	}
-//
-//	m_timerQueue.push_back (timerid);
-//        CreateTimerQueueTimer(&m_timer, m_timerQueue, MotorMonitor, this, 1000, 200, WT_EXECUTEDEFAULT | WT_EXECUTELONGFUNCTION);
+    const bool sequential = (int64_t)track == lastTrack + 1;
+    const uint32_t totalTracks = m_totalCylinders[fileSystem] ? std::min((uint32_t)MAX_TRACKS, m_totalCylinders[fileSystem] * m_numHeads[fileSystem]) : MAX_TRACKS;
+    {
+        std::lock_guard<std::mutex> lock(m_prefetchLock);
+        m_prefetchQueue.clear();
+        if (sequential)
+            for (uint32_t ahead = 1; ahead <= PREFETCH_TRACKS; ahead++)
+                if (track + ahead < totalTracks)
+                    m_prefetchQueue.push_back(std::make_pair(fileSystem, track + ahead));
     }
+    if (sequential) m_prefetchSignal.notify_one();
+}
+
+// Read queued tracks. The bridge lock is taken per track, so demand reads get in between
+void SectorCacheMFM::prefetchThread() {
+    for (;;) {
+        uint32_t fileSystem, track;
+        {
+            std::unique_lock<std::mutex> lock(m_prefetchLock);
+            m_prefetchSignal.wait(lock, [this]() { return m_prefetchQuit || !m_prefetchQueue.empty(); });
+            if (m_prefetchQuit) return;
+            fileSystem = m_prefetchQueue.front().first;
+            track = m_prefetchQueue.front().second;
+            m_prefetchQueue.pop_front();
+        }
 
+        std::lock_guard<std::mutex> bridgeLock(m_motorTimerProtect);
+        if ((!m_diskInDrive) || (m_diskType == SectorType::stUnknown) || (m_blockWriting)) continue;
+        if (track >= MAX_TRACKS) continue;
+        // Already there, or about to be overwritten anyway
+        if (isTrackComplete(fileSystem, track)) continue;
+        if ((fileSystem == 0) && (isTrackPending(track))) continue;
+
+        const bool upperSurface = track % m_numHeads[fileSystem];
+        motorInUse(upperSurface);
+        headSeek(track / m_numHeads[fileSystem], upperSurface);
+        if (!waitForMotor(upperSurface)) continue;
+
+        // A single attempt, errors are left for the demand read to retry
+        doTrackReading(fileSystem, track, false);
+    }
 }
 
 // Reads some data to see what kind of disk it is
@@ -96,10 +292,9 @@ void SectorCacheMFM::identifyFileSystem() {
         m_totalCylinders[i] = 0;
         m_numHeads[i] = 2;
     }
-    m_alwaysIgnore = false;
     std::lock_guard<std::mutex> bridgeLock(m_motorTimerProtect);
     m_diskType = SectorType::stUnknown;
-    cylinderSeek(0, false);
+    headSeek(0, false);
     motorInUse(true);
     if (waitForMotor(false)) {
         for (uint32_t retries = 0; retries < 5; retries++) {
@@ -108,19 +303,268 @@ void SectorCacheMFM::identifyFileSystem() {
                     break;
         }
     }
+    if (m_diskType != SectorType::stUnknown) {
+        computeFingerprint();
+        loadBadSectors();
+        loadDiskCache();
+    }
 }
 
+// Identify the disk from its boot sector, serial number and geometry
+void SectorCacheMFM::computeFingerprint() {
+    // FNV-1a
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    auto mix = [&hash](const void* data, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            hash ^= ((const uint8_t*)data)[i];
+            hash *= 0x100000001B3ULL;
+        }
+    };
+    const DecodedTrack& boot = m_trackCache[0][0];
+    if ((boot.has(0)) && (boot.numErrors[0] == 0)) mix(boot.data(0), boot.sectorSize);
+    const uint32_t type = (uint32_t)m_diskType;
+    mix(&type, sizeof(type));
+    mix(m_serialNumber, sizeof(m_serialNumber));
+    mix(m_totalCylinders, sizeof(m_totalCylinders));
+    mix(m_numHeads, sizeof(m_numHeads));
+    mix(m_sectorsPerTrack, sizeof(m_sectorsPerTrack));
+    mix(m_bytesPerSector, sizeof(m_bytesPerSector));
+    m_diskFingerprint = hash ? hash : 1;
+}
 
-// Return TRUE if theres a disk in the drive
-bool SectorCacheMFM::isDiskPresent() {
+// Fetch what's known about this disk from the bad sector file
+void SectorCacheMFM::loadBadSectors() {
+    m_badSectors.clear();
+    m_badSectorsDirty = false;
+    if ((m_badSectorFile.empty()) || (!m_diskFingerprint)) return;
+
+    // Start again with this disk, the next save drops it from the file
+    if (m_recoverHarder) {
+        m_badSectorsDirty = true;
+        return;
+    }
+
+    FILE* f = fopen(m_badSectorFile.c_str(), "r");
+    if (!f) return;
+    char line[128];
+    while (fgets(line, sizeof(line), f)) {
+        uint64_t fingerprint;
+        uint32_t key, errors;
+        if (sscanf(line, "%" SCNx64 " %u %u", &fingerprint, &key, &errors) != 3) continue;
+        if (fingerprint == m_diskFingerprint) m_badSectors[key] = errors;
+    }
+    fclose(f);
+}
+
+// Rewrite the bad sector file with this disk's entries last, so the disks not seen for longest drop out first
+void SectorCacheMFM::saveBadSectors() {
+    if ((!m_badSectorsDirty) || (m_badSectorFile.empty()) || (!m_diskFingerprint)) return;
+    m_badSectorsDirty = false;
+
+    // Everything else in the file, grouped by disk in the order they were saved
+    std::vector<uint64_t> disks;
+    std::multimap<uint64_t, std::string> others;
+    if (FILE* f = fopen(m_badSectorFile.c_str(), "r")) {
+        char line[128];
+        while (fgets(line, sizeof(line), f)) {
+            uint64_t fingerprint;
+            uint32_t key, errors;
+            if (sscanf(line, "%" SCNx64 " %u %u", &fingerprint, &key, &errors) != 3) continue;
+            if (fingerprint == m_diskFingerprint) continue;
+            if (others.find(fingerprint) == others.end()) disks.push_back(fingerprint);
+            others.insert(std::make_pair(fingerprint, std::string(line)));
+        }
+        fclose(f);
+    }
+
+    const std::string temp = m_badSectorFile + ".tmp";
+    FILE* f = fopen(temp.c_str(), "w");
+    if (!f) return;
+    const size_t keep = m_badSectors.empty() ? BAD_SECTOR_DISKS : BAD_SECTOR_DISKS - 1;
+    for (size_t i = (disks.size() > keep) ? disks.size() - keep : 0; i < disks.size(); i++) {
+        auto range = others.equal_range(disks[i]);
+        for (auto it = range.first; it != range.second; ++it) fputs(it->second.c_str(), f);
+    }
+    for (const auto& bad : m_badSectors)
+        fprintf(f, "%016" PRIx64 " %u %u\n", m_diskFingerprint, bad.first, bad.second);
+    const bool ok = fclose(f) == 0;
+    if ((!ok) || (rename(temp.c_str(), m_badSectorFile.c_str()) != 0)) remove(temp.c_str());
+}
+
+// Layout of a disk cache file: the header, then each track followed by its sectors in order
+#define DISK_CACHE_MAGIC   0x43545747   // GWTC
+#define DISK_CACHE_VERSION 1
+struct DiskCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t fingerprint;
+    uint32_t sectorsPerTrack[2];
+    uint32_t bytesPerSector[2];
+    uint32_t numTracks;
+};
+struct DiskCacheTrack {
+    uint32_t key;           // file system * MAX_TRACKS + track
+    uint32_t present;
+    uint32_t sectorSize;
+};
+
+std::string SectorCacheMFM::diskCacheFilename() const {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016" PRIx64 ".trk", m_diskFingerprint);
+    return m_diskCacheDir + name;
+}
+
+// Read one track from a disk cache file into target
+static bool readDiskCacheTrack(FILE* f, uint32_t& key, DecodedTrack& target) {
+    DiskCacheTrack entry;
+    if (fread(&entry, sizeof(entry), 1, f) != 1) return false;
+    if ((!entry.sectorSize) || (entry.sectorSize > MAX_DECODED_TRACK_BYTES)) return false;
+    if ((entry.key >= 2 * MAX_TRACKS) || (entry.present >> MAX_DECODED_SECTORS)) return false;
+    if (std::popcount(entry.present) * entry.sectorSize > MAX_DECODED_TRACK_BYTES) return false;
+    target.clear();
+    for (uint32_t sec = 0; sec < MAX_DECODED_SECTORS; sec++) {
+        if (!(entry.present & (1U << sec))) continue;
+        uint8_t* data = target.add(sec, entry.sectorSize, 0);
+        if ((!data) || (fread(data, entry.sectorSize, 1, f) != 1)) return false;
+    }
+    key = entry.key;
+    return true;
+}
+
+// TRUE if two tracks hold the same clean sectors
+static bool sameTrack(const DecodedTrack& a, const DecodedTrack& b) {
+    if ((a.present != b.present) || (a.sectorSize != b.sectorSize)) return false;
+    for (uint32_t sec = 0; sec < MAX_DECODED_SECTORS; sec++) {
+        if (!a.has(sec)) continue;
+        if ((a.numErrors[sec]) || (b.numErrors[sec])) return false;
+        if (memcmp(a.data(sec), b.data(sec), a.sectorSize)) return false;
+    }
+    return true;
+}
+
+// The disk has been seen before? Check it hasn't been changed elsewhere and fill the track cache from the host
+void SectorCacheMFM::loadDiskCache() {
+    m_diskCacheDirty = false;
+    if ((m_diskCacheDir.empty()) || (!m_diskFingerprint)) return;
+
+    FILE* f = fopen(diskCacheFilename().c_str(), "rb");
+    if (!f) return;
+
+    DiskCacheHeader header;
+    bool ok = (fread(&header, sizeof(header), 1, f) == 1) && (header.magic == DISK_CACHE_MAGIC) && (header.version == DISK_CACHE_VERSION) &&
+              (header.fingerprint == m_diskFingerprint) && (header.numTracks >= 2) &&
+              (!memcmp(header.sectorsPerTrack, m_sectorsPerTrack, sizeof(m_sectorsPerTrack))) && (!memcmp(header.bytesPerSector, m_bytesPerSector, sizeof(m_bytesPerSector)));
+
+    // The first two are the boot track and the one the file system changes with any write (FAT and root directory,
+    // or the Amiga root block). Both have to match the disk
+    for (uint32_t i = 0; (i < 2) && (ok); i++) {
+        uint32_t key;
+        ok = readDiskCacheTrack(f, key, m_verifyTrack) && (key < MAX_TRACKS);
+        if (!ok) break;
+        if (!isTrackComplete(0, key)) {
+            const bool upperSurface = key % m_numHeads[0];
+            motorInUse(upperSurface);
+            headSeek(key / m_numHeads[0], upperSurface);
+            ok = waitForMotor(upperSurface) && doTrackReading(0, key, false);
+        }
+        ok = ok && sameTrack(m_trackCache[0][key], m_verifyTrack);
+    }
+
+    uint32_t loaded = 0;
+    for (uint32_t i = 2; (i < header.numTracks) && (ok); i++) {
+        uint32_t key;
+        if (!readDiskCacheTrack(f, key, m_verifyTrack)) break;
+        const uint32_t fileSystem = key / MAX_TRACKS;
+        const uint32_t track = key % MAX_TRACKS;
+        if (m_verifyTrack.count() != m_sectorsPerTrack[fileSystem]) continue;
+        if ((fileSystem == 0) && (isTrackPending(track))) continue;
+        if (isTrackComplete(fileSystem, track)) continue;
+        m_trackCache[fileSystem][track] = m_verifyTrack;
+        loaded++;
+    }
+    fclose(f);
+    m_diskCacheDirty = false;
+    if (loaded) fprintf(stderr, "Disk recognised, %u tracks from the host cache\n", loaded + 2);
+}
+
+// Keep the clean tracks of this disk for next time
+void SectorCacheMFM::saveDiskCache() {
+    if ((!m_diskCacheDirty) || (m_diskCacheDir.empty()) || (!m_diskFingerprint)) return;
+    m_diskCacheDirty = false;
+
+    // Nothing can be checked against without these two
+    const uint32_t totalTracks = m_totalCylinders[0] ? m_totalCylinders[0] * m_numHeads[0] : 160;
+    const uint32_t checkTrack = ((m_diskType == SectorType::stIBM) || (m_diskType == SectorType::stAtari)) ? 1 : totalTracks / 2;
+    if ((!isTrackComplete(0, 0)) || (!isTrackComplete(0, checkTrack))) return;
+
+    std::vector<uint32_t> keys = { 0, checkTrack };
+    const uint32_t systems = (m_diskType == SectorType::stHybrid) ? 2 : 1;
+    for (uint32_t fileSystem = 0; fileSystem < systems; fileSystem++)
+        for (uint32_t track = 0; track < MAX_TRACKS; track++) {
+            if ((fileSystem == 0) && ((track == 0) || (track == checkTrack))) continue;
+            // Not on the disk yet
+            if ((fileSystem == 0) && (isTrackPending(track))) continue;
+            if (isTrackComplete(fileSystem, track)) keys.push_back(fileSystem * MAX_TRACKS + track);
+        }
+    if ((isTrackPending(0)) || (isTrackPending(checkTrack))) return;
+
+    const std::string filename = diskCacheFilename();
+    const std::string temp = filename + ".tmp";
+    FILE* f = fopen(temp.c_str(), "wb");
+    if (!f) return;
+    DiskCacheHeader header;
+    header.magic = DISK_CACHE_MAGIC;
+    header.version = DISK_CACHE_VERSION;
+    header.fingerprint = m_diskFingerprint;
+    memcpy(header.sectorsPerTrack, m_sectorsPerTrack, sizeof(m_sectorsPerTrack));
+    memcpy(header.bytesPerSector, m_bytesPerSector, sizeof(m_bytesPerSector));
+    header.numTracks = (uint32_t)keys.size();
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (const uint32_t key : keys) {
+        const DecodedTrack& trk = m_trackCache[key / MAX_TRACKS][key % MAX_TRACKS];
+        const DiskCacheTrack entry = { key, trk.present, trk.sectorSize };
+        ok = ok && (fwrite(&entry, sizeof(entry), 1, f) == 1);
+        for (uint32_t sec = 0; (sec < MAX_DECODED_SECTORS) && (ok); sec++)
+            if (trk.has(sec)) ok = fwrite(trk.data(sec), trk.sectorSize, 1, f) == 1;
+    }
+    ok = (fclose(f) == 0) && ok;
+    if ((!ok) || (rename(temp.c_str(), filename.c_str()) != 0)) remove(temp.c_str());
+}
+
+// Where decoded tracks are kept between mounts
+void SectorCacheMFM::setDiskCacheDir(const std::string& directory) {
+    std::lock_guard<std::mutex> bridgeLock(m_motorTimerProtect);
+    saveDiskCache();
+    m_diskCacheDir = directory;
+    // The disk may already have been identified
+    loadDiskCache();
+}
+
+// Where the bad sector map is kept between mounts
+void SectorCacheMFM::setBadSectorFile(const std::string& filename, bool recoverHarder) {
     std::lock_guard<std::mutex> bridgeLock(m_motorTimerProtect);
+    saveBadSectors();
+    m_badSectorFile = filename;
+    m_recoverHarder = recoverHarder;
+    // The disk may already have been identified
+    loadBadSectors();
+}
+
+
+// Return TRUE if theres a disk in the drive - no lock, this is checked on every cached read
+bool SectorCacheMFM::isDiskPresent() {
     return m_diskInDrive;
 }
 
-// Return TRUE if the disk is write protected
+// Return TRUE if the disk is write protected. FatFs asks on every call, so only go to the drive now and again
 bool SectorCacheMFM::isDiskWriteProtected() {
+    const uint64_t now = GetTickCount64();
+    if (now - m_writeProtectChecked < WRITE_PROTECT_POLL_TIME) return m_writeProtected;
+
     std::lock_guard<std::mutex> bridgeLock(m_motorTimerProtect);
-    return isDriveWriteProtected();
+    m_writeProtected = isDriveWriteProtected();
+    m_writeProtectChecked = now;
+    return m_writeProtected;
 }
 
 // Return TRUE if you can export this to disk image
@@ -137,7 +581,9 @@ void SectorCacheMFM::overwriteSectorSettings(const SectorType systemType, const
         m_totalCylinders[0] = std::min((unsigned)totalCylinders,(unsigned) MAX_TRACKS / 2);
         m_numHeads[0] = totalHeads;
         m_diskType = systemType;
+        std::lock_guard<std::mutex> pendingLock(m_pendingLock);
         m_tracksToFlush.clear();
+        m_stagedWrites.clear();
     }
     resetCache();
 }
@@ -151,77 +597,120 @@ void SectorCacheMFM::triggerNewDiskMount() {
 
 // Pre-populate with blank sectors
 void SectorCacheMFM::createBlankSectors() {
-    DecodedSector blankSector;
-    blankSector.numErrors = 0;
-    blankSector.data.resize(m_bytesPerSector[0]);
-
+    m_badSectors.clear();
+    m_badSectorsDirty = true;
     for (uint32_t trk = 0; trk < m_totalCylinders[0] * m_numHeads[0]; trk++) {
-        m_trackCache[0][trk].sectorsWithErrors = 0;
-        m_trackCache[0][trk].sectors.clear();
-        for (uint32_t sec = 0; sec < m_sectorsPerTrack[0]; sec++)
-            m_trackCache[0][trk].sectors.insert(std::make_pair(sec, blankSector));
+        m_trackCache[0][trk].clear();
+        for (uint32_t sec = 0; sec < m_sectorsPerTrack[0]; sec++) {
+            uint8_t* data = m_trackCache[0][trk].add(sec, m_bytesPerSector[0], 0);
+            if (data) memset(data, 0, m_bytesPerSector[0]);
+        }
     }
 }
 
-uint64_t GetTickCount64() {
-  using namespace std::chrono;
-  auto now = steady_clock::now();
-  auto duration = now.time_since_epoch();
-  return duration_cast<milliseconds>(duration).count();
-}
-
 // The motor usage has timed out
 void SectorCacheMFM::motorMonitor() {
     bool sendNotify = false;
+    bool diskInserted = false;
     {
         // Shoudl it time out?
         std::lock_guard<std::mutex> bridgeLock(m_motorTimerProtect);
-        if ((m_motorTurnOnTime) && (GetTickCount64() - m_motorTurnOnTime > MOTOR_IDLE_TIMEOUT)) {
-            flushPendingWrites();
+        const uint64_t now = GetTickCount64();
+        const uint64_t lastWrite = m_lastStagedWrite;
+        const bool writesIdle = (lastWrite) && (now - lastWrite >= m_motorIdleTimeout);
+        const bool motorIdle = (m_motorTurnOnTime) && (now - m_motorTurnOnTime >= m_motorIdleTimeout);
+        if (writesIdle) m_lastStagedWrite = 0;
+        // Reported by the next flushWriteCache if it goes wrong
+        if ((writesIdle || motorIdle) && (hasPendingWrites()) && (!flushPendingWrites())) {
+            std::lock_guard<std::mutex> pendingLock(m_pendingLock);
+            m_writerFailed = true;
+        }
+        if (motorIdle) {
             motorEnable(false, false);
-            if (!m_alwaysIgnore) m_ignoreErrors = false;
             m_blockWriting = false;
             m_motorTurnOnTime = 0;
+            saveBadSectors();
+            saveDiskCache();
         }
 
         // Force writing etc
         const bool isDiskNowInDrive = isDiskInDrive();
         if (isDiskNowInDrive != m_diskInDrive) {
+            // Before anything of the old disk is thrown away
+            saveDiskCache();
             if (!isDiskNowInDrive) {
-                cylinderSeek(0, false);
+                headSeek(0, false);
                 motorEnable(false, false);
+            }
 
+            // Nothing pending belongs on whatever disk is in the drive now
+            {
+                std::lock_guard<std::mutex> pendingLock(m_pendingLock);
                 if (m_tracksToFlush.size()) {
-		  // FIXME(mreis) removed code here diskRemovedWarning
+	      // FIXME(mreis) removed code here diskRemovedWarning
                     m_tracksToFlush.clear();
+                    m_stagedWrites.clear();
+                    m_writerFailed = true;
+                    m_flushDone.notify_all();
                 }
+            }
 
-                // cache really needs to be cleared!
-                if (m_tracksToFlush.size() < 1) {
-                    for (uint32_t trk = 0; trk < MAX_TRACKS; trk++) {
-                        m_trackCache[0][trk].sectors.clear();
-                        m_trackCache[0][trk].sectors.clear();
-                    }
-                }
+            // cache really needs to be cleared, before the workers can get at it again
+            for (uint32_t trk = 0; trk < MAX_TRACKS; trk++) {
+                m_trackCache[0][trk].clear();
+                m_trackCache[1][trk].clear();
             }
+            m_diskType = SectorType::stUnknown;
+            m_writeProtectChecked = 0;
+
+            // Nothing learnt about the old disk applies to the new one
+            m_fusion[0].reset();
+            m_fusion[1].reset();
+            saveBadSectors();
+            m_badSectors.clear();
+            m_diskFingerprint = 0;
             m_diskInDrive = isDiskNowInDrive;
+            diskInserted = isDiskNowInDrive;
             sendNotify = true;
         }
     }
 
     if (sendNotify) {
+        // Sectors of the old disk must not be served from the cache
+        SectorCacheEngine::resetCache();
         if (!m_fileSystemID) return;
         if (m_diskChangeCallback) {
-            for (DecodedTrack& trk : m_trackCache[0]) trk.sectors.clear();
-            for (DecodedTrack& trk : m_trackCache[1]) trk.sectors.clear();
-            if (m_diskInDrive) 
-                identifyFileSystem(); 
-            else m_diskType = SectorType::stUnknown;
-            m_diskChangeCallback(m_diskInDrive, m_diskInDrive ? m_diskType : SectorType::stUnknown);
+            // Takes the lock itself
+            if (diskInserted) identifyFileSystem();
+            m_diskChangeCallback(diskInserted, diskInserted ? m_diskType : SectorType::stUnknown);
         }
     }
 }
 
+// Sleep until the drive reports a change, drives without events just wait
+void SectorCacheMFM::waitForDriveEvent(uint32_t timeoutMs) {
+    delayMs(timeoutMs);
+}
+
+// Number of sectors currently in the bad sector map
+uint32_t SectorCacheMFM::badSectorCount() {
+    std::lock_guard<std::mutex> bridgeLock(m_motorTimerProtect);
+    return (uint32_t)m_badSectors.size();
+}
+
+// Copy out the cold read latency histogram
+void SectorCacheMFM::readLatencyHistogram(uint64_t* buckets, uint32_t count) const {
+    for (uint32_t i = 0; i < count; i++)
+        buckets[i] = (i < READ_LATENCY_BUCKETS) ? m_readLatency[i].load() : 0;
+}
+
+// Seek the head, keeping count of how far it moved
+bool SectorCacheMFM::headSeek(uint32_t cylinder, bool upperSide) {
+    if (m_headCylinder >= 0) m_seekDistance += (uint64_t)std::abs((int64_t)cylinder - m_headCylinder);
+    m_headCylinder = cylinder;
+    return cylinderSeek(cylinder, upperSide);
+}
+
 // Signal the motor is in use.  Returns if its ok
 void SectorCacheMFM::motorInUse(bool upperSide) {
     if (!m_motorTurnOnTime) motorEnable(true, upperSide);
@@ -231,9 +720,10 @@ void SectorCacheMFM::motorInUse(bool upperSide) {
 // Waits for the drive to be ready, and if it times out, returns false
 bool SectorCacheMFM::waitForMotor(bool upperSide) {
     motorInUse(upperSide);
+    const uint64_t start = GetTickCount64();
     while (!motorReady()) {
-        sleep(100);
-        if (GetTickCount64() - m_motorTurnOnTime > MOTOR_TIMEOUT_TIME) 
+        waitForDriveEvent(100);
+        if (GetTickCount64() - start > MOTOR_TIMEOUT_TIME) 
             return false;
         motorInUse(upperSide);
     }
@@ -242,10 +732,13 @@ bool SectorCacheMFM::waitForMotor(bool upperSide) {
 
 // Release
 SectorCacheMFM::~SectorCacheMFM() {
+    stopWorkers();
     releaseDrive();
 
     // FLUSH
     std::lock_guard<std::mutex> guard(m_motorTimerProtect);
+    saveBadSectors();
+    saveDiskCache();
 //    if (m_timer) {
 //        // Disable the motor timer
 //        DeleteTimerQueueTimer(m_timerQueue, m_timer, 0);
@@ -263,81 +756,127 @@ uint64_t SectorCacheMFM::getDiskDataSize() {
     return m_bytesPerSector[0] * m_sectorsPerTrack[0] * m_numHeads[0] * 82;
 }
 
-// Read *all* data from a specific cylinder and side
+// Read a single sector
 bool SectorCacheMFM::readDataAllFS(const uint32_t fileSystem, const uint32_t sectorNumber, const uint32_t sectorSize, void* data) {
+    return readSectorsAllFS(fileSystem, sectorNumber, 1, sectorSize, data);
+}
+
+// Read a run of sectors, split into one request per track
+bool SectorCacheMFM::readSectorsAllFS(const uint32_t fileSystem, const uint32_t firstSector, const uint32_t count, const uint32_t sectorSize, void* data) {
     if (sectorSize != m_bytesPerSector[fileSystem])
         return false;
+    if (!m_sectorsPerTrack[fileSystem])
+        return false;
+
+    uint8_t* output = (uint8_t*)data;
+    uint32_t sector = firstSector;
+    uint32_t remaining = count;
+    while (remaining) {
+        const uint32_t track = sector / m_sectorsPerTrack[fileSystem];
+        const uint32_t trackBlock = sector % m_sectorsPerTrack[fileSystem];
+        const uint32_t amount = std::min(remaining, m_sectorsPerTrack[fileSystem] - trackBlock);
+        if (!readTrackSectors(fileSystem, track, trackBlock, amount, sectorSize, output)) return false;
+        output += amount * sectorSize;
+        sector += amount;
+        remaining -= amount;
+    }
+    return true;
+}
 
-    const int track = sectorNumber / m_sectorsPerTrack[fileSystem];
-    const int trackBlock = sectorNumber % m_sectorsPerTrack[fileSystem];
+// Read sectors from a specific cylinder and side, the whole track is read if any of them are missing
+bool SectorCacheMFM::readTrackSectors(const uint32_t fileSystem, const uint32_t track, const uint32_t firstBlock, const uint32_t count, const uint32_t sectorSize, void* data) {
     const bool upperSurface = track % m_numHeads[fileSystem];
     const int cylinder = track / m_numHeads[fileSystem];
 
     if (track >= MAX_TRACKS)
         return false;
 
+    // Pending writes are not flushed first: tracks waiting to be written are served from the track cache,
+    // and a flush already running lets this read in between tracks
+    m_readWaitCylinder = cylinder;
+    m_readersWaiting++;
     std::lock_guard<std::mutex> bridgeLock(m_motorTimerProtect);
-
-    checkFlushPendingWrites();
+    m_readersWaiting--;
+    if (fileSystem == 0) absorbStagedWrites();
 
     if (!isDiskInDrive()) return false;
 
-    // Retry several times
+    schedulePrefetch(fileSystem, track);
+
+    // Retry until the policy runs out, this runs on a file system thread so nobody can be asked
+    const uint32_t maxRetries = m_readRetries;
+    const uint64_t deadline = m_readDeadline;
+    const uint64_t requestStart = GetTickCount64();
     uint32_t retries = 0;
+    uint64_t driveReadStart = 0;
     for (;;) {
-        // First, see if we have a perfect sector already
-        auto it = m_trackCache[fileSystem][track].sectors.find(trackBlock);
-
-        if (it != m_trackCache[fileSystem][track].sectors.end()) {
-            // No errors? (or are we skipping them?)
-            if ((it->second.numErrors == 0) || (m_ignoreErrors)) {
-                memcpy_s(data, sectorSize, it->second.data.data(), std::min((unsigned)it->second.data.size(), (unsigned)sectorSize));
-                return true;
+        // First, see if we have perfect sectors already. Ones that have already given up don't get retried
+        const DecodedTrack& decoded = m_trackCache[fileSystem][track];
+        bool knownBad = false;
+        uint32_t block = 0;
+        for (; block < count; block++) {
+            const uint32_t sec = firstBlock + block;
+            if ((decoded.has(sec)) && (decoded.numErrors[sec] == 0)) continue;
+            if ((m_recoverHarder) || (m_badSectors.empty()) || (m_badSectors.find(badSectorKey(fileSystem, track, sec)) == m_badSectors.end())) break;
+            knownBad = true;
+        }
+        if ((block == count) && (!knownBad)) {
+            uint8_t* output = (uint8_t*)data;
+            for (block = 0; block < count; block++, output += sectorSize)
+                memcpy_s(output, sectorSize, decoded.data(firstBlock + block), std::min(decoded.sectorSize, (unsigned)sectorSize));
+            if (driveReadStart) {
+                const uint64_t elapsed = GetTickCount64() - driveReadStart;
+                m_readLatency[std::min((uint64_t)std::bit_width(elapsed), (uint64_t)READ_LATENCY_BUCKETS - 1)]++;
+                // Recovered something that had given up before
+                if (!m_badSectors.empty())
+                    for (block = 0; block < count; block++)
+                        if (m_badSectors.erase(badSectorKey(fileSystem, track, firstBlock + block))) m_badSectorsDirty = true;
             }
+            return true;
         }
 
-        // Retry monitor
-        if (retries > MAX_RETRIES) {
-            if (m_ignoreErrors) return false;
-            retries = 0;
-
-            if (!shouldPrompt()) return false;
-
-	    fprintf(stderr, "Disk read errors were detected. What would you like to do? \n Retry (r), Ignore (i), Always Ignore (a), Quit (q)");
-            switch (getchar()) {
-            case 'r': break;
-            case 'i': m_ignoreErrors = true;
-                break;
-            case 'a': m_alwaysIgnore = true;
-                m_ignoreErrors = true;
-                break;
-            default: 
-                return false;
+        // Out of retries or time
+        if ((block == count) || (retries > maxRetries) || ((deadline) && (GetTickCount64() - requestStart > deadline))) {
+            uint8_t* output = (uint8_t*)data;
+            for (block = 0; block < count; block++, output += sectorSize) {
+                const uint32_t sec = firstBlock + block;
+                const bool good = (decoded.has(sec)) && (decoded.numErrors[sec] == 0);
+                if (!good) {
+                    m_badSectors[badSectorKey(fileSystem, track, sec)] = decoded.has(sec) ? decoded.numErrors[sec] : 0xFFFF;
+                    m_badSectorsDirty = true;
+                }
+                if (!m_fillBadSectors) continue;
+                // Best effort: the copy with the fewest errors, or zeros if there isn't one
+                if (decoded.has(sec)) memcpy_s(output, sectorSize, decoded.data(sec), std::min(decoded.sectorSize, (unsigned)sectorSize));
+                else memset(output, 0, sectorSize);
             }
-
-            // Re-check disk is actually inserted!
-            if (!isDiskInDrive()) return false;
+            if (!knownBad) fprintf(stderr, "Unreadable sectors on track %u after %u attempts\n", track, retries);
+            saveBadSectors();
+            // Filled in sectors must not stick in the sector cache, or they'd never be retried
+            if (m_fillBadSectors) doNotCacheRead();
+            return m_fillBadSectors;
         }
 
         // If this hits, then do a re-seek.  Sometimes it helps
-        if (retries == MAX_RETRIES / 2) {
+        if ((retries) && (retries == maxRetries / 2)) {
             if (!isDiskInDrive()) return false;
             motorInUse(upperSurface);
             if (isPhysicalDisk()) {
                 if (cylinder < 40)
-                    cylinderSeek(79, upperSurface);
+                    headSeek(79, upperSurface);
                 else
-                    cylinderSeek(0, upperSurface);
+                    headSeek(0, upperSurface);
 
                 // Wait for the seek, or it will get removed! 
-                sleep(300);
+                delayMs(300);
             }
             if (!isDiskInDrive()) return false;
         }
 
         // If we get here then this sector isn't in the cache (or has errors), so we'll read and update ALL sectors for this cylinder
+        if (!driveReadStart) driveReadStart = GetTickCount64();
         motorInUse(upperSurface);
-        cylinderSeek(cylinder, upperSurface);
+        headSeek(cylinder, upperSurface);
 
         // Wait for the motor to spin up properly
         if (!waitForMotor(upperSurface))
@@ -359,6 +898,20 @@ bool SectorCacheMFM::internalReadData(const uint32_t sectorNumber, const uint32_
     return readDataAllFS(0, sectorNumber, sectorSize, data);
 }
 
+bool SectorCacheMFM::internalReadSectors(const uint32_t firstSector, const uint32_t count, const uint32_t sectorSize, void* data) {
+    if (sectorSize != m_bytesPerSector[0]) return false;
+
+    return readSectorsAllFS(0, firstSector, count, sectorSize, data);
+}
+
+bool SectorCacheMFM::internalHybridReadSectors(const uint32_t firstSector, const uint32_t count, const uint32_t sectorSize, void* data) {
+    uint32_t fs = (m_diskType == SectorType::stHybrid) ? 1 : 0;
+
+    if (sectorSize != m_bytesPerSector[fs]) return false;
+
+    return readSectorsAllFS(fs, firstSector, count, sectorSize, data);
+}
+
 // Do reading
 bool SectorCacheMFM::internalHybridReadData(const uint32_t sectorNumber, const uint32_t sectorSize, void* data) {
     uint32_t fs = (m_diskType == SectorType::stHybrid) ? 1 : 0;
@@ -370,7 +923,7 @@ bool SectorCacheMFM::internalHybridReadData(const uint32_t sectorNumber, const u
 
 
 // Internal single attempt to read a track
-bool SectorCacheMFM::doTrackReading(const uint32_t fileSystem, const uint32_t track, bool retryMode) {
+bool SectorCacheMFM::doTrackReading(const uint32_t fileSystem, const uint32_t track, bool retryMode, DecodedTrack* readBack) {
     // Read some track data, with some delay for a retry
     uint64_t start = GetTickCount64();
     uint32_t bitsReceived;
@@ -384,10 +937,29 @@ bool SectorCacheMFM::doTrackReading(const uint32_t fileSystem, const uint32_t tr
 
         if (!bitsReceived) {
             if (GetTickCount64() - start > TRACK_READ_TIMEOUT) return false;
-            else sleep(50);
+            else waitForDriveEvent(50);
         }
     } while (!bitsReceived);
 
+    // Verifying a write, decode it the same way it was encoded
+    if (readBack) {
+        readBack->clear();
+        const uint32_t written = m_trackCache[0][track].count();
+        if ((m_diskType == SectorType::stAmiga) || ((m_diskType == SectorType::stHybrid) && ((written == 11) || (written == 22))))
+            findSectors_AMIGA((const unsigned char*)m_mfmBuffer, bitsReceived, isHD(), track, m_sectorsPerTrack[0], *readBack);
+        else findSectors_IBM((const unsigned char*)m_mfmBuffer, bitsReceived, isHD(), track, m_sectorsPerTrack[0], *readBack);
+        return true;
+    }
+
+    // The decoders below can add to these tracks, the disk cache only needs saving again if one of them changed
+    auto cachedRevisions = [this, track]() {
+        uint64_t total = 0;
+        for (const uint32_t trk : { track, track * 2, track >> 1 })
+            if (trk < MAX_TRACKS) total += (uint64_t)m_trackCache[0][trk].revision + m_trackCache[1][trk].revision;
+        return total;
+    };
+    const uint64_t revisionsBefore = cachedRevisions();
+
     // Try to identify the file system
     if (m_diskType == SectorType::stUnknown) {
         // Some defaults
@@ -405,19 +977,19 @@ bool SectorCacheMFM::doTrackReading(const uint32_t fileSystem, const uint32_t tr
         uint32_t sectorsPerTrack;
         uint32_t bytesPerSector;
 
-        if (trAmiga.sectors.size()) {
+        if (trAmiga.count()) {
             m_diskType = SectorType::stAmiga;
-            m_sectorsPerTrack[0] = std::max(m_sectorsPerTrack[0], (uint32_t)trAmiga.sectors.size());
+            m_sectorsPerTrack[0] = std::max(m_sectorsPerTrack[0], trAmiga.count());
             m_serialNumber[0] = 0x414D4644; // AMFD
         }
         else m_diskType = SectorType::stUnknown;
 
-        if (trIBM.sectors.size() >= 5) {
+        if (trIBM.count() >= 5) {
             m_diskType = SectorType::stIBM;
             uint32_t totalSectors;
             uint32_t numHeads;
             if (getTrackDetails_IBM(&trIBM, serialNumber, numHeads, totalSectors, sectorsPerTrack, bytesPerSector)) {
-                if ((trIBM.sectors.size() >= 5) && (trAmiga.sectors.size() > 1)) {
+                if ((trIBM.count() >= 5) && (trAmiga.count() > 1)) {
                     m_diskType = SectorType::stHybrid;
                 }
                 else
@@ -441,150 +1013,263 @@ bool SectorCacheMFM::doTrackReading(const uint32_t fileSystem, const uint32_t tr
     if (m_diskType == SectorType::stHybrid) {
 
         if (m_numHeads[1] == 2) {  // Has 2 sides? Treat everything as normal
-            findSectors_AMIGA((const unsigned char*)m_mfmBuffer, bitsReceived, isHD(), track, m_sectorsPerTrack[0], m_trackCache[0][track]);
-            findSectors_IBM((const unsigned char*)m_mfmBuffer, bitsReceived, isHD(), track, m_sectorsPerTrack[1], m_trackCache[1][track]);
+            findSectors_AMIGA((const unsigned char*)m_mfmBuffer, bitsReceived, isHD(), track, m_sectorsPerTrack[0], m_trackCache[0][track], &m_fusion[0]);
+            findSectors_IBM((const unsigned char*)m_mfmBuffer, bitsReceived, isHD(), track, m_sectorsPerTrack[1], m_trackCache[1][track], &m_fusion[1]);
         }
         else // Atari is single sided. Amiga is ALWAYS double sided
             if (fileSystem == 1) {
-                findSectors_AMIGA((const unsigned char*)m_mfmBuffer, bitsReceived, isHD(), track * 2, m_sectorsPerTrack[0], m_trackCache[0][track * 2]);
-                findSectors_IBM((const unsigned char*)m_mfmBuffer, bitsReceived, isHD(), track, m_sectorsPerTrack[1], m_trackCache[1][track]);
+                findSectors_AMIGA((const unsigned char*)m_mfmBuffer, bitsReceived, isHD(), track * 2, m_sectorsPerTrack[0], m_trackCache[0][track * 2], &m_fusion[0]);
+                findSectors_IBM((const unsigned char*)m_mfmBuffer, bitsReceived, isHD(), track, m_sectorsPerTrack[1], m_trackCache[1][track], &m_fusion[1]);
             }
             else {
-                findSectors_AMIGA((const unsigned char*)m_mfmBuffer, bitsReceived, isHD(), track, m_sectorsPerTrack[0], m_trackCache[0][track]);
+                findSectors_AMIGA((const unsigned char*)m_mfmBuffer, bitsReceived, isHD(), track, m_sectorsPerTrack[0], m_trackCache[0][track], &m_fusion[0]);
+                // No fusion here, its copies are kept by the track number of the other file system
                 if ((track & 1) == 0)
                     findSectors_IBM((const unsigned char*)m_mfmBuffer, bitsReceived, isHD(), track, m_sectorsPerTrack[1], m_trackCache[1][track >> 1]);
             }
     }
     else
         if (m_diskType == SectorType::stAmiga)
-            findSectors_AMIGA((const unsigned char*)m_mfmBuffer, bitsReceived, isHD(), track, m_sectorsPerTrack[0], m_trackCache[0][track]);
+            findSectors_AMIGA((const unsigned char*)m_mfmBuffer, bitsReceived, isHD(), track, m_sectorsPerTrack[0], m_trackCache[0][track], &m_fusion[0]);
     if ((m_diskType == SectorType::stAtari) || (m_diskType == SectorType::stIBM))
-        findSectors_IBM((const unsigned char*)m_mfmBuffer, bitsReceived, isHD(), track, m_sectorsPerTrack[0], m_trackCache[0][track]);
+        findSectors_IBM((const unsigned char*)m_mfmBuffer, bitsReceived, isHD(), track, m_sectorsPerTrack[0], m_trackCache[0][track], &m_fusion[0]);
 
+    if (cachedRevisions() != revisionsBefore) m_diskCacheDirty = true;
     return true;
 }
 
 // Do writing
 bool SectorCacheMFM::internalWriteData(const uint32_t sectorNumber, const uint32_t sectorSize, const void* data) {
+    return internalWriteSectors(sectorNumber, 1, sectorSize, data);
+}
+
+// Write a run of sectors, split into one request per track
+bool SectorCacheMFM::internalWriteSectors(const uint32_t firstSector, const uint32_t count, const uint32_t sectorSize, const void* data) {
     if (m_blockWriting) return false;
     if ((m_diskType == SectorType::stHybrid) || (m_diskType == SectorType::stUnknown)) return false;
+    if (!m_sectorsPerTrack[0]) return false;
     if (isDiskWriteProtected()) return false;
 
-    const int track = sectorNumber / m_sectorsPerTrack[0];
+    const uint8_t* input = (const uint8_t*)data;
+    uint32_t sector = firstSector;
+    uint32_t remaining = count;
+    while (remaining) {
+        const uint32_t track = sector / m_sectorsPerTrack[0];
+        const uint32_t trackBlock = sector % m_sectorsPerTrack[0];
+        const uint32_t amount = std::min(remaining, m_sectorsPerTrack[0] - trackBlock);
+        if (!writeTrackSectors(track, trackBlock, amount, sectorSize, input)) return false;
+        input += amount * sectorSize;
+        sector += amount;
+        remaining -= amount;
+    }
+    return true;
+}
+
+// Backpressure: a write that needs a track that isn't pending yet waits until the writer has made room.
+// This runs before the engine takes its lock so cached reads carry on meanwhile
+bool SectorCacheMFM::admitWrite(const uint32_t firstSector, const uint32_t count) {
+    std::unique_lock<std::mutex> pendingLock(m_pendingLock);
+    if (!m_sectorsPerTrack[0]) return true;
+    const uint32_t firstTrack = firstSector / m_sectorsPerTrack[0];
+    const uint32_t lastTrack = (firstSector + (count ? count - 1 : 0)) / m_sectorsPerTrack[0];
+    auto needsNewTrack = [&]() {
+        for (uint32_t track = firstTrack; track <= lastTrack; track++)
+            if (m_tracksToFlush.find(track) == m_tracksToFlush.end()) return true;
+        return false;
+    };
+    while (m_writerRunning && (m_tracksToFlush.size() >= DIRTY_TRACK_BUDGET) && needsNewTrack()) {
+        if (m_writerFailed) return false;
+        m_writerSignal.notify_one();
+        m_flushDone.wait(pendingLock);
+    }
+    return true;
+}
+
+// Replace sectors on a single track, just in memory at this point. The sectors are only staged, so a flush
+// pass that has the drive doesn't hold this up
+bool SectorCacheMFM::writeTrackSectors(const uint32_t track, const uint32_t firstBlock, const uint32_t count, const uint32_t sectorSize, const void* data) {
     if (track >= MAX_TRACKS) return false;
-    const int trackBlock = sectorNumber % m_sectorsPerTrack[0];
-    const bool upperSurface = track % m_numHeads[0];
-    const int cylinder = track / m_numHeads[0];
 
+    std::unique_lock<std::mutex> pendingLock(m_pendingLock);
+
+    const uint8_t* input = (const uint8_t*)data;
+    uint32_t added = 0;
+    auto& staged = m_stagedWrites[track];
+    for (uint32_t block = 0; block < count; block++, input += sectorSize) {
+        std::vector<uint8_t>& sector = staged[firstBlock + block];
+        if (sector.empty()) added++;
+        const uint32_t size = std::min(m_bytesPerSector[0], sectorSize);
+        sector.assign(input, input + size);
+        sector.resize(m_bytesPerSector[0], 0);
+    }
+    // Counted as changed for now, absorbStagedWrites takes off the ones that weren't
+    m_tracksToFlush[track] += added;
+    m_lastStagedWrite = GetTickCount64();
+
+    if (m_tracksToFlush.size() < FORCE_FLUSH_AT_TRACKS) return true;
+    if (m_writerRunning) {
+        m_writerSignal.notify_one();
+        return true;
+    }
+    pendingLock.unlock();
     std::lock_guard<std::mutex> bridgeLock(m_motorTimerProtect);
+    flushPendingWrites(true);
 
-    // Now replace the sector we're overwriting, just in memory at this point
-    auto it = m_trackCache[0][track].sectors.find(trackBlock);
-    if (it != m_trackCache[0][track].sectors.end()) {
-        if (memcmp(it->second.data.data(), data, std::min(sectorSize, (unsigned)it->second.data.size())) == 0) {
-            if (it->second.numErrors == 0) return true;
-            it->second.numErrors = 0;                
-        }
-        else {
-            // No errors? (or are we skipping them?)
-            memcpy_s(it->second.data.data(), it->second.data.size(), data, std::min(sectorSize, (unsigned)it->second.data.size()));
-            it->second.numErrors = 0;
-        }
-    }
-    else {
-        // Add the track
-        DecodedSector sector;
-        sector.data.resize(m_bytesPerSector[0]);
-        memcpy_s(sector.data.data(), sector.data.size(), data, std::min((unsigned)sector.data.size(), sectorSize));
-        sector.numErrors = 0;
-        m_trackCache[0][track].sectors.insert(std::make_pair(trackBlock, sector));
+    return true;
+}
+
+// Merge staged writes into the track cache - lock must already be obtained
+void SectorCacheMFM::absorbStagedWrites() {
+    std::map<uint32_t, std::map<uint32_t, std::vector<uint8_t>>> staged;
+    {
+        std::lock_guard<std::mutex> pendingLock(m_pendingLock);
+        if (m_stagedWrites.empty()) return;
+        staged.swap(m_stagedWrites);
     }
 
-    auto i = m_tracksToFlush.find(track);
-    if (i == m_tracksToFlush.end())
-        m_tracksToFlush.insert(std::make_pair(track, 1));
-    else i->second++;
+    for (auto& trk : staged) {
+        const uint32_t track = trk.first;
+        DecodedTrack& decoded = m_trackCache[0][track];
+        uint32_t unchanged = 0;
+        for (auto& sec : trk.second) {
+            const std::vector<uint8_t>& input = sec.second;
+            // Whatever was wrong with it, it's been replaced now
+            if ((!m_badSectors.empty()) && (m_badSectors.erase(badSectorKey(0, track, sec.first)))) m_badSectorsDirty = true;
+            if (decoded.has(sec.first)) {
+                uint8_t* existing = decoded.data(sec.first);
+                const uint32_t size = std::min((uint32_t)input.size(), decoded.sectorSize);
+                if (memcmp(existing, input.data(), size) == 0) {
+                    if (decoded.numErrors[sec.first] == 0) {
+                        unchanged++;
+                        continue;
+                    }
+                }
+                // No errors? (or are we skipping them?)
+                else memcpy_s(existing, decoded.sectorSize, input.data(), size);
+                decoded.numErrors[sec.first] = 0;
+            }
+            else {
+                // Add the sector
+                uint8_t* added = decoded.add(sec.first, m_bytesPerSector[0], 0);
+                if (added) memcpy_s(added, m_bytesPerSector[0], input.data(), std::min((uint32_t)input.size(), m_bytesPerSector[0]));
+                else unchanged++;
+            }
+        }
+        if (!unchanged) continue;
 
-    motorInUse(upperSurface);
-    checkFlushPendingWrites();
+        std::lock_guard<std::mutex> pendingLock(m_pendingLock);
+        auto i = m_tracksToFlush.find(track);
+        if (i == m_tracksToFlush.end()) continue;
+        i->second -= std::min(i->second, unchanged);
+        if ((!i->second) && (m_stagedWrites.find(track) == m_stagedWrites.end())) m_tracksToFlush.erase(i);
+    }
+}
 
-    return true;
+// Forget the first tracks of a pass that have been written and not written to since
+void SectorCacheMFM::removeWrittenTracks(const std::vector<uint32_t>& order, const size_t done) {
+    std::lock_guard<std::mutex> pendingLock(m_pendingLock);
+    for (size_t index = 0; index < done; index++) {
+        auto i = m_tracksToFlush.find(order[index]);
+        if ((i != m_tracksToFlush.end()) && (!i->second)) m_tracksToFlush.erase(i);
+    }
+}
+
+// Is the track waiting to be written
+bool SectorCacheMFM::isTrackPending(const uint32_t track) {
+    std::lock_guard<std::mutex> pendingLock(m_pendingLock);
+    return m_tracksToFlush.find(track) != m_tracksToFlush.end();
 }
 
-// Checks for pending writes, if theres too many then flush them
-void SectorCacheMFM::checkFlushPendingWrites() {
-    if (m_tracksToFlush.size() < FORCE_FLUSH_AT_TRACKS) return;
-    flushPendingWrites();
+// Is anything waiting to be written
+bool SectorCacheMFM::hasPendingWrites() {
+    std::lock_guard<std::mutex> pendingLock(m_pendingLock);
+    return !m_tracksToFlush.empty();
 }
 
 // Removes anything that failed from the cache so it has to be re-read from the disk
 void SectorCacheMFM::removeFailedWritesFromCache() {
+    std::lock_guard<std::mutex> pendingLock(m_pendingLock);
     for (auto& trk : m_tracksToFlush)
-        if (trk.second)
-            m_trackCache[0][trk.first].sectors.clear();
+        if (trk.second) {
+            m_trackCache[0][trk.first].clear();
+            m_stagedWrites.erase(trk.first);
+            // The sector cache holds what was written, not what's on the disk
+            dropFromCache(trk.first * m_sectorsPerTrack[0], m_sectorsPerTrack[0]);
+        }
     m_tracksToFlush.clear();
 }
 
 // Flush any writing thats still pending - lock must already be obtained
-bool SectorCacheMFM::flushPendingWrites() {
+bool SectorCacheMFM::flushPendingWrites(bool yieldToReads) {
     if (m_blockWriting) return false;
+    absorbStagedWrites();
 
-    for (auto& trk : m_tracksToFlush) {
-        const uint32_t track = trk.first;
+    // C-LOOK: sweep upwards from the cylinder under the head, then jump back to the lowest pending track.
+    // Both sides of a cylinder are adjacent track numbers so they get written together. Writes staged while
+    // the pass runs wait for the next one
+    std::vector<uint32_t> order;
+    std::map<uint32_t, uint32_t> hits;
+    {
+        // Sectors staged since the absorb above aren't in the track cache, so don't count towards this pass
+        std::lock_guard<std::mutex> pendingLock(m_pendingLock);
+        for (const auto& trk : m_tracksToFlush) {
+            auto staged = m_stagedWrites.find(trk.first);
+            const uint32_t notAbsorbed = (staged == m_stagedWrites.end()) ? 0 : (uint32_t)staged->second.size();
+            if (trk.second > notAbsorbed) hits[trk.first] = trk.second - notAbsorbed;
+        }
+    }
+    order.reserve(hits.size());
+    const uint32_t startTrack = (m_headCylinder < 0) ? 0 : (uint32_t)m_headCylinder * m_numHeads[0];
+    for (auto it = hits.lower_bound(startTrack); it != hits.end(); ++it) order.push_back(it->first);
+    for (auto it = hits.begin(); (it != hits.end()) && (it->first < startTrack); ++it) order.push_back(it->first);
+
+    for (size_t index = 0; index < order.size(); index++) {
+        const uint32_t track = order[index];
         const bool upperSurface = track % m_numHeads[0];
         const int cylinder = track / m_numHeads[0];
 
         // Motor shouldn't stop here
         motorInUse(upperSurface);
-        cylinderSeek(cylinder, upperSurface);
+        headSeek(cylinder, upperSurface);
         if (!waitForMotor(upperSurface)) {
+            std::lock_guard<std::mutex> pendingLock(m_pendingLock);
             m_tracksToFlush.clear();
             return false;
         }
-        cylinderSeek(cylinder, upperSurface);
+        headSeek(cylinder, upperSurface);
 
         // Assemble and commit an entire track.  First see if any data is missing
-        bool fillData = m_trackCache[0][track].sectors.size() < m_sectorsPerTrack[0];
+        DecodedTrack& decoded = m_trackCache[0][track];
+        bool fillData = decoded.count() < m_sectorsPerTrack[0];
         if (!fillData)
-            for (const auto& it : m_trackCache[0][track].sectors)
-                if (it.second.numErrors) {
+            for (uint32_t sec = 0; sec < MAX_DECODED_SECTORS; sec++)
+                if (decoded.has(sec) && decoded.numErrors[sec]) {
                     fillData = true;
                     break;
                 }
 
-        // Theres some missing data. We we'll request the track again and fill in the gaps
+        // Theres some missing data. We we'll request the track again and fill in the gaps.
+        // No copy is needed to protect what we're writing: decoding only ever replaces a sector with one that has
+        // fewer errors, so sectors with no errors are left alone
         if (fillData) {
-            // 1. Take a copy
-            const std::map<int, DecodedSector> backup = m_trackCache[0][track].sectors;
             if (m_writeOnly) {
                 for (uint32_t sec = 0; sec < m_sectorsPerTrack[0]; sec++) {
-                    auto it = m_trackCache[0][track].sectors.find(sec);
                     // Does a sector with this number exist?
-                    if (it == m_trackCache[0][track].sectors.end()) {
-                        DecodedSector tmp;
-                        tmp.numErrors = 0;
-                        tmp.data.resize(m_bytesPerSector[0]);;
-                        m_trackCache[0][track].sectors.insert(std::make_pair(sec, tmp));
+                    if (!decoded.has(sec)) {
+                        uint8_t* blank = decoded.add(sec, m_bytesPerSector[0], 0);
+                        if (blank) memset(blank, 0, m_bytesPerSector[0]);
                     }
                 }
             }
             else {
-                // 2. *try* to read the track (but dont care if it fails)
+                // *try* to read the track (but dont care if it fails)
                 doTrackReading(0, track, false);
             }
-            // 3. Replace any tracks now read with any we have in our backup that have errors = 0
-            for (const auto& sec : backup) {
-                if (sec.second.numErrors == 0) {
-                    auto it = m_trackCache[0][track].sectors.find(sec.first);
-                    if (it != m_trackCache[0][track].sectors.end())
-                        it->second = sec.second;
-                }
-            }
         }
 
         // Remove sectors that shouldn't be there
-        while (m_trackCache[0][track].sectors.size() > m_sectorsPerTrack[0]) 
-            m_trackCache[0][track].sectors.erase(m_trackCache[0][track].sectors.rbegin()->first);
+        while (decoded.count() > m_sectorsPerTrack[0])
+            decoded.remove(decoded.last());
 
         // We will now have a complete track worth of sectors so we can now finally commit this to disk (hopefully) plus we will verify it
         uint32_t numBytes;
@@ -595,7 +1280,7 @@ bool SectorCacheMFM::flushPendingWrites() {
         case SectorType::stAtari: numBytes = encodeSectorsIntoMFM_IBM(isHD(), true, &m_trackCache[0][track], track, MAX_TRACK_SIZE, m_mfmBuffer); break;
         case SectorType::stHybrid:
             // Need to work out which type of track it is although technically hybrid isnt supported for writing
-            if ((m_trackCache[0][track].sectors.size() == 11) || (m_trackCache[0][track].sectors.size() == 22))
+            if ((decoded.count() == 11) || (decoded.count() == 22))
                 numBytes = encodeSectorsIntoMFM_AMIGA(isHD(), m_trackCache[0][track], track, MAX_TRACK_SIZE, m_mfmBuffer);
             else numBytes = encodeSectorsIntoMFM_IBM(isHD(), true, &m_trackCache[0][track], track, MAX_TRACK_SIZE, m_mfmBuffer);
             break;
@@ -610,8 +1295,9 @@ bool SectorCacheMFM::flushPendingWrites() {
             return false;
         }
 
-        // Write retries
+        // Write retries, the re-seek resets retries so attempts puts a limit on the whole thing
         uint32_t retries = 0;
+        uint32_t attempts = 0;
         for (;;) {
             // Handle a re-seek - might clean the head
             if (retries == MAX_RETRIES / 2) {
@@ -619,16 +1305,16 @@ bool SectorCacheMFM::flushPendingWrites() {
                     motorInUse(upperSurface);
 
                     if (cylinder < 40)
-                        cylinderSeek(79, upperSurface);
+                        headSeek(79, upperSurface);
                     else
-                        cylinderSeek(0, upperSurface);
+                        headSeek(0, upperSurface);
 
                     // Wait for the seek, or it will get removed! 
-                    sleep(300);
+                    delayMs(300);
                 }
                 retries = 0;
             }
-            cylinderSeek(cylinder, upperSurface);
+            headSeek(cylinder, upperSurface);
 
             // Commit to disk
             motorInUse(upperSurface);
@@ -650,9 +1336,10 @@ bool SectorCacheMFM::flushPendingWrites() {
                 while (!writeCompleted()) {
                     if (GetTickCount64() - start > DISK_WRITE_TIMEOUT) {
                         resetDrive(cylinder);
+                        m_headCylinder = cylinder;
                         m_motorTurnOnTime = 0;
                         
-                        if (isPhysicalDisk()) sleep(200);
+                        if (isPhysicalDisk()) delayMs(200);
 
                         if (!isDiskInDrive()) {
 //                            if (diskRemovedWarning()) {
@@ -671,15 +1358,15 @@ bool SectorCacheMFM::flushPendingWrites() {
                         else
                             return false;
                     }
+                    waitForDriveEvent(50);
                 }
                 if (doRetry) {
                     retries = 0;
                 }
                 else {
                     // Writing succeeded. Now to do a verify!
-                    const std::map<int, DecodedSector> backup = m_trackCache[0][track].sectors;
                     for (;;) {
-                        if (!doTrackReading(0, track, retries > 1)) {
+                        if (!doTrackReading(0, track, retries > 1, &m_verifyTrack)) {
                             m_motorTurnOnTime = 0;
                             if (!isDiskInDrive()) {
 //                                if (!diskRemovedWarning()) {
@@ -692,35 +1379,35 @@ bool SectorCacheMFM::flushPendingWrites() {
                             else
                                 return false;
                             // Wait and try again
-                            if (isPhysicalDisk()) sleep(100);
+                            if (isPhysicalDisk()) delayMs(100);
                         }
                         else break;
                     }
 
                     // Check what was read back matches what we wrote
                     bool errors = false;
-                    for (const auto& sec : backup) {
-                        auto search = m_trackCache[0][track].sectors.find(sec.first);
+                    for (uint32_t sec = 0; sec < MAX_DECODED_SECTORS; sec++) {
+                        if (!decoded.has(sec)) continue;
                         // Sector no longer exists.  ERROR!
-                        if (search == m_trackCache[0][track].sectors.end()) {
+                        if (!m_verifyTrack.has(sec)) {
                             errors = true;
                             break;
                         }
                         else {
                             // Did it reac back with errors!?
-                            if (search->second.numErrors) {
+                            if (m_verifyTrack.numErrors[sec]) {
                                 errors = true;
                                 break;
                             }
                             else {
                                 // Finally, compare the data and see if its identical
-                                if (search->second.data.size() != sec.second.data.size()) {
+                                if (m_verifyTrack.sectorSize != decoded.sectorSize) {
                                     // BAD read back wrong sector size
                                     errors = true;
                                     break;
                                 }
                                 else
-                                    if (memcmp(search->second.data.data(), sec.second.data.data(), search->second.data.size()) != 0) {
+                                    if (memcmp(m_verifyTrack.data(sec), decoded.data(sec), decoded.sectorSize) != 0) {
                                         // BAD read back even though there were no errors
                                         errors = true;
                                         break;
@@ -738,13 +1425,34 @@ bool SectorCacheMFM::flushPendingWrites() {
                 return false;
             }
 
+            // Still doesn't read back correctly
+            if (++attempts > MAX_RETRIES) {
+                removeFailedWritesFromCache();
+                return false;
+            }
             retries++;
         }
 
-        // Mark that its done!
-        trk.second = 0;
+        // Mark that its done! Unless more was written to it meanwhile
+        {
+            std::lock_guard<std::mutex> pendingLock(m_pendingLock);
+            auto i = m_tracksToFlush.find(track);
+            if (i != m_tracksToFlush.end()) i->second -= std::min(i->second, hits[track]);
+        }
+        m_diskCacheDirty = true;
+
+        // Let a waiting read go before the rest of the batch: straight away if it wants the cylinder under
+        // the head, otherwise once both sides of this cylinder are written. Too big a backlog is finished first
+        const size_t remaining = order.size() - index - 1;
+        if (yieldToReads && m_readersWaiting && remaining && (remaining < FORCE_FLUSH_AT_TRACKS * 2)) {
+            const bool sameCylinder = order[index + 1] / m_numHeads[0] == (uint32_t)cylinder;
+            if ((m_readWaitCylinder == cylinder) || (!sameCylinder)) {
+                removeWrittenTracks(order, index + 1);
+                return true;
+            }
+        }
     }
 
-    removeFailedWritesFromCache();
+    removeWrittenTracks(order, order.size());
     return true;
 }
\ No newline at end of file
@@ -16,32 +16,50 @@
 
 // Handles reading and writing from real disks, with *hopefully* reliable detection of the type of disk inserted
 #include <map>
+#include <string>
 #include <functional>
 #include "sectorCache.h"
 #include "sectorCommon.h"
+#include "sectorFusion.h"
 #include "mfminterface.h"
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <stop_token>
 
 #define MAX_TRACKS                          168
 #define MOTOR_TIMEOUT_TIME                  2500ULL // Timeout to wait for the motor to spin up
 #define TRACK_READ_TIMEOUT                  1000ULL // Should be enough to read it 5 times!
 #define MAX_RETRIES                         10      // Attempts to re-read a sector to get a better one
+#define READ_DEADLINE                       5000ULL // How long a read may keep retrying before it gives up, 0 for no limit
+#define BAD_SECTOR_DISKS                    256     // Most disks remembered in the bad sector file, the oldest are dropped
 #define MOTOR_IDLE_TIMEOUT                  2000ULL // How long after access to switch off the motor and flush changes to disk
+#define DISK_CHANGE_POLL_TIME               250ULL  // How often the monitor asks the drive if the disk has changed
 #define DISK_WRITE_TIMEOUT                  1000ULL // Allow 1.5 second to write and read-back the data
 #define FORCE_FLUSH_AT_TRACKS               10      // How many tracks to have pending write before its forced (5 cylinders, both sides)
+#define DIRTY_TRACK_BUDGET                  30      // How many tracks can be pending before writers wait for the writer thread
 #define DOKAN_EXTRATIME                     10000   // How much extra time to add to the timeout for dokan file operations
+#define DEFAULT_SECTOR_CACHE_MEM            (2U * 1024U * 1024U) // Sector cache budget, enough for a whole HD disk
+#define WRITE_PROTECT_POLL_TIME             500ULL  // How long the write protect state is trusted before asking the drive again
+#define READ_LATENCY_BUCKETS                13      // Cold read histogram: <1ms, <2ms, <4ms ... <2048ms, then anything longer
+#define PREFETCH_TRACKS                     2       // Tracks to read ahead of sequential access: the other head, then the next cylinder
 
 class SectorCacheMFM : public SectorCacheEngine {
 private:
     SectorType m_diskType           = SectorType::stUnknown;
-    uint64_t m_motorTurnOnTime     = 0;
+    std::atomic<uint64_t> m_motorTurnOnTime = 0;
     void* m_mfmBuffer               = nullptr;
-    bool m_ignoreErrors             = false;   // should get reset when motor goes off
     std::vector<timer_t> m_timerQueue;
     void* m_timer                  = 0;
     bool m_blockWriting             = false;  // used if errors occur
-    bool m_diskInDrive              = false;  // Monitor for disk change
+    std::atomic<bool> m_diskInDrive = false;  // Monitor for disk change
+    std::atomic<bool> m_writeProtected = false;
+    std::atomic<uint64_t> m_writeProtectChecked = 0;
     std::mutex m_motorTimerProtect;
+    std::atomic<uint64_t> m_motorIdleTimeout = MOTOR_IDLE_TIMEOUT;
     bool m_writeOnly                = false;
     std::function<void(bool diskInserted, SectorType diskFormat)> m_diskChangeCallback;
 
@@ -51,24 +69,120 @@ private:
     uint32_t m_serialNumber[2] = { 0x554E4B4E, 0 };
     uint32_t m_numHeads[2] = { 2, 2 };
 
-    bool m_alwaysIgnore = false;
     bool m_fileSystemID = true;
 
+    // Read error policy. A read that runs out of retries or time fails, or in fill mode returns what it has
+    std::atomic<uint64_t> m_readDeadline = READ_DEADLINE;
+    std::atomic<uint32_t> m_readRetries = MAX_RETRIES;
+    std::atomic<bool> m_fillBadSectors = false;
+
+    // Sectors that gave up, see badSectorKey. A read of one of these doesn't retry again unless recovering harder,
+    // or the sector is written. The value is the errors it had, 0xFFFF if it was never found.
+    // Kept in m_badSectorFile between mounts under the fingerprint of the disk
+    std::map<uint32_t, uint32_t> m_badSectors;
+    std::string m_badSectorFile;
+    uint64_t m_diskFingerprint = 0;         // 0 until a disk has been identified
+    bool m_badSectorsDirty = false;
+    std::atomic<bool> m_recoverHarder = false;
+
+    // Host copy of the decoded tracks of each disk seen, in m_diskCacheDir under the fingerprint of the disk.
+    // Only clean tracks that are on the disk itself are kept, writes reach it after they've been flushed
+    std::string m_diskCacheDir;
+    bool m_diskCacheDirty = false;
+
+    // Guards the write-behind state below: m_tracksToFlush, m_stagedWrites and the writer thread's flags.
+    // Writers only take this one, so they never wait for the drive. Taken after the bridge lock, never before it
+    std::mutex m_pendingLock;
+
     // Tracks that need committing to disk
-    // NOTE: Using MAP not UNORDERED_MAP. This *should* make the disk head stepping fairly sequential and faster
+    // NOTE: Using MAP not UNORDERED_MAP. flushPendingWrites walks it in C-LOOK order from the head position
     std::map<uint32_t, uint32_t> m_tracksToFlush; // mapping of track -> number of hits
 
-    // Cache for previous tracks read
-    DecodedTrack m_trackCache[2][MAX_TRACKS];
+    // Written sectors not yet merged into the track cache, track -> sector -> data. Merged by whoever next holds the bridge lock
+    std::map<uint32_t, std::map<uint32_t, std::vector<uint8_t>>> m_stagedWrites;
+    std::atomic<uint64_t> m_lastStagedWrite = 0;    // when the last write was staged, 0 once the monitor has flushed
+
+    // Head position as last requested, -1 if unknown, and the total cylinders stepped
+    int64_t m_headCylinder = -1;
+    std::atomic<uint64_t> m_seekDistance = 0;
 
-    // Flush any writing thats still pending
-    bool flushPendingWrites();
+    // How long reads that had to go to the drive took, by power of two milliseconds
+    std::atomic<uint64_t> m_readLatency[READ_LATENCY_BUCKETS] = {};
 
-    // Checks for pending writes, if theres too many then flush them
-    void checkFlushPendingWrites();
+    // Reads waiting for the drive, and the cylinder the latest of them wants. A flush lets them in part way through
+    std::atomic<uint32_t> m_readersWaiting = 0;
+    std::atomic<int32_t> m_readWaitCylinder = -1;
 
-    // Actually read the track
-    bool doTrackReading(const uint32_t fileSystem, const uint32_t track, bool retryMode);
+    // Cache for previous tracks read
+    DecodedTrack m_trackCache[2][MAX_TRACKS];
+    // What a track read back as after writing it
+    DecodedTrack m_verifyTrack;
+    // Bad copies of sectors from earlier reads of the same track, one per track cache
+    SectorFusion m_fusion[2];
+
+    // Read-ahead. Tracks are queued as (file system, track) and read by the prefetch thread
+    std::thread m_prefetchThread;
+    std::mutex m_prefetchLock;
+    std::condition_variable m_prefetchSignal;
+    std::deque<std::pair<uint32_t, uint32_t>> m_prefetchQueue;
+    bool m_prefetchQuit = false;
+    int64_t m_lastReadTrack[2] = { -1, -1 };
+
+    // Write-behind. The writer thread commits pending tracks, writers only wait once DIRTY_TRACK_BUDGET is used up
+    std::thread m_writerThread;
+    std::condition_variable m_writerSignal;     // wakes the writer, used with m_pendingLock
+    std::condition_variable m_flushDone;        // a flush pass has finished, used with m_pendingLock
+    std::vector<std::promise<bool>> m_flushWaiters;
+    bool m_writerRunning = false;
+    bool m_writerQuit = false;
+    bool m_writerFailed = false;
+
+    // Motor idle and disk change monitor. Sleeps until the next idle deadline or disk poll, or until stopped
+    std::jthread m_monitorThread;
+    std::mutex m_monitorLock;
+    std::condition_variable_any m_monitorSignal;
+
+    // Worker that reads and decodes queued tracks while the drive would otherwise sit idle
+    void prefetchThread();
+
+    // Runs motorMonitor whenever something might be due
+    void monitorThread(std::stop_token stop);
+
+    // Worker that commits pending tracks to the disk
+    void writerThread();
+
+    // Called for each track a request needed, queues read-ahead if access looks sequential - lock must already be obtained
+    void schedulePrefetch(const uint32_t fileSystem, const uint32_t track);
+
+    // Returns TRUE if every sector of the track is cached without errors - lock must already be obtained
+    bool isTrackComplete(const uint32_t fileSystem, const uint32_t track);
+
+    // Flush any writing thats still pending. With yieldToReads it may stop early to let waiting reads go first
+    bool flushPendingWrites(bool yieldToReads = false);
+
+    // Seek the head, keeping count of the distance - lock must already be obtained
+    bool headSeek(uint32_t cylinder, bool upperSide);
+
+    // Merge staged writes into the track cache - lock must already be obtained
+    void absorbStagedWrites();
+
+    // Is the track waiting to be written, or are any tracks
+    bool isTrackPending(const uint32_t track);
+    bool hasPendingWrites();
+
+    // Forget the first tracks of a pass that have been written and not written to since
+    void removeWrittenTracks(const std::vector<uint32_t>& order, const size_t done);
+
+    // Bad sector file, lock must already be obtained
+    void computeFingerprint();
+    void loadBadSectors();
+    void saveBadSectors();
+    void loadDiskCache();
+    void saveDiskCache();
+    std::string diskCacheFilename() const;
+
+    // Actually read the track. With readBack set the sectors are decoded into that instead of the cache
+    bool doTrackReading(const uint32_t fileSystem, const uint32_t track, bool retryMode, DecodedTrack* readBack = nullptr);
 
     // Removes anything that failed from the cache so it has to be re-read from the disk
     void removeFailedWritesFromCache();
@@ -81,6 +195,11 @@ private:
 
     // Read all sector data regarding of the mode
     bool readDataAllFS(const uint32_t fileSystem, const uint32_t sectorNumber, const uint32_t sectorSize, void* data);
+    bool readSectorsAllFS(const uint32_t fileSystem, const uint32_t firstSector, const uint32_t count, const uint32_t sectorSize, void* data);
+
+    // Read or replace sectors within a single track, under one lock
+    bool readTrackSectors(const uint32_t fileSystem, const uint32_t track, const uint32_t firstBlock, const uint32_t count, const uint32_t sectorSize, void* data);
+    bool writeTrackSectors(const uint32_t track, const uint32_t firstBlock, const uint32_t count, const uint32_t sectorSize, const void* data);
 
     // Signal the motor is in use
     void motorInUse(bool upperSide);
@@ -93,6 +212,11 @@ protected:
     bool internalReadData(const uint32_t sectorNumber, const uint32_t sectorSize, void* data) final;
     bool internalWriteData(const uint32_t sectorNumber, const uint32_t sectorSize, const void* data) final;
     bool internalHybridReadData(const uint32_t sectorNumber, const uint32_t sectorSize, void* data) final;
+    bool internalReadSectors(const uint32_t firstSector, const uint32_t count, const uint32_t sectorSize, void* data) final;
+    bool internalHybridReadSectors(const uint32_t firstSector, const uint32_t count, const uint32_t sectorSize, void* data) final;
+    bool internalWriteSectors(const uint32_t firstSector, const uint32_t count, const uint32_t sectorSize, const void* data) final;
+    bool hybridIsSeparate() final { return m_diskType == SectorType::stHybrid; };
+    bool admitWrite(const uint32_t firstSector, const uint32_t count) final;
 
     virtual bool restoreDrive() = 0;
     virtual void releaseDrive();
@@ -102,13 +226,18 @@ protected:
     virtual bool motorReady() = 0;
     virtual bool resetDrive(uint32_t cylinder) = 0;
     virtual bool writeCompleted() = 0;
+    // Block until the drive might be ready for something, or timeoutMs passes
+    virtual void waitForDriveEvent(uint32_t timeoutMs);
     virtual bool cylinderSeek(uint32_t cylinder, bool upperSide) = 0;
     virtual uint32_t mfmRead(uint32_t cylinder, bool upperSide, bool retryMode, void* data, uint32_t maxLength) = 0; // return BITS written
     virtual uint32_t mfmRead(uint32_t track, bool retryMode, void* data, uint32_t maxLength) { return 0; };
     virtual bool mfmWrite(uint32_t cylinder, bool upperSide, bool fromIndex, void* data, uint32_t maxLength) = 0;
-    virtual bool shouldPrompt() { return true; };
     void setReady();
 
+    // Start and stop the background threads. They call into the drive, so the derived class must stop them first
+    void startWorkers();
+    void stopWorkers();
+
 public:
     SectorCacheMFM(std::function<void(bool diskInserted, SectorType diskFormat)> diskChangeCallback);
     ~SectorCacheMFM();
@@ -171,4 +300,31 @@ public:
 
     // Monitoring keeping the motor spinning or not when not in use
     void motorMonitor();
+
+    // How long after the last access pending tracks are flushed and the motor switched off
+    void setMotorIdleTimeout(uint32_t milliseconds) { m_motorIdleTimeout = milliseconds; m_monitorSignal.notify_all(); };
+
+    // Total number of cylinders the head has been stepped
+    uint64_t seekDistance() const { return m_seekDistance; };
+
+    // Copy out the cold read latency histogram, see READ_LATENCY_BUCKETS
+    void readLatencyHistogram(uint64_t* buckets, uint32_t count) const;
+
+    // How long and how many times a read retries before giving up (0 deadline for no limit), and whether
+    // it then fails or returns the best copy it has with missing sectors zeroed
+    void setReadErrorPolicy(uint32_t deadlineMs, uint32_t retries, bool fill) { m_readDeadline = deadlineMs; m_readRetries = retries; m_fillBadSectors = fill; };
+
+    // Number of sectors currently in the bad sector map
+    uint32_t badSectorCount();
+
+    // Where the bad sector map is kept between mounts, empty to not keep it. Recovering harder forgets what's
+    // stored for each disk inserted and retries every bad sector on every read
+    void setBadSectorFile(const std::string& filename, bool recoverHarder);
+
+    // Directory decoded tracks are kept in between mounts, empty to not keep them. A disk seen before is checked
+    // against its boot and file system tracks and then served from there
+    void setDiskCacheDir(const std::string& directory);
+
+    // Key of a sector in the bad sector map
+    static uint32_t badSectorKey(const uint32_t fileSystem, const uint32_t track, const uint32_t sector) { return (fileSystem * MAX_TRACKS + track) * MAX_DECODED_SECTORS + sector; };
 };
@@ -34,6 +34,10 @@ bool SectorRW_FloppyBridge::resetDrive(uint32_t cylinder) {
 bool SectorRW_FloppyBridge::writeCompleted() {
     return m_bridge && m_bridge->isWriteComplete();
 }
+void SectorRW_FloppyBridge::waitForDriveEvent(uint32_t timeoutMs) {
+    if (m_bridge) m_bridge->waitForEvent(m_eventGeneration, timeoutMs);
+    else SectorCacheMFM::waitForDriveEvent(timeoutMs);
+}
 bool SectorRW_FloppyBridge::cylinderSeek(uint32_t cylinder, bool upperSide) {
     if (!m_bridge) return false;
     m_bridge->gotoCylinder(cylinder, upperSide);
@@ -124,7 +128,7 @@ bool SectorRW_FloppyBridge::runCleaning(std::function<bool(uint16_t position, ui
     uint32_t counter = 0;
     // Wait for spinup
     for (counter=0; counter<12; counter++) {
-        sleep(50);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
         if (!progress(0, progressMax)) {
             m_bridge->setMotorStatus(false, false);
             return false;
@@ -136,14 +140,14 @@ bool SectorRW_FloppyBridge::runCleaning(std::function<bool(uint16_t position, ui
     for (uint32_t cycle = 0; cycle < REPEAT_COUNT; cycle++) {
         for (uint32_t cylinder = 0; cylinder < m_bridge->getMaxCylinder() - steps; cylinder += steps) {
             m_bridge->gotoCylinder(cylinder + steps - 1, false);
-            sleep(300);
+            std::this_thread::sleep_for(std::chrono::milliseconds(300));
             if (!progress(++counter, progressMax)) {
                 m_bridge->setMotorStatus(false, false);
                 m_bridge->gotoCylinder(0, false);
                 return false;
             }
             m_bridge->gotoCylinder(cylinder, false);
-            sleep(300);
+            std::this_thread::sleep_for(std::chrono::milliseconds(300));
             if (!progress(++counter, progressMax)) {
                 m_bridge->setMotorStatus(false, false);
                 m_bridge->gotoCylinder(0, false);
@@ -182,6 +186,8 @@ bool SectorRW_FloppyBridge::available() {
 
 // Rapid shutdown
 void SectorRW_FloppyBridge::quickClose() {
+    // The background threads use the bridge
+    stopWorkers();
     if (m_bridge) {
         m_bridge->shutdown();
         delete m_bridge;
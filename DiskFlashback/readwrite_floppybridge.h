@@ -27,6 +27,7 @@ class SectorRW_FloppyBridge : public SectorCacheMFM {
 private:
     FloppyBridgeAPI* m_bridge       = nullptr;
     FloppyBridge::BridgeDensityMode m_densityMode = FloppyBridge::BridgeDensityMode::bdmAuto;
+    unsigned int m_eventGeneration = 0;
 protected:
     virtual bool restoreDrive() override;
     virtual void releaseDrive() override;
@@ -37,6 +38,7 @@ protected:
     virtual bool motorReady() override;
     virtual bool resetDrive(uint32_t cylinder) override;
     virtual bool writeCompleted() override;
+    virtual void waitForDriveEvent(uint32_t timeoutMs) override;
     virtual bool cylinderSeek(uint32_t cylinder, bool upperSide) override;
     virtual uint32_t mfmRead(uint32_t cylinder, bool upperSide, bool retryMode, void* data, uint32_t maxLength) override;
     virtual bool mfmWrite(uint32_t cylinder, bool upperSide, bool fromIndex, void* data, uint32_t maxLength) override;
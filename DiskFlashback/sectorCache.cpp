@@ -14,85 +14,199 @@
 
 #include "sectorCache.h"
 #include <safe_mem_lib.h>
+#include <new>
+
+// Take an entry out of the LRU list
+void SectorCacheEngine::unlinkEntry(SectorData* entry) {
+    if (entry->newer) entry->newer->older = entry->older; else m_newest = entry->older;
+    if (entry->older) entry->older->newer = entry->newer; else m_oldest = entry->newer;
+    entry->newer = entry->older = nullptr;
+}
+
+// Mark an entry as the most recently used
+void SectorCacheEngine::pushNewest(SectorData* entry) {
+    entry->newer = nullptr;
+    entry->older = m_newest;
+    if (m_newest) m_newest->newer = entry; else m_oldest = entry;
+    m_newest = entry;
+}
 
 // Get oldest sector we've cached and remove it, but don't free it!
 SectorCacheEngine::SectorData* SectorCacheEngine::getAndReleaseOldestSector() {
-    SectorData* result = nullptr;
-    uint32_t sectorNumber = 0;
-
-    for (auto cache : m_cache)
-        if ((!result) || (cache.second->lastUse < result->lastUse)) {
-            result = cache.second;
-            sectorNumber = cache.first;
-        }
+    SectorData* result = m_oldest;
     if (!result) return nullptr;
 
-    m_cache.erase(sectorNumber);
+    unlinkEntry(result);
+    m_cache.erase(result->sectorNumber);
     return result;
 }
 
+// Release the slab, the next write sizes it again
+void SectorCacheEngine::dropSlab() {
+    m_cache.clear();
+    m_newest = m_oldest = m_freeEntries = nullptr;
+    m_slab.clear();
+    m_slab.shrink_to_fit();
+    m_entries.clear();
+    m_entries.shrink_to_fit();
+    m_slotSize = 0;
+    m_maxCacheEntries = 0;
+}
+
+// Carve every sector buffer out of one block sized from the memory budget
+bool SectorCacheEngine::allocateSlab(const uint32_t sectorSize) {
+    if (sectorSize <= m_slotSize) return true;
+
+    // Bigger sectors than before (new disk format), start again
+    m_cache.clear();
+    m_newest = m_oldest = m_freeEntries = nullptr;
+    uint64_t budget = m_cacheMaxMem;
+    if (m_resident) {
+        // Room for every sector of the disk, hybrid disks are cached under both layouts
+        budget = getDiskDataSize();
+        if (hybridIsSeparate()) budget += hybridGetDiskDataSize();
+    }
+    m_maxCacheEntries = (uint32_t)std::min(budget / sectorSize, (uint64_t)UINT32_MAX);
+    if (!m_maxCacheEntries) return false;
+
+    try {
+        m_slab.assign((size_t)m_maxCacheEntries * sectorSize, 0);
+        m_entries.assign(m_maxCacheEntries, SectorData{});
+        m_cache.reserve(m_maxCacheEntries);
+    }
+    catch (const std::bad_alloc&) {
+        m_slab.clear();
+        m_entries.clear();
+        m_slotSize = 0;
+        m_maxCacheEntries = 0;
+        return false;
+    }
+    m_slotSize = sectorSize;
+    for (uint32_t i = 0; i < m_maxCacheEntries; i++) {
+        m_entries[i].data = m_slab.data() + (size_t)i * sectorSize;
+        m_entries[i].newer = m_freeEntries;
+        m_freeEntries = &m_entries[i];
+    }
+    return true;
+}
 
 // Write data to the cache
 void SectorCacheEngine::writeCache(const uint32_t sectorNumber, const uint32_t sectorSize, const void* data) {
-    if (!m_cacheMaxMem) return;
+    if (!isCacheEnabled()) return;
+    if (!allocateSlab(sectorSize)) return;
 
     auto f = m_cache.find(sectorNumber);
     SectorData* secData;
 
     if (f == m_cache.end()) {
-        if (m_maxCacheEntries == 0) m_maxCacheEntries = m_cacheMaxMem / sectorSize; // approx
-
-        // If cache size is ZERO it means cache everything
-        if (m_cache.size() > m_maxCacheEntries) {
-            secData = getAndReleaseOldestSector();
-            if (!secData) return;
-            if (secData->sectorSize != sectorSize) {
-                free(secData->data);
-                secData->data = malloc(sectorSize);
-                secData->sectorSize = sectorSize;
-            }
+        if (m_freeEntries) {
+            secData = m_freeEntries;
+            m_freeEntries = secData->newer;
         }
         else {
-            secData = new SectorData();
+            secData = getAndReleaseOldestSector();
             if (!secData) return;
-            secData->data = malloc(sectorSize);
-            secData->sectorSize = sectorSize;
-            if (!secData->data) {
-                delete secData;
-                return;
-            }
         }
+        secData->sectorNumber = sectorNumber;
         m_cache.insert(std::make_pair(sectorNumber, secData));
     }
     else {
         secData = f->second;
+        unlinkEntry(secData);
     }
 
     // Make a copy
-    memcpy_s(secData->data, sectorSize, data, sectorSize);
-    secData->lastUse = std::chrono::system_clock::to_time_t (std::chrono::system_clock::now());
+    secData->sectorSize = sectorSize;
+    memcpy_s(secData->data, m_slotSize, data, sectorSize);
+    pushNewest(secData);
 }
 
 // Read data from the cache
 bool SectorCacheEngine::readCache(const uint32_t sectorNumber, const uint32_t sectorSize, void* data) {
-    if (!m_cacheMaxMem) return false;
+    if (!isCacheEnabled()) return false;
 
     auto f = m_cache.find(sectorNumber);
     if (f == m_cache.end()) return false;
-    if (m_maxCacheEntries == 0) m_maxCacheEntries = m_cacheMaxMem / sectorSize;
 
-    memcpy_s(data, sectorSize, f->second->data, std::min(sectorSize, f->second->sectorSize));
-    f->second->lastUse = std::chrono::system_clock::to_time_t (std::chrono::system_clock::now());
+    SectorData* secData = f->second;
+    memcpy_s(data, sectorSize, secData->data, std::min(sectorSize, secData->sectorSize));
+    if (secData != m_newest) {
+        unlinkEntry(secData);
+        pushNewest(secData);
+    }
     return true;
 }
 
-// Reset the cache
+// Take one sector out of the cache and give its slot back
+void SectorCacheEngine::removeCacheEntry(const uint32_t sectorNumber) {
+    auto f = m_cache.find(sectorNumber);
+    if (f == m_cache.end()) return;
+    SectorData* secData = f->second;
+    m_cache.erase(f);
+    unlinkEntry(secData);
+    secData->newer = m_freeEntries;
+    m_freeEntries = secData;
+}
+
+// Queue sectors to be taken out of the cache
+void SectorCacheEngine::dropFromCache(const uint32_t firstSector, const uint32_t count) {
+    if (!count) return;
+    std::lock_guard lock(m_dropLock);
+    m_dropRanges.push_back(std::make_pair(firstSector, count));
+    m_dropPending = true;
+}
+
+// Take out anything queued by dropFromCache
+void SectorCacheEngine::applyDrops() {
+    if (!m_dropPending) return;
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+    {
+        std::lock_guard lock(m_dropLock);
+        ranges.swap(m_dropRanges);
+        m_dropPending = false;
+    }
+    if (m_cache.empty()) return;
+    for (const auto& range : ranges)
+        for (uint32_t i = 0; i < range.second; i++) {
+            removeCacheEntry(range.first + i);
+            removeCacheEntry(HYBRID_CACHE_KEY | (range.first + i));
+        }
+}
+
+// Reset the cache, the slab is kept for the next disk unless it was sized for the last one
 void SectorCacheEngine::resetCache() {
-    for (auto it : m_cache) {
-        if (it.second->data) free(it.second->data);
-        delete it.second;
+    std::lock_guard lock(m_multithreadLock);
+    {
+        std::lock_guard dropLock(m_dropLock);
+        m_dropRanges.clear();
+        m_dropPending = false;
+    }
+    if (m_resident) {
+        dropSlab();
+        return;
     }
     m_cache.clear();
+    m_newest = m_oldest = m_freeEntries = nullptr;
+    for (SectorData& entry : m_entries) {
+        entry.older = nullptr;
+        entry.newer = m_freeEntries;
+        m_freeEntries = &entry;
+    }
+}
+
+// Change the memory budget, this empties the cache
+void SectorCacheEngine::setCacheSize(const uint32_t maxCacheMem) {
+    std::lock_guard lock(m_multithreadLock);
+    m_cacheMaxMem = maxCacheMem;
+    m_resident = false;
+    dropSlab();
+}
+
+// Keep every sector of the current disk, sized again for each disk
+void SectorCacheEngine::setResidentMode(const bool resident) {
+    std::lock_guard lock(m_multithreadLock);
+    m_resident = resident;
+    dropSlab();
 }
 
 SectorCacheEngine::SectorCacheEngine(const uint32_t maxCacheMem) : m_maxCacheEntries(0), m_cacheMaxMem(maxCacheMem) {
@@ -100,34 +214,101 @@ SectorCacheEngine::SectorCacheEngine(const uint32_t maxCacheMem) : m_maxCacheEnt
 }
 
 SectorCacheEngine::~SectorCacheEngine() {
-    resetCache();
+    std::lock_guard lock(m_multithreadLock);
+    dropSlab();
 }
 
 bool SectorCacheEngine::hybridReadData(const uint32_t sectorNumber, const uint32_t sectorSize, void* data) { 
-    std::lock_guard lock(m_multithreadLock);
-    return internalHybridReadData(sectorNumber, sectorSize, data); 
+    return hybridReadSectors(sectorNumber, 1, sectorSize, data);
 };
 
 bool SectorCacheEngine::readData(const uint32_t sectorNumber, const uint32_t sectorSize, void* data) {
+    return readSectors(sectorNumber, 1, sectorSize, data);
+}
+
+bool SectorCacheEngine::writeData(const uint32_t sectorNumber, const uint32_t sectorSize, const void* data) {
+    if (!admitWrite(sectorNumber, 1)) return false;
+    std::lock_guard writeLock(m_writeLock);
+    const bool ok = internalWriteData(sectorNumber, sectorSize, data);
+
     std::lock_guard lock(m_multithreadLock);
+    applyDrops();
+    if (ok) writeCache(sectorNumber, sectorSize, data);
+    else removeCacheEntry(sectorNumber);
+    return ok;
+}
 
-    if (readCache(sectorNumber, sectorSize, data)) return true;
+// Default range implementations, one sector at a time
+bool SectorCacheEngine::internalReadSectors(const uint32_t firstSector, const uint32_t count, const uint32_t sectorSize, void* data) {
+    for (uint32_t i = 0; i < count; i++)
+        if (!internalReadData(firstSector + i, sectorSize, (uint8_t*)data + i * sectorSize)) return false;
+    return true;
+}
 
-    if (internalReadData(sectorNumber, sectorSize, data)) {
-        writeCache(sectorNumber, sectorSize, data);
-        return true;
-    }
+bool SectorCacheEngine::internalHybridReadSectors(const uint32_t firstSector, const uint32_t count, const uint32_t sectorSize, void* data) {
+    for (uint32_t i = 0; i < count; i++)
+        if (!internalHybridReadData(firstSector + i, sectorSize, (uint8_t*)data + i * sectorSize)) return false;
+    return true;
+}
 
-    return false;
+bool SectorCacheEngine::internalWriteSectors(const uint32_t firstSector, const uint32_t count, const uint32_t sectorSize, const void* data) {
+    for (uint32_t i = 0; i < count; i++)
+        if (!internalWriteData(firstSector + i, sectorSize, (const uint8_t*)data + i * sectorSize)) return false;
+    return true;
 }
 
-bool SectorCacheEngine::writeData(const uint32_t sectorNumber, const uint32_t sectorSize, const void* data) {
+// Read through the cache, only runs of missing sectors reach the drive
+bool SectorCacheEngine::cachedReadSectors(const uint32_t firstSector, const uint32_t count, const uint32_t sectorSize, void* data, const bool hybrid) {
     std::lock_guard lock(m_multithreadLock);
+    applyDrops();
+
+    // The hybrid layout numbers its sectors differently, keep those apart
+    const uint32_t keyBase = (hybrid && hybridIsSeparate()) ? HYBRID_CACHE_KEY : 0;
+    uint8_t* output = (uint8_t*)data;
+    uint32_t i = 0;
+    while (i < count) {
+        if (readCache(keyBase | (firstSector + i), sectorSize, output + i * sectorSize)) {
+            i++;
+            continue;
+        }
+        // Hand the whole run of missing sectors over in one request
+        uint32_t runEnd = i + 1;
+        while ((runEnd < count) && (!readCache(keyBase | (firstSector + runEnd), sectorSize, output + runEnd * sectorSize))) runEnd++;
+        m_skipCacheFill = false;
+        const bool ok = hybrid ? internalHybridReadSectors(firstSector + i, runEnd - i, sectorSize, output + i * sectorSize) :
+                                 internalReadSectors(firstSector + i, runEnd - i, sectorSize, output + i * sectorSize);
+        if (!ok) return false;
+        if (m_skipCacheFill) {
+            // Not what's on the disk, the next read has to try again
+            i = runEnd;
+            continue;
+        }
+        for (; i < runEnd; i++)
+            writeCache(keyBase | (firstSector + i), sectorSize, output + i * sectorSize);
+    }
+    return true;
+}
+
+bool SectorCacheEngine::readSectors(const uint32_t firstSector, const uint32_t count, const uint32_t sectorSize, void* data) {
+    return cachedReadSectors(firstSector, count, sectorSize, data, false);
+}
 
-    if (internalWriteData(sectorNumber, sectorSize, data)) {
-        writeCache(sectorNumber, sectorSize, data);
-        return true;
-    } 
-    return false;
+bool SectorCacheEngine::hybridReadSectors(const uint32_t firstSector, const uint32_t count, const uint32_t sectorSize, void* data) {
+    return cachedReadSectors(firstSector, count, sectorSize, data, true);
 }
 
+// The drive side is updated first without the cache lock, then the cache. A read that misses meanwhile
+// already gets the new data from the drive side, and the cache is only written after it
+bool SectorCacheEngine::writeSectors(const uint32_t firstSector, const uint32_t count, const uint32_t sectorSize, const void* data) {
+    if (!admitWrite(firstSector, count)) return false;
+    std::lock_guard writeLock(m_writeLock);
+    const bool ok = internalWriteSectors(firstSector, count, sectorSize, data);
+
+    std::lock_guard lock(m_multithreadLock);
+    applyDrops();
+    for (uint32_t i = 0; i < count; i++)
+        // Part of a failed run may have been taken, what was cached can't be trusted either way
+        if (ok) writeCache(firstSector + i, sectorSize, (const uint8_t*)data + i * sectorSize);
+        else removeCacheEntry(firstSector + i);
+    return ok;
+}
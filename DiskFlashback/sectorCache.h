@@ -16,31 +16,67 @@
 
 
 #include <unordered_map>
+#include <vector>
 #include <atomic>
 #include <mutex>
 
 
+// Cache keys of sectors read through the hybrid layout when it differs from the normal one
+#define HYBRID_CACHE_KEY                    0x80000000U
+
 // Possible types of sector / file
 enum class SectorType  {stAmiga, stIBM, stAtari, stHybrid, stUnknown };
 
 class SectorCacheEngine {
 private:
+    // Entries live in one array and point into one buffer, both allocated once
     struct SectorData {
-        void* data;
-        uint64_t lastUse;
+        uint8_t* data;
+        uint32_t sectorNumber;
         uint32_t sectorSize;
+        SectorData* newer;      // LRU list, or the next free entry
+        SectorData* older;
     };
 
     uint32_t m_maxCacheEntries;
-    const uint32_t m_cacheMaxMem;
+    uint32_t m_cacheMaxMem;
+    bool m_resident = false;
 
     std::mutex m_multithreadLock;
     std::atomic<bool> m_isLocked = false;
+    // Serialises writes, which reach the drive side without m_multithreadLock. Taken before it, never after
+    std::mutex m_writeLock;
 
     // Sector disk cache for speed
     std::unordered_map<uint32_t, SectorData*> m_cache;
+    std::vector<SectorData> m_entries;
+    std::vector<uint8_t> m_slab;
+    uint32_t m_slotSize = 0;
+    SectorData* m_freeEntries = nullptr;
+    SectorData* m_newest = nullptr;
+    SectorData* m_oldest = nullptr;
+
+    // Sectors to take out of the cache the next time it's used, queued from threads that can't take m_multithreadLock
+    std::mutex m_dropLock;
+    std::vector<std::pair<uint32_t, uint32_t>> m_dropRanges;
+    std::atomic<bool> m_dropPending = false;
+    // Set by an internal read that returned sectors that aren't really what's on the disk
+    std::atomic<bool> m_skipCacheFill = false;
+
+    // Size the slab for sectors of this size, returns false if the cache can't be used
+    bool allocateSlab(const uint32_t sectorSize);
+    void dropSlab();
+    bool isCacheEnabled() const { return m_resident || m_cacheMaxMem; };
+    // Least recently used list
+    void unlinkEntry(SectorData* entry);
+    void pushNewest(SectorData* entry);
 
     SectorData* getAndReleaseOldestSector();
+    void removeCacheEntry(const uint32_t sectorNumber);
+    // Apply dropFromCache, m_multithreadLock must already be held
+    void applyDrops();
+
+    bool cachedReadSectors(const uint32_t firstSector, const uint32_t count, const uint32_t sectorSize, void* data, const bool hybrid);
 
 protected:
     // Write data to the cache
@@ -48,11 +84,28 @@ protected:
     // Read data from the cache
     bool readCache(const uint32_t sectorNumber, const uint32_t sectorSize, void* data);
 
+    // Take sectors out of the cache. Safe from any thread whatever locks it holds, they go before the cache is next used
+    void dropFromCache(const uint32_t firstSector, const uint32_t count);
+    // Called from inside an internal read whose sectors mustn't be cached, such as filled in unreadable ones
+    void doNotCacheRead() { m_skipCacheFill = true; };
+
 
     // Override.  
     virtual bool internalReadData(const uint32_t sectorNumber, const uint32_t sectorSize, void* data) = 0;
     virtual bool internalHybridReadData(const uint32_t sectorNumber, const uint32_t sectorSize, void* data) { return internalReadData(sectorNumber, sectorSize, data); };
+    // Writes are called without the cache lock, so cached reads carry on, and must be safe alongside the reads
     virtual bool internalWriteData(const uint32_t sectorNumber, const uint32_t sectorSize, const void* data) = 0;
+
+    // Override to service a run of consecutive sectors in one go. The defaults go one sector at a time
+    virtual bool internalReadSectors(const uint32_t firstSector, const uint32_t count, const uint32_t sectorSize, void* data);
+    virtual bool internalHybridReadSectors(const uint32_t firstSector, const uint32_t count, const uint32_t sectorSize, void* data);
+    virtual bool internalWriteSectors(const uint32_t firstSector, const uint32_t count, const uint32_t sectorSize, const void* data);
+
+    // Return TRUE if hybrid reads use a different sector layout to normal reads
+    virtual bool hybridIsSeparate() { return false; };
+
+    // Called before a write takes the cache lock, so waiting here for room to write doesn't hold up cached reads
+    virtual bool admitWrite(const uint32_t /*firstSector*/, const uint32_t /*count*/) { return true; };
 public:
     // Create cache engine, setting maxCacheMem to zero disables the cache
     SectorCacheEngine(const uint32_t maxCacheMem);
@@ -61,6 +114,10 @@ public:
     // Reset the cache
     virtual void resetCache();
 
+    // Change the memory budget (zero disables the cache), or keep every sector of the disk
+    void setCacheSize(const uint32_t maxCacheMem);
+    void setResidentMode(const bool resident);
+
     // Special lock flag that locks out Dokan while we're doing low-level stuff
     bool isAccessLocked() { return m_isLocked; };
     void setLocked(bool locked) { m_isLocked = locked; };
@@ -69,6 +126,11 @@ public:
     bool writeData(const uint32_t sectorNumber, const uint32_t sectorSize, const void* data);
     bool hybridReadData(const uint32_t sectorNumber, const uint32_t sectorSize, void* data);
 
+    // Same as above for count consecutive sectors, data holds count * sectorSize bytes
+    bool readSectors(const uint32_t firstSector, const uint32_t count, const uint32_t sectorSize, void* data);
+    bool writeSectors(const uint32_t firstSector, const uint32_t count, const uint32_t sectorSize, const void* data);
+    bool hybridReadSectors(const uint32_t firstSector, const uint32_t count, const uint32_t sectorSize, void* data);
+
     virtual bool isDiskPresent() = 0;
     virtual bool isDiskWriteProtected() = 0;
 
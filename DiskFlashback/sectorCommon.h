@@ -1,25 +1,96 @@
 #pragma once
 
-#define MFM_MASK					0x55555555L		
+#define MFM_MASK					0x55555555L
 #define DEFAULT_SECTOR_BYTES		512				// Number of bytes in a decoded sector - the default, but NOT always
 #define MAX_TRACK_SIZE				(0x3A00 * 2)	// used for MFM encoding etc
+#define MAX_DECODED_SECTORS			22				// Most sectors a track can hold (Amiga HD), sector numbers run from 0 to this-1
+#define MAX_DECODED_TRACK_BYTES		(MAX_DECODED_SECTORS * DEFAULT_SECTOR_BYTES)
 
-#include <map>
-#include <vector>
+#include <stdint.h>
+#include <string.h>
+#include <bit>
 
-typedef std::vector<uint8_t> RawDecodedSector;
+// To hold a list of valid and checksum failed sectors.
+// Everything lives in this one block so decoding, merging and copying a track never touches the heap.
+// Every sector on a track has the same size, set by the first one added
+struct DecodedTrack {
+	alignas(16) uint8_t buffer[MAX_DECODED_TRACK_BYTES];	// sector n is at n * sectorSize
+	uint32_t numErrors[MAX_DECODED_SECTORS];				// Number of decoding errors found per sector
+	uint32_t present = 0;									// bit n is set if sector n is held
+	uint32_t sectorSize = 0;								// 0 until a sector is added
 
-// Structure to hold data while we decode it
-typedef struct {
-	uint32_t numErrors;					// Number of decoding errors found
-	RawDecodedSector data;          // decoded sector data
-} DecodedSector;
+	uint32_t sectorsWithErrors = 0;
+	uint32_t revision = 0;									// goes up whenever a sector is added or replaced, never reset
 
-// To hold a list of valid and checksum failed sectors
-struct DecodedTrack {
-	// A map of sector number to valid sectors 
-	std::map<int, DecodedSector> sectors;
+	bool has(const uint32_t sector) const { return (sector < MAX_DECODED_SECTORS) && (present & (1U << sector)); }
+	uint32_t count() const { return (uint32_t)std::popcount(present); }
+	// Highest sector number held, or -1 if empty
+	int last() const { return present ? 31 - std::countl_zero(present) : -1; }
+
+	uint8_t* data(const uint32_t sector) { return buffer + sector * sectorSize; }
+	const uint8_t* data(const uint32_t sector) const { return buffer + sector * sectorSize; }
 
-	uint32_t sectorsWithErrors;
+	// Claim the slot for a sector and return where its data goes, or nullptr if it doesn't fit this track
+	uint8_t* add(const uint32_t sector, const uint32_t size, const uint32_t errors) {
+		if (sector >= MAX_DECODED_SECTORS) return nullptr;
+		if (!present) sectorSize = size; else if (size != sectorSize) return nullptr;
+		if ((sector + 1) * sectorSize > MAX_DECODED_TRACK_BYTES) return nullptr;
+		present |= 1U << sector;
+		numErrors[sector] = errors;
+		revision++;
+		return data(sector);
+	}
+	// As above but the contents are copied in
+	bool set(const uint32_t sector, const uint8_t* src, const uint32_t size, const uint32_t errors) {
+		uint8_t* target = add(sector, size, errors);
+		if (!target) return false;
+		memcpy(target, src, size);
+		return true;
+	}
+	// Overwrite a sector already held, with a copy of the same size
+	void replace(const uint32_t sector, const uint8_t* src, const uint32_t errors) {
+		memcpy(data(sector), src, sectorSize);
+		numErrors[sector] = errors;
+		revision++;
+	}
+	void remove(const uint32_t sector) { if (sector < MAX_DECODED_SECTORS) present &= ~(1U << sector); }
+	void clear() { present = 0; sectorSize = 0; sectorsWithErrors = 0; }
 };
 
+// Copies numBytes * 8 bits out of a track starting at bitPos, byte aligned into output, wrapping round at the end.
+// Runs of 64 bits that don't cross the end are funnel-shifted out of two big-endian loads
+inline void extractTrackBits(const uint8_t* track, const uint32_t dataLengthInBits, uint32_t bitPos, uint32_t numBytes, uint8_t* output) {
+	if (!dataLengthInBits) return;
+	bitPos %= dataLengthInBits;
+	while (numBytes) {
+		const uint32_t trackBytePos = bitPos >> 3;
+		const uint32_t shift = bitPos & 7;
+		const uint8_t* in = track + trackBytePos;
+		if ((numBytes >= 8) && (bitPos + 64 <= dataLengthInBits)) {
+			uint64_t value = ((uint64_t)in[0] << 56) | ((uint64_t)in[1] << 48) | ((uint64_t)in[2] << 40) | ((uint64_t)in[3] << 32) |
+				((uint64_t)in[4] << 24) | ((uint64_t)in[5] << 16) | ((uint64_t)in[6] << 8) | (uint64_t)in[7];
+			// The byte after is only read if it holds some of the bits
+			if (shift) value = (value << shift) | (in[8] >> (8 - shift));
+			for (uint32_t i = 0; i < 8; i++) output[i] = (uint8_t)(value >> (56 - i * 8));
+			output += 8;
+			numBytes -= 8;
+			bitPos += 64;
+		}
+		else {
+			if (bitPos + 8 <= dataLengthInBits) *output = shift ? (uint8_t)((in[0] << shift) | (in[1] >> (8 - shift))) : in[0];
+			else {
+				// Wraps around the end of the track
+				uint8_t byteOut = 0;
+				for (uint32_t bit = 0, realBitPos = bitPos; bit < 8; bit++) {
+					byteOut = (byteOut << 1) | ((track[realBitPos >> 3] >> (7 - (realBitPos & 7))) & 1);
+					if (++realBitPos == dataLengthInBits) realBitPos = 0;
+				}
+				*output = byteOut;
+			}
+			output++;
+			numBytes--;
+			bitPos += 8;
+		}
+		if (bitPos >= dataLengthInBits) bitPos -= dataLengthInBits;
+	}
+}
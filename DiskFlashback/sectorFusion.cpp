@@ -0,0 +1,88 @@
+#include "sectorFusion.h"
+#include <string.h>
+
+// Copies are only kept for one track, a different one starts again
+void SectorFusion::begin(const uint32_t track) {
+	if (track == m_track) return;
+	m_track = track;
+	for (Slot& slot : m_slots) slot.numCopies = slot.next = 0;
+}
+
+// The sector read back fine, its copies aren't needed any more
+void SectorFusion::discard(const uint32_t sector) {
+	if (sector < MAX_DECODED_SECTORS) m_slots[sector].numCopies = m_slots[sector].next = 0;
+}
+
+// Add a failed copy and vote
+bool SectorFusion::fuse(const uint32_t sector, const uint8_t* raw, const uint32_t size, FusionCheck check, uint8_t* result) {
+	if ((sector >= MAX_DECODED_SECTORS) || (size > FUSION_MAX_BYTES) || (!size)) return false;
+	Slot& slot = m_slots[sector];
+	if (slot.size != size) {
+		slot.size = size;
+		slot.numCopies = slot.next = 0;
+	}
+
+	// The overlap at the end of a revolution decodes the same bits twice, that's no new evidence
+	for (uint32_t c = 0; c < slot.numCopies; c++)
+		if (memcmp(slot.copies[c], raw, size) == 0) return false;
+
+	memcpy(slot.copies[slot.next], raw, size);
+	const uint32_t newest = slot.next;
+	slot.next = (slot.next + 1) % FUSION_COPIES;
+	if (slot.numCopies < FUSION_COPIES) slot.numCopies++;
+	if (slot.numCopies < 2) return false;
+
+	// Least agreed bits seen, ordered by margin
+	uint32_t weakBit[FUSION_FLIP_BITS];
+	uint32_t weakMargin[FUSION_FLIP_BITS];
+	uint32_t numWeak = 0;
+
+	const uint32_t n = slot.numCopies;
+	for (uint32_t byte = 0; byte < size; byte++) {
+		uint8_t all = 0xFF, any = 0;
+		for (uint32_t c = 0; c < n; c++) {
+			all &= slot.copies[c][byte];
+			any |= slot.copies[c][byte];
+		}
+		// Every copy agrees, which is nearly always
+		if (all == any) {
+			result[byte] = all;
+			continue;
+		}
+
+		uint8_t voted = all;
+		for (uint32_t bit = 0; bit < 8; bit++) {
+			const uint8_t mask = 1 << bit;
+			if (!((all ^ any) & mask)) continue;
+			uint32_t ones = 0;
+			for (uint32_t c = 0; c < n; c++)
+				if (slot.copies[c][byte] & mask) ones++;
+			// A tie goes to the most recent read
+			if ((ones * 2 > n) || ((ones * 2 == n) && (slot.copies[newest][byte] & mask))) voted |= mask;
+
+			const uint32_t margin = (ones * 2 > n) ? ones * 2 - n : n - ones * 2;
+			if ((numWeak == FUSION_FLIP_BITS) && (margin >= weakMargin[numWeak - 1])) continue;
+			uint32_t pos = (numWeak < FUSION_FLIP_BITS) ? numWeak++ : numWeak - 1;
+			for (; pos && (weakMargin[pos - 1] > margin); pos--) {
+				weakBit[pos] = weakBit[pos - 1];
+				weakMargin[pos] = weakMargin[pos - 1];
+			}
+			weakBit[pos] = byte * 8 + bit;
+			weakMargin[pos] = margin;
+		}
+		result[byte] = voted;
+	}
+
+	bool repaired = check(result, size);
+
+	// One bad bit left, most likely where the copies agree least
+	for (uint32_t w = 0; (w < numWeak) && (!repaired); w++) {
+		const uint8_t mask = 1 << (weakBit[w] & 7);
+		result[weakBit[w] >> 3] ^= mask;
+		repaired = check(result, size);
+		if (!repaired) result[weakBit[w] >> 3] ^= mask;
+	}
+
+	if (repaired) slot.numCopies = slot.next = 0;
+	return repaired;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include "sectorCommon.h"
+
+#define FUSION_COPIES			5		// Most recent bad copies of a sector kept for voting
+#define FUSION_MAX_BYTES		1040	// Largest raw sector (marks + data + checksum) that can be fused
+#define FUSION_FLIP_BITS		16		// Weakest bits tried as single-bit flips after a failed vote
+
+// Returns TRUE if a raw sector passes its checksum or CRC
+typedef bool (*FusionCheck)(const uint8_t* raw, const uint32_t size);
+
+// Keeps the last few copies of sectors that failed their checksum on one track, so a sector that
+// never reads back cleanly can be rebuilt by bitwise majority vote across revolutions
+class SectorFusion {
+private:
+	struct Slot {
+		uint32_t size = 0;
+		uint32_t numCopies = 0;
+		uint32_t next = 0;
+		uint8_t copies[FUSION_COPIES][FUSION_MAX_BYTES];
+	};
+
+	uint32_t m_track = UINT32_MAX;
+	Slot m_slots[MAX_DECODED_SECTORS];
+
+public:
+	// Copies are only kept for one track, a different one starts again
+	void begin(const uint32_t track);
+	void reset() { begin(UINT32_MAX); }
+
+	// The sector read back fine, its copies aren't needed any more
+	void discard(const uint32_t sector);
+
+	// Add a failed copy and vote. Returns TRUE with the repaired sector in result if the vote, or flipping one
+	// of the least agreed bits, passes check. result must hold size bytes
+	bool fuse(const uint32_t sector, const uint8_t* raw, const uint32_t size, FusionCheck check, uint8_t* result);
+};
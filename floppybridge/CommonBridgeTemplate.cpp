@@ -212,6 +212,7 @@ void CommonBridgeTemplate::pushOntoQueue(const QueueInfo& info, const bool shoul
 		std::lock_guard lock(m_queueProtect);
 		if (insertAtStart) m_queue.push_front(info); else m_queue.push_back(info);
 	}
+	m_queueFlag.notify_one();
 
 	// A little sneaky trick.  If there's a command to move on, but we have like 90% of the data and we don't have a complete reading for that track yet, it makes sense to carry on and finish it.
 	if ((m_driveStreamingData) && ((m_bridgeMode == FloppyBridge::BridgeMode::bmStalling) || m_extractor.isNearlyReady()) && (!m_mfmRead[m_actualCurrentCylinder][(int)m_actualFloppySide].current.ready)) return;
@@ -263,11 +264,44 @@ bool CommonBridgeTemplate::isReadyForManualDiskCheck() {
 	}
 }
 
+// Wake anyone in waitForEvent
+void CommonBridgeTemplate::signalEvent() {
+	{
+		std::lock_guard lock(m_eventLock);
+		m_eventGeneration++;
+	}
+	m_eventFlag.notify_all();
+}
+
+// Packs the states waitForEvent callers are interested in
+unsigned int CommonBridgeTemplate::eventState() {
+	return (isReady() ? 1 : 0) | (m_diskInDrive ? 2 : 0) | (m_writeComplete ? 4 : 0) | (m_readBufferAvailable ? 8 : 0) | (m_writeProtected ? 16 : 0);
+}
+
+// Wake anyone in waitForEvent if one of those states is different to last time. Called straight after they change,
+// rather than leaving it to the main thread, which could be in the middle of reading a whole revolution
+void CommonBridgeTemplate::publishEventState() {
+	const unsigned int state = eventState();
+	if (m_lastEventState.exchange(state) != state) signalEvent();
+}
+
+// Wait until the state changes or the timeout passes. generation is whatever the previous call returned
+bool CommonBridgeTemplate::waitForEvent(unsigned int& generation, unsigned int timeoutMs) {
+	std::unique_lock lock(m_eventLock);
+	const bool changed = m_eventFlag.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this, &generation]() { return m_eventGeneration != generation; });
+	generation = m_eventGeneration;
+	return changed;
+}
+
 // The main thread
 void CommonBridgeTemplate::mainThread() {
 	m_lastDiskCheckTime = std::chrono::steady_clock::now();
+	m_lastEventState = eventState();
 
 	for (;;) {
+		// Catches anything changed from other threads since last time round
+		publishEventState();
+
 		// Extract processing needed?
 		poll();
 
@@ -293,14 +327,19 @@ void CommonBridgeTemplate::mainThread() {
 		else {
 			// Trigger background reading if we're not busy
 			if (m_motorIsReady) {
-				std::this_thread::sleep_for(std::chrono::milliseconds(2));
+				{
+					// Idle, but a queued command cuts this short
+					std::unique_lock lock(m_queueProtect);
+					m_queueFlag.wait_for(lock, std::chrono::milliseconds(2), [this]() { return !m_queue.empty(); });
+				}
 				const auto timePassed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_delayStreamingStart).count();
 				if ((!m_delayStreaming) || ((m_delayStreaming) && (timePassed > 100)))
 					handleBackgroundDiskRead();
 			}
 			else {
 				handleBackgroundCaching();
-				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				std::unique_lock lock(m_queueProtect);
+				m_queueFlag.wait_for(lock, std::chrono::milliseconds(10), [this]() { return !m_queue.empty(); });
 			}			
 
 
@@ -327,6 +366,7 @@ void CommonBridgeTemplate::mainThread() {
 				m_firstTrackMode = !(m_mfmRead[m_actualCurrentCylinder][(int)m_actualFloppySide].current.ready || m_mfmRead[m_actualCurrentCylinder][1-(int)m_actualFloppySide].current.ready);
 				m_motorSpinningUp = false;
 				m_motorIsReady = true;
+				publishEventState();
 			}
 		}
 
@@ -347,6 +387,7 @@ void CommonBridgeTemplate::mainThread() {
 			}
 
 			m_diskInDrive = diskInDrive;
+			publishEventState();
 		}
 	}
 }
@@ -488,6 +529,7 @@ void CommonBridgeTemplate::saveNextBuffer(const int cylinder, const DiskSurface
 			m_readBufferAvailable = true;
 			m_readBufferAvailableFlag.notify_one();
 		}
+		publishEventState();
 	}
 }
 
@@ -574,6 +616,7 @@ void CommonBridgeTemplate::handleBackgroundDiskRead() {
 				 m_delayStreamingStart = std::chrono::steady_clock::now();
 				 resetMFMCache();
 				 m_inHDMode = false;
+				 publishEventState();
 				 break;
 
 			case ReadResponse::rrOK:
@@ -582,6 +625,7 @@ void CommonBridgeTemplate::handleBackgroundDiskRead() {
 					m_delayStreaming = false;
 					m_lastDiskCheckTime = std::chrono::steady_clock::now();
 					m_inHDMode = false;
+					publishEventState();
 				}
 				else {
 					if ((revolutionExtracted) && (!m_mfmRead[m_actualCurrentCylinder][(int)m_actualFloppySide].next.ready)) {
@@ -640,6 +684,7 @@ void CommonBridgeTemplate::handleBackgroundDiskRead() {
 					m_delayStreamingStart = std::chrono::steady_clock::now();
 					m_inHDMode = false;
 					resetMFMCache();
+					publishEventState();
 					break;
 
 				case ReadResponse::rrOK:
@@ -648,6 +693,7 @@ void CommonBridgeTemplate::handleBackgroundDiskRead() {
 						m_delayStreaming = false;
 						m_lastDiskCheckTime = std::chrono::steady_clock::now();
 						m_inHDMode = false;
+						publishEventState();
 					}
 					else {
 						if (m_firstTrackMode) {
@@ -750,6 +796,7 @@ void CommonBridgeTemplate::internalSwitchCylinder(const int cylinder, const Disk
 		m_writeCompletePending = false;
 		m_writeComplete = true;
 		m_lastWroteTo = (cylinder * 2) + ((int)side);
+		publishEventState();
 	}
 	else m_lastWroteTo = -1;
 }
@@ -1059,6 +1106,7 @@ void CommonBridgeTemplate::handleBackgroundCaching() {
 			m_delayStreamingStart = std::chrono::steady_clock::now();
 			resetMFMCache();
 			m_inHDMode = false;
+			publishEventState();
 			break;
 
 		case ReadResponse::rrOK:
@@ -1067,6 +1115,7 @@ void CommonBridgeTemplate::handleBackgroundCaching() {
 				m_delayStreaming = false;
 				m_lastDiskCheckTime = std::chrono::steady_clock::now();
 				m_inHDMode = false;
+				publishEventState();
 			}
 			break;
 		}
@@ -1166,6 +1215,7 @@ void CommonBridgeTemplate::processCommand(const QueueInfo& info) {
 			m_driveResetStatus = true;
 			m_driveResetStatusFlag.notify_one();
 		}
+		publishEventState();
 		break;
 
 	case QueueCommand::qcMotorOn:
@@ -1577,6 +1627,7 @@ bool CommonBridgeTemplate::writeMFMTrackToBuffer(bool side, unsigned int track,
 		m_writeCompletePending = false;
 		m_writePending = false;
 		m_writeComplete = true;
+		publishEventState();
 
 		// Prevent disk check while we're doing this
 		m_lastDiskCheckTime = std::chrono::steady_clock::now();
@@ -37,6 +37,7 @@
 #include <deque>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
 #include "floppybridge_abstract.h"
 #include "RotationExtractor.h"
 #include "floppybridge_common.h"
@@ -274,6 +275,16 @@ private:
 	// A lock to prevent buffer switch being accessed or changed in two places at once
 	std::mutex m_switchBufferLock;
 
+	// Wakes the main thread as soon as a command is queued
+	std::condition_variable m_queueFlag;
+
+	// Bumped and signalled whenever something a caller might be waiting for changes
+	std::mutex m_eventLock;
+	std::condition_variable m_eventFlag;
+	unsigned int m_eventGeneration = 0;
+	// The eventState() waiters were last woken for
+	std::atomic<unsigned int> m_lastEventState = 0;
+
 	// An event that is set the moment data is available
 	std::mutex m_readBufferAvailableLock;
 	std::condition_variable m_readBufferAvailableFlag;
@@ -345,6 +356,15 @@ private:
 
 	// For direct mode, allows you to lock the main thread queue so you can directly use the drive
 	void threadLockControl(bool enter);
+
+	// Wake anyone in waitForEvent
+	void signalEvent();
+
+	// Packs the states waitForEvent callers are interested in, so a change to any of them can be spotted
+	unsigned int eventState();
+
+	// Wake anyone in waitForEvent if eventState() has changed, called wherever those states change
+	void publishEventState();
 protected:
 	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	// Stuff that you need to implement in your derived class, a lot less than on the original bridge - These are all allowed to block as they're called from a thread
@@ -549,6 +569,9 @@ public:
 	// Set to TRUE if turbo writing is allowed (this is a sneaky DMA bypass trick)
 	virtual bool canTurboWrite() { return true; }
 
+	// Blocks until the drive state may have changed or timeoutMs passes
+	virtual bool waitForEvent(unsigned int& generation, unsigned int timeoutMs) override final;
+
 };
 
 #endif
\ No newline at end of file
@@ -1009,6 +1009,14 @@ extern "C" {
         }
         return false;
     }
+    FLOPPYBRIDGE_API bool CALLING_CONVENSION DRIVER_waitForEvent(BridgeOpened* bridgeDriverHandle, unsigned int* generation, unsigned int timeoutMs) {
+        if ((bridgeDriverHandle) && (bridgeDriverHandle->bridge) && (generation)) {
+            return bridgeDriverHandle->bridge->waitForEvent(*generation, timeoutMs);
+        }
+        // Nothing to wait on, but callers loop on this so still let the time pass
+        std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+        return false;
+    }
 }
 
 #ifdef _WIN32
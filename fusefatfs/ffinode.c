@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "ffinode.h"
+
+#define FFINODE_BUCKETS 1024
+
+static struct ffinode *ino_hash[FFINODE_BUCKETS];
+static struct ffinode *name_hash[FFINODE_BUCKETS];
+static uint64_t next_ino = FFINODE_ROOT + 1;
+static struct ffinode root;
+static pthread_mutex_t ffinode_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int hash_ino(uint64_t ino) {
+	return (unsigned int) (ino % FFINODE_BUCKETS);
+}
+
+static unsigned int hash_name(uint64_t parent, const char *name) {
+	uint64_t h = 1469598103934665603ULL ^ parent;
+	for (; *name; name++)
+		h = (h ^ (unsigned char) *name) * 1099511628211ULL;
+	return (unsigned int) (h % FFINODE_BUCKETS);
+}
+
+static struct ffinode *get_locked(uint64_t ino) {
+	struct ffinode *node;
+	for (node = ino_hash[hash_ino(ino)]; node != NULL; node = node->ino_next)
+		if (node->ino == ino)
+			return node;
+	return NULL;
+}
+
+static struct ffinode *find_locked(uint64_t parent, const char *name) {
+	struct ffinode *node;
+	for (node = name_hash[hash_name(parent, name)]; node != NULL; node = node->name_next)
+		if (node->parent == parent && strcmp(node->name, name) == 0)
+			return node;
+	return NULL;
+}
+
+static void unhash_name(struct ffinode *node) {
+	struct ffinode **scan;
+	for (scan = &name_hash[hash_name(node->parent, node->name)]; *scan != NULL; scan = &(*scan)->name_next)
+		if (*scan == node) {
+			*scan = node->name_next;
+			break;
+		}
+	node->name_next = NULL;
+}
+
+static void free_node(struct ffinode *node) {
+	struct ffinode **scan;
+	for (scan = &ino_hash[hash_ino(node->ino)]; *scan != NULL; scan = &(*scan)->ino_next)
+		if (*scan == node) {
+			*scan = node->ino_next;
+			break;
+		}
+	free(node->name);
+	free(node);
+}
+
+// Nodes stay around while the disk is unchanged, only stale ones go once the kernel forgot them
+static void make_stale(struct ffinode *node) {
+	unhash_name(node);
+	node->stale = 1;
+	if (node->nlookup == 0)
+		free_node(node);
+}
+
+void ffinode_init(void) {
+	memset(&root, 0, sizeof(root));
+	root.ino = FFINODE_ROOT;
+	root.parent = FFINODE_ROOT;
+	root.name = "";
+	root.nlookup = 1;
+	ino_hash[hash_ino(FFINODE_ROOT)] = &root;
+}
+
+void ffinode_fini(void) {
+	int i;
+	pthread_mutex_lock(&ffinode_mutex);
+	for (i = 0; i < FFINODE_BUCKETS; i++) {
+		struct ffinode *node = ino_hash[i];
+		while (node != NULL) {
+			struct ffinode *next = node->ino_next;
+			if (node != &root) {
+				free(node->name);
+				free(node);
+			}
+			node = next;
+		}
+		ino_hash[i] = NULL;
+		name_hash[i] = NULL;
+	}
+	pthread_mutex_unlock(&ffinode_mutex);
+}
+
+struct ffinode *ffinode_get(uint64_t ino) {
+	pthread_mutex_lock(&ffinode_mutex);
+	struct ffinode *node = get_locked(ino);
+	pthread_mutex_unlock(&ffinode_mutex);
+	return node;
+}
+
+// Get or create the node for a directory entry. lookup is non zero when the kernel takes a reference
+struct ffinode *ffinode_add(uint64_t parent, const char *name, int lookup) {
+	pthread_mutex_lock(&ffinode_mutex);
+	struct ffinode *node = find_locked(parent, name);
+	if (node == NULL) {
+		node = calloc(1, sizeof(struct ffinode));
+		if (node != NULL)
+			node->name = strdup(name);
+		if (node == NULL || node->name == NULL) {
+			free(node);
+			pthread_mutex_unlock(&ffinode_mutex);
+			return NULL;
+		}
+		node->ino = next_ino++;
+		node->parent = parent;
+		node->ino_next = ino_hash[hash_ino(node->ino)];
+		ino_hash[hash_ino(node->ino)] = node;
+		node->name_next = name_hash[hash_name(parent, name)];
+		name_hash[hash_name(parent, name)] = node;
+	}
+	if (lookup)
+		node->nlookup++;
+	pthread_mutex_unlock(&ffinode_mutex);
+	return node;
+}
+
+void ffinode_forget(uint64_t ino, uint64_t nlookup) {
+	pthread_mutex_lock(&ffinode_mutex);
+	struct ffinode *node = get_locked(ino);
+	if (node != NULL && node != &root) {
+		node->nlookup = (nlookup > node->nlookup) ? 0 : node->nlookup - nlookup;
+		if (node->nlookup == 0 && node->stale)
+			free_node(node);
+	}
+	pthread_mutex_unlock(&ffinode_mutex);
+}
+
+void ffinode_remove(uint64_t parent, const char *name) {
+	pthread_mutex_lock(&ffinode_mutex);
+	struct ffinode *node = find_locked(parent, name);
+	if (node != NULL)
+		make_stale(node);
+	pthread_mutex_unlock(&ffinode_mutex);
+}
+
+int ffinode_rename(uint64_t parent, const char *name, uint64_t newparent, const char *newname) {
+	pthread_mutex_lock(&ffinode_mutex);
+	struct ffinode *target = find_locked(newparent, newname);
+	struct ffinode *node = find_locked(parent, name);
+	if (target != NULL && target != node)
+		make_stale(target);
+	if (node != NULL) {
+		char *copy = strdup(newname);
+		if (copy == NULL) {
+			make_stale(node);
+			pthread_mutex_unlock(&ffinode_mutex);
+			return -ENOMEM;
+		}
+		unhash_name(node);
+		free(node->name);
+		node->name = copy;
+		node->parent = newparent;
+		node->name_next = name_hash[hash_name(newparent, newname)];
+		name_hash[hash_name(newparent, newname)] = node;
+	}
+	pthread_mutex_unlock(&ffinode_mutex);
+	return 0;
+}
+
+int ffinode_get_attr(uint64_t ino, struct stat *attr) {
+	int ret = -1;
+	pthread_mutex_lock(&ffinode_mutex);
+	struct ffinode *node = get_locked(ino);
+	if (node != NULL && !node->stale && node->attr_valid) {
+		*attr = node->attr;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&ffinode_mutex);
+	return ret;
+}
+
+void ffinode_set_attr(uint64_t ino, const struct stat *attr) {
+	pthread_mutex_lock(&ffinode_mutex);
+	struct ffinode *node = get_locked(ino);
+	if (node != NULL && !node->stale) {
+		node->attr = *attr;
+		node->attr_valid = 1;
+	}
+	pthread_mutex_unlock(&ffinode_mutex);
+}
+
+void ffinode_clear_attr(uint64_t ino) {
+	pthread_mutex_lock(&ffinode_mutex);
+	struct ffinode *node = get_locked(ino);
+	if (node != NULL)
+		node->attr_valid = 0;
+	pthread_mutex_unlock(&ffinode_mutex);
+}
+
+// Writes the path backwards from the end of buf, then moves it to the front
+static int path_locked(uint64_t ino, char *buf, size_t size) {
+	size_t pos = size;
+	if (size < 2)
+		return -ENAMETOOLONG;
+	buf[--pos] = 0;
+	struct ffinode *node = get_locked(ino);
+	if (node == NULL || node->stale)
+		return -ESTALE;
+	while (node != &root) {
+		size_t len = strlen(node->name);
+		if (len + 1 > pos)
+			return -ENAMETOOLONG;
+		pos -= len;
+		memcpy(buf + pos, node->name, len);
+		buf[--pos] = '/';
+		node = get_locked(node->parent);
+		if (node == NULL || node->stale)
+			return -ESTALE;
+	}
+	if (pos == size - 1)
+		buf[--pos] = '/';
+	memmove(buf, buf + pos, size - pos);
+	return (int) (size - pos - 1);
+}
+
+int ffinode_path(uint64_t ino, char *buf, size_t size) {
+	pthread_mutex_lock(&ffinode_mutex);
+	int len = path_locked(ino, buf, size);
+	pthread_mutex_unlock(&ffinode_mutex);
+	return len;
+}
+
+int ffinode_child_path(uint64_t parent, const char *name, char *buf, size_t size) {
+	int len = ffinode_path(parent, buf, size);
+	if (len < 0)
+		return len;
+	size_t namelen = strlen(name);
+	if (parent != FFINODE_ROOT)
+		buf[len++] = '/';
+	if (len + namelen + 1 > size)
+		return -ENAMETOOLONG;
+	memcpy(buf + len, name, namelen + 1);
+	return (int) (len + namelen);
+}
+
+void ffinode_invalidate_all(void (*cb)(uint64_t parent, const char *name, uint64_t ino, void *arg), void *arg) {
+	int i;
+	pthread_mutex_lock(&ffinode_mutex);
+	for (i = 0; i < FFINODE_BUCKETS; i++) {
+		struct ffinode *node = name_hash[i];
+		while (node != NULL) {
+			struct ffinode *next = node->name_next;
+			if (cb)
+				cb(node->parent, node->name, node->ino, arg);
+			node->name_next = NULL;
+			node->stale = 1;
+			if (node->nlookup == 0)
+				free_node(node);
+			node = next;
+		}
+		name_hash[i] = NULL;
+	}
+	pthread_mutex_unlock(&ffinode_mutex);
+}
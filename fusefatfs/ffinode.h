@@ -0,0 +1,48 @@
+#ifndef FFINODE_H
+#define FFINODE_H
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define FFINODE_ROOT 1
+
+/* FAT has no inode numbers, so every directory entry the kernel has seen gets one here.
+ * Nodes are keyed by parent inode + the name FatFs reports, which keeps the number stable
+ * for as long as the disk is not changed. */
+struct ffinode {
+	uint64_t ino;
+	uint64_t parent;
+	char *name;
+	uint64_t nlookup;
+	int stale;              // removed or from a previous disk, only kept until the kernel forgets it
+	int attr_valid;
+	struct stat attr;       // as last read from the directory entry
+	struct ffinode *ino_next;
+	struct ffinode *name_next;
+};
+
+void ffinode_init(void);
+void ffinode_fini(void);
+
+// All functions below take the table lock themselves
+struct ffinode *ffinode_get(uint64_t ino);
+struct ffinode *ffinode_add(uint64_t parent, const char *name, int lookup);
+void ffinode_forget(uint64_t ino, uint64_t nlookup);
+void ffinode_remove(uint64_t parent, const char *name);
+int ffinode_rename(uint64_t parent, const char *name, uint64_t newparent, const char *newname);
+
+// Attribute cache, returns 0 and fills attr on a hit, -1 on a miss
+int ffinode_get_attr(uint64_t ino, struct stat *attr);
+void ffinode_set_attr(uint64_t ino, const struct stat *attr);
+void ffinode_clear_attr(uint64_t ino);
+
+// Build the FatFs path of an inode, returns the length or -errno
+int ffinode_path(uint64_t ino, char *buf, size_t size);
+// Same but for a child of a directory inode
+int ffinode_child_path(uint64_t parent, const char *name, char *buf, size_t size);
+
+// The disk changed: every node but the root becomes stale. cb is called for each of them
+// with the table locked, so it must only copy what it needs
+void ffinode_invalidate_all(void (*cb)(uint64_t parent, const char *name, uint64_t ino, void *arg), void *arg);
+
+#endif
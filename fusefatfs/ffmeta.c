@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "ffmeta.h"
+
+#define FFMETA_BUCKETS 1024
+#define FFMETA_MAX_ENTRIES 4096
+
+struct ffmeta {
+	char *path;
+	int noent;
+	FILINFO info;
+	struct ffmeta *hash_next;
+	struct ffmeta *lru_prev;  // most recently used at the head
+	struct ffmeta *lru_next;
+};
+
+static struct ffmeta *meta_hash[FFMETA_BUCKETS];
+static struct ffmeta *lru_head;
+static struct ffmeta *lru_tail;
+static uint64_t nentries;
+static uint64_t nnoent;
+static uint64_t nhits, nneg_hits, nmisses;
+static pthread_mutex_t ffmeta_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int hash_path(const char *path) {
+	uint64_t h = 1469598103934665603ULL;
+	for (; *path; path++)
+		h = (h ^ (unsigned char) *path) * 1099511628211ULL;
+	return (unsigned int) (h % FFMETA_BUCKETS);
+}
+
+static void lru_unlink(struct ffmeta *meta) {
+	if (meta->lru_prev)
+		meta->lru_prev->lru_next = meta->lru_next;
+	else
+		lru_head = meta->lru_next;
+	if (meta->lru_next)
+		meta->lru_next->lru_prev = meta->lru_prev;
+	else
+		lru_tail = meta->lru_prev;
+}
+
+static void lru_push(struct ffmeta *meta) {
+	meta->lru_prev = NULL;
+	meta->lru_next = lru_head;
+	if (lru_head)
+		lru_head->lru_prev = meta;
+	else
+		lru_tail = meta;
+	lru_head = meta;
+}
+
+static struct ffmeta *find_locked(const char *path, unsigned int bucket) {
+	struct ffmeta *meta;
+	for (meta = meta_hash[bucket]; meta != NULL; meta = meta->hash_next)
+		if (strcmp(meta->path, path) == 0)
+			return meta;
+	return NULL;
+}
+
+static void free_locked(struct ffmeta *meta) {
+	struct ffmeta **scan;
+	for (scan = &meta_hash[hash_path(meta->path)]; *scan != NULL; scan = &(*scan)->hash_next)
+		if (*scan == meta) {
+			*scan = meta->hash_next;
+			break;
+		}
+	lru_unlink(meta);
+	nentries--;
+	if (meta->noent)
+		nnoent--;
+	free(meta->path);
+	free(meta);
+}
+
+static void set_locked(const char *path, const FILINFO *info) {
+	unsigned int bucket = hash_path(path);
+	struct ffmeta *meta = find_locked(path, bucket);
+	if (meta == NULL) {
+		if (nentries >= FFMETA_MAX_ENTRIES)
+			free_locked(lru_tail);
+		meta = malloc(sizeof(struct ffmeta));
+		if (meta != NULL)
+			meta->path = strdup(path);
+		if (meta == NULL || meta->path == NULL) {
+			free(meta);
+			return;
+		}
+		meta->noent = 0;
+		meta->hash_next = meta_hash[bucket];
+		meta_hash[bucket] = meta;
+		nentries++;
+	} else
+		lru_unlink(meta);
+	lru_push(meta);
+	nnoent -= meta->noent;
+	meta->noent = (info == NULL);
+	nnoent += meta->noent;
+	if (info != NULL)
+		meta->info = *info;
+}
+
+void ffmeta_init(void) {
+	ffmeta_clear();
+	pthread_mutex_lock(&ffmeta_mutex);
+	nhits = nneg_hits = nmisses = 0;
+	pthread_mutex_unlock(&ffmeta_mutex);
+}
+
+void ffmeta_fini(void) {
+	ffmeta_clear();
+}
+
+int ffmeta_lookup(const char *path, FILINFO *info) {
+	int ret = FFMETA_MISS;
+	pthread_mutex_lock(&ffmeta_mutex);
+	struct ffmeta *meta = find_locked(path, hash_path(path));
+	if (meta == NULL)
+		nmisses++;
+	else {
+		lru_unlink(meta);
+		lru_push(meta);
+		if (meta->noent) {
+			nneg_hits++;
+			ret = FFMETA_NOENT;
+		} else {
+			nhits++;
+			*info = meta->info;
+			ret = FFMETA_FOUND;
+		}
+	}
+	pthread_mutex_unlock(&ffmeta_mutex);
+	return ret;
+}
+
+void ffmeta_set(const char *path, const FILINFO *info) {
+	pthread_mutex_lock(&ffmeta_mutex);
+	set_locked(path, info);
+	pthread_mutex_unlock(&ffmeta_mutex);
+}
+
+void ffmeta_set_noent(const char *path) {
+	pthread_mutex_lock(&ffmeta_mutex);
+	set_locked(path, NULL);
+	pthread_mutex_unlock(&ffmeta_mutex);
+}
+
+void ffmeta_invalidate(const char *path, int subtree) {
+	pthread_mutex_lock(&ffmeta_mutex);
+	struct ffmeta *meta = find_locked(path, hash_path(path));
+	if (meta != NULL)
+		free_locked(meta);
+	if (subtree) {
+		size_t len = strlen(path);
+		struct ffmeta *next;
+		for (meta = lru_head; meta != NULL; meta = next) {
+			next = meta->lru_next;
+			if (strncmp(meta->path, path, len) == 0 && meta->path[len] == '/')
+				free_locked(meta);
+		}
+	}
+	pthread_mutex_unlock(&ffmeta_mutex);
+}
+
+void ffmeta_drop_noent(void) {
+	struct ffmeta *meta, *next;
+	pthread_mutex_lock(&ffmeta_mutex);
+	for (meta = lru_head; meta != NULL && nnoent > 0; meta = next) {
+		next = meta->lru_next;
+		if (meta->noent)
+			free_locked(meta);
+	}
+	pthread_mutex_unlock(&ffmeta_mutex);
+}
+
+void ffmeta_clear(void) {
+	pthread_mutex_lock(&ffmeta_mutex);
+	while (lru_head != NULL)
+		free_locked(lru_head);
+	pthread_mutex_unlock(&ffmeta_mutex);
+}
+
+void ffmeta_get_stats(struct ffmeta_stats *stats) {
+	pthread_mutex_lock(&ffmeta_mutex);
+	stats->hits = nhits;
+	stats->neg_hits = nneg_hits;
+	stats->misses = nmisses;
+	stats->entries = nentries;
+	pthread_mutex_unlock(&ffmeta_mutex);
+}
@@ -0,0 +1,39 @@
+#ifndef FFMETA_H
+#define FFMETA_H
+#include <stdint.h>
+#include <ff.h>
+
+/* Path -> FILINFO cache, including negative entries for paths that do not exist.
+ * Positive entries are only stored under the canonical path (the names FatFs reports), so
+ * invalidating by canonical path is exact. Negative entries keep the name as asked and are
+ * all dropped whenever a name is added to the volume, FAT matching is case insensitive. */
+
+#define FFMETA_MISS 0
+#define FFMETA_FOUND 1
+#define FFMETA_NOENT 2
+
+struct ffmeta_stats {
+	uint64_t hits;
+	uint64_t neg_hits;
+	uint64_t misses;
+	uint64_t entries;
+};
+
+void ffmeta_init(void);
+void ffmeta_fini(void);
+
+// Returns FFMETA_FOUND and fills info, FFMETA_NOENT for a cached ENOENT or FFMETA_MISS
+int ffmeta_lookup(const char *path, FILINFO *info);
+void ffmeta_set(const char *path, const FILINFO *info);
+void ffmeta_set_noent(const char *path);
+
+// Drop path, and everything below it when subtree is set
+void ffmeta_invalidate(const char *path, int subtree);
+// A name appeared: cached ENOENTs can no longer be trusted
+void ffmeta_drop_noent(void);
+// Disk changed
+void ffmeta_clear(void);
+
+void ffmeta_get_stats(struct ffmeta_stats *stats);
+
+#endif
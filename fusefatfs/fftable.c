@@ -16,6 +16,7 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,6 +40,15 @@ int fftab_new (int flags)
 	new->fd = -1;
 	new->index = index;
 	new->flags = flags;
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+	// glibc lets readers overtake a waiting writer by default, so a busy reader could hold off writes and the idle
+	// sync for as long as it kept reading. No operation takes the lock twice, so the non-recursive kind is safe
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	pthread_rwlock_init(&new->lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
 	memset(&new->fs, 0, sizeof(new->fs));
 	fftab[index] = new;
 	return index;
@@ -48,6 +58,7 @@ void fftab_del(int index) {
 	if (index < 0) return;
 	if (index >= FF_VOLUMES) return;
 	if (fftab[index] == NULL) return;
+	pthread_rwlock_destroy(&fftab[index]->lock);
 	free(fftab[index]);
 	fftab[index] = NULL;
 }
@@ -1,6 +1,7 @@
 #ifndef FFTABLE_H
 #define FFTABLE_H
 #include <ff.h>
+#include <pthread.h>
 
 #define FFFF_RDONLY 1
 
@@ -8,6 +9,7 @@ struct fftab {
 	int fd;
 	int index;
 	int flags;
+	pthread_rwlock_t lock;
 	FATFS fs;
 };
 
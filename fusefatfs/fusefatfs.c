@@ -16,10 +16,12 @@
  *
  */
 
-#define FUSE_USE_VERSION 29
+#define FUSE_USE_VERSION 34
 
 #include <ff.h>
 #include "fftable.h"
+#include "ffinode.h"
+#include "ffmeta.h"
 #include <config.h>
 
 #include <mount_drive.h>
@@ -28,10 +30,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <time.h>
 #include <stddef.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
 
 
 int fuse_reentrant_tag = 0;
@@ -44,10 +48,60 @@ int fuse_reentrant_tag = 0;
 
 #define FAT_DEFAULT_CODEPAGE 850
 
-static pthread_mutex_t fff_mutex = PTHREAD_MUTEX_INITIALIZER;
-#define mutex_in() pthread_mutex_lock(&fff_mutex)
-#define mutex_out() pthread_mutex_unlock(&fff_mutex)
-#define mutex_out_return(RETVAL) do {mutex_out(); return(RETVAL); } while (0)
+// Each volume has a reader/writer lock: lookups and reads share it, anything that
+// modifies the volume takes it exclusively. FatFs itself is built reentrant.
+#define read_in(ffentry) pthread_rwlock_rdlock(&(ffentry)->lock)
+#define write_in(ffentry) pthread_rwlock_wrlock(&(ffentry)->lock)
+#define lock_out(ffentry) pthread_rwlock_unlock(&(ffentry)->lock)
+#define lock_out_reply_err(ffentry, req, ERR) do {lock_out(ffentry); fuse_reply_err(req, ERR); return; } while (0)
+
+#define FFF_DEFAULT_SYNC_IDLE 2
+#define FFF_PATH_MAX 1024
+// Initial cluster link map size in DWORDs: 15 fragments, plenty for a floppy file
+#define FFF_CLMT_SIZE 32
+
+// Every change goes through us and a disk change is notified to the kernel,
+// so entries and attributes can be cached for as long as the disk stays in.
+#define FFF_CACHE_TIMEOUT 86400.0
+// Names that don't exist aren't tracked, so a disk change can't take them back:
+// the kernel only keeps them for long enough to soak up a burst of lookups
+#define FFF_NEGATIVE_TIMEOUT 1.0
+
+// An open file, kept on a list so the idle timer can sync it
+struct ffffile {
+	FIL fp;
+	fuse_ino_t ino;
+	pthread_mutex_t lock; // keeps seek + read together when readers share the volume
+	int dirty;
+	uint32_t *clmt;       // fast seek link map, fp.cltbl points here while it matches the chain
+	struct ffffile *next;
+	struct ffffile *prev;
+};
+
+// An open directory, f_readdir only goes forward so the position is tracked here
+struct fffdir {
+	DIR dp;
+	char *path;
+	off_t off;
+	int pending;          // fileinfo was read but did not fit in the last reply
+	FILINFO fileinfo;
+};
+
+static struct ffffile *fff_files;
+static pthread_mutex_t fff_files_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int fff_writeback;
+// Atomic so the idle timer can look at them without taking the volume lock
+static atomic_int fff_dirty;
+static _Atomic time_t fff_last_write;
+static unsigned int fff_sync_idle = FFF_DEFAULT_SYNC_IDLE;
+static pthread_mutex_t fff_idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fff_idle_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t fff_idle_tid;
+static int fff_idle_running;
+static int fff_idle_stop;
+static struct fuse_session *fff_session;
+static struct fftab *fff_volume;
+static int fff_debug;
 
 #define fffpath(index, path) \
   *fffpath; \
@@ -76,6 +130,11 @@ static int fr2errno(FRESULT fres) {
 								return -EEXIST;
 		case FR_NOT_ENOUGH_CORE:
 								return -ENOMEM;
+		case FR_TIMEOUT:
+		case FR_LOCKED:
+								return -EBUSY;
+		case FR_TOO_MANY_OPEN_FILES:
+								return -ENFILE;
 		default:
 								return -EIO;
 	}
@@ -116,283 +175,971 @@ static time_t fftime2time(WORD fdate, WORD ftime) {
 	}
 }
 
-static int fff_getattr(const char *path, struct stat *stbuf)
-{
-	mutex_in();
-	struct fuse_context *cntx=fuse_get_context();
-	struct fftab *ffentry = cntx->private_data;
-	FRESULT fres;
-	// f_stat path: The object must not be the root directory */
-	if (strcmp(path, "/") == 0) {
-		memset(stbuf, 0, sizeof(struct stat));
+static int time2fftime(time_t newtime, FILINFO *fno) {
+	struct tm tm;
+	if (localtime_r(&newtime, &tm) == NULL)
+		return -EINVAL;
+	fno->fdate =
+		/* bit15:9: Year origin from the 1980 (0..127, e.g. 37 for 2017) */
+		(((tm.tm_year - 80) & 0x7f) << 9) |
+		/* bit8:5: Month (1..12) */
+		(((tm.tm_mon + 1) & 0xf) << 5) |
+		/* bit4:0: Day of the month (1..31) */
+		(tm.tm_mday & 0x1f);
+	fno->ftime =
+		/* bit15:11: Hour (0..23)) */
+		((tm.tm_hour & 0x1f) << 11) |
+		/* bit10:5: Minute (0..59) */
+		((tm.tm_min & 0x3f) << 5) |
+		/* bit4:0 Second / 2 (0..29, e.g. 25 for 50) */
+		((tm.tm_sec & 0x3f) / 2);
+	return 0;
+}
+
+static void fff_root_stat(struct stat *stbuf) {
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = FFINODE_ROOT;
+	stbuf->st_mode = 0755 | S_IFDIR;
+	stbuf->st_nlink = 2;
+}
+
+static void fff_fill_stat(fuse_ino_t ino, const FILINFO *fileinfo, struct stat *stbuf) {
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = ino;
+	stbuf->st_size = fileinfo->fsize;
+	stbuf->st_ctime = stbuf->st_mtime =
+		fftime2time(fileinfo->fdate, fileinfo->ftime);
+	if (fileinfo->fattrib & AM_DIR) {
 		stbuf->st_mode = 0755 | S_IFDIR;
 		stbuf->st_nlink = 2;
-		mutex_out_return(0);
 	} else {
-		const char fffpath(ffentry->index, path);
-		FILINFO fileinfo;
-		fres = f_stat(fffpath, &fileinfo);
-		//printf("getattr %s %s -> %d\n", path, fffpath, fres);
-		if (fres != FR_OK) goto err;
-		memset(stbuf, 0, sizeof(struct stat));
-		stbuf->st_size = fileinfo.fsize;
-		stbuf->st_ctime = stbuf->st_mtime =
-			fftime2time(fileinfo.fdate, fileinfo.ftime);
-		if (fileinfo.fattrib & AM_DIR) {
-			stbuf->st_mode = 0755 | S_IFDIR;
-			stbuf->st_nlink = 2;
-		} else {
-			stbuf->st_nlink = 1;
-			stbuf->st_mode = 0755 | S_IFREG;
+		stbuf->st_nlink = 1;
+		stbuf->st_mode = 0755 | S_IFREG;
+	}
+	if (fileinfo->fattrib & AM_RDO)
+		stbuf->st_mode &= ~0222;
+}
+
+static struct ffffile *fff_file_new(fuse_ino_t ino) {
+	struct ffffile *file = malloc(sizeof(struct ffffile));
+	if (file == NULL)
+		return NULL;
+	pthread_mutex_init(&file->lock, NULL);
+	file->ino = ino;
+	file->dirty = 0;
+	file->clmt = NULL;
+	file->prev = NULL;
+	pthread_mutex_lock(&fff_files_mutex);
+	file->next = fff_files;
+	if (fff_files)
+		fff_files->prev = file;
+	fff_files = file;
+	pthread_mutex_unlock(&fff_files_mutex);
+	return file;
+}
+
+static void fff_file_free(struct ffffile *file) {
+	pthread_mutex_lock(&fff_files_mutex);
+	if (file->prev)
+		file->prev->next = file->next;
+	else
+		fff_files = file->next;
+	if (file->next)
+		file->next->prev = file->prev;
+	pthread_mutex_unlock(&fff_files_mutex);
+	pthread_mutex_destroy(&file->lock);
+	free(file->clmt);
+	free(file);
+}
+
+// Seek using the cluster link map, built on the first seek so random access never walks the FAT chain
+static FRESULT fff_fast_seek(struct ffffile *file, FSIZE_t offset) {
+	FIL *fp = &file->fp;
+	if (fp->cltbl == NULL) {
+		FRESULT fres;
+		if (file->clmt == NULL) {
+			file->clmt = malloc(FFF_CLMT_SIZE * sizeof(uint32_t));
+			if (file->clmt == NULL)
+				return f_lseek(fp, offset);
+			file->clmt[0] = FFF_CLMT_SIZE;
+		}
+		fp->cltbl = file->clmt;
+		fres = f_lseek(fp, CREATE_LINKMAP);
+		if (fres == FR_NOT_ENOUGH_CORE) {
+			// The first entry now holds the size needed
+			uint32_t *clmt = realloc(file->clmt, file->clmt[0] * sizeof(uint32_t));
+			if (clmt != NULL) {
+				file->clmt = fp->cltbl = clmt;
+				fres = f_lseek(fp, CREATE_LINKMAP);
+			}
+		}
+		if (fres != FR_OK) {
+			fp->cltbl = NULL;
+			file->clmt[0] = FFF_CLMT_SIZE;
+			return f_lseek(fp, offset);
 		}
-		if (fileinfo.fattrib & AM_RDO)
-			stbuf->st_mode &= ~0222;
 	}
-	mutex_out_return(0);
-err:
-	mutex_out_return(fr2errno(fres));
+	return f_lseek(fp, offset);
+}
+
+// Writes and truncation change the chain, and fast seek mode cannot extend a file
+static void fff_drop_clmt(struct ffffile *file) {
+	if (file->fp.cltbl != NULL) {
+		file->fp.cltbl = NULL;
+		file->clmt[0] = FFF_CLMT_SIZE;
+	}
+}
+
+// In write-back mode the directory entry lags behind, an open handle knows the real size
+static void fff_open_size(fuse_ino_t ino, struct stat *stbuf) {
+	struct ffffile *file;
+	pthread_mutex_lock(&fff_files_mutex);
+	for (file = fff_files; file != NULL; file = file->next)
+		if (file->ino == ino && file->dirty) {
+			stbuf->st_size = f_size(&file->fp);
+			break;
+		}
+	pthread_mutex_unlock(&fff_files_mutex);
+}
+
+// FatFs refuses a second open of a file being written, so a truncate by path goes through the handle that has it
+static struct ffffile *fff_open_writer(fuse_ino_t ino) {
+	struct ffffile *file;
+	pthread_mutex_lock(&fff_files_mutex);
+	for (file = fff_files; file != NULL; file = file->next)
+		if (file->ino == ino && (file->fp.flag & FA_WRITE))
+			break;
+	pthread_mutex_unlock(&fff_files_mutex);
+	return file;
+}
+
+// Something changed on the volume, file may be NULL for metadata-only updates
+static void fff_mark_dirty(struct ffffile *file) {
+	if (file)
+		file->dirty = 1;
+	fff_dirty = 1;
+	fff_last_write = time(NULL);
+}
+
+// Forget the cached attributes of an inode whose directory entry changed
+static void fff_invalidate_ino(fuse_ino_t ino) {
+	char path[FFF_PATH_MAX];
+	if (ino == 0)
+		return;
+	ffinode_clear_attr(ino);
+	if (ffinode_path(ino, path, sizeof(path)) >= 0)
+		ffmeta_invalidate(path, 0);
+}
+
+// The directory entry now matches the handle, a cached stat of it is out of date
+static void fff_mark_synced(struct ffffile *file) {
+	file->dirty = 0;
+	fff_invalidate_ino(file->ino);
+}
+
+// Build the canonical path of a directory entry: dir is canonical, name as FatFs reports it
+static int fff_join_path(const char *dir, const char *name, char *buf, size_t size) {
+	int len = snprintf(buf, size, "%s%s%s", dir, (dir[0] == '/' && dir[1] == 0) ? "" : "/", name);
+	return (len < 0 || (size_t) len >= size) ? -ENAMETOOLONG : len;
+}
+
+// Cache what f_stat found under the name FatFs reports, path may have been asked with another case
+static void fff_meta_store(const char *path, const FILINFO *fileinfo) {
+	const char *last = strrchr(path, '/');
+	if (last == NULL || strcmp(last + 1, fileinfo->fname) == 0)
+		ffmeta_set(path, fileinfo);
+	else {
+		char dir[FFF_PATH_MAX];
+		char canonical[FFF_PATH_MAX];
+		size_t dirlen = (last == path) ? 1 : (size_t) (last - path);
+		if (dirlen >= sizeof(dir))
+			return;
+		memcpy(dir, path, dirlen);
+		dir[dirlen] = 0;
+		if (fff_join_path(dir, fileinfo->fname, canonical, sizeof(canonical)) >= 0)
+			ffmeta_set(canonical, fileinfo);
+	}
+}
+
+// f_stat through the metadata cache: path is the volume path, fffpath the same with the drive prefix
+static FRESULT fff_stat(const char *path, const char *fffpath, FILINFO *fileinfo) {
+	switch (ffmeta_lookup(path, fileinfo)) {
+		case FFMETA_FOUND:
+			return FR_OK;
+		case FFMETA_NOENT:
+			return FR_NO_FILE;
+	}
+	FRESULT fres = f_stat(fffpath, fileinfo);
+	if (fres == FR_OK)
+		fff_meta_store(path, fileinfo);
+	else if (fres == FR_NO_FILE || fres == FR_NO_PATH)
+		ffmeta_set_noent(path);
+	return fres;
+}
+
+// Push every open file to the sector cache and commit the pending tracks to disk - volume must be write locked
+static FRESULT fff_sync_all(void) {
+	FRESULT fres = FR_OK;
+	struct ffffile *file;
+	pthread_mutex_lock(&fff_files_mutex);
+	for (file = fff_files; file != NULL; file = file->next) {
+		if (file->dirty) {
+			FRESULT res = f_sync(&file->fp);
+			if (res == FR_OK)
+				fff_mark_synced(file);
+			else
+				fres = res;
+		}
+	}
+	pthread_mutex_unlock(&fff_files_mutex);
+	if (fff_dirty) {
+		if (sync_drive() < 0)
+			fres = FR_DISK_ERR;
+		else if (fres == FR_OK)
+			fff_dirty = 0;
+	}
+	return fres;
+}
+
+// Write-back idle timer: sync once nothing has been written for fff_sync_idle seconds
+static void *fff_idle_thread(void *arg) {
+	struct fftab *ffentry = arg;
+	pthread_mutex_lock(&fff_idle_mutex);
+	while (!fff_idle_stop) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+		pthread_cond_timedwait(&fff_idle_cond, &fff_idle_mutex, &ts);
+		if (fff_idle_stop) break;
+		// Readers are only held up when a sync is actually due
+		if (!fff_dirty || time(NULL) - fff_last_write < fff_sync_idle)
+			continue;
+		pthread_mutex_unlock(&fff_idle_mutex);
+		write_in(ffentry);
+		if (fff_dirty && time(NULL) - fff_last_write >= fff_sync_idle)
+			fff_sync_all();
+		lock_out(ffentry);
+		pthread_mutex_lock(&fff_idle_mutex);
+	}
+	pthread_mutex_unlock(&fff_idle_mutex);
+	return NULL;
+}
+
+struct fffinval {
+	fuse_ino_t parent;
+	fuse_ino_t ino;
+	char *name;
+	struct fffinval *next;
+};
+
+static void fff_collect_inval(uint64_t parent, const char *name, uint64_t ino, void *arg) {
+	struct fffinval **list = arg;
+	struct fffinval *inval = malloc(sizeof(struct fffinval));
+	if (inval == NULL)
+		return;
+	inval->name = strdup(name);
+	if (inval->name == NULL) {
+		free(inval);
+		return;
+	}
+	inval->parent = parent;
+	inval->ino = ino;
+	inval->next = *list;
+	*list = inval;
 }
 
-static int fff_open(const char *path, struct fuse_file_info *fi){
-	mutex_in();
-	struct fuse_context *cntx=fuse_get_context();
-	struct fftab *ffentry = cntx->private_data;
+// Called by the drive monitor: forget everything about the old disk and tell the kernel to do the same
+static void fff_disk_changed(int diskInserted) {
+	(void) diskInserted;
+	struct fftab *ffentry = fff_volume;
+	struct fffinval *list = NULL;
+	if (ffentry == NULL)
+		return;
+	write_in(ffentry);
+	// Open handles belong to the old disk, FatFs refuses them after the remount
+	fff_dirty = 0;
+	char sdrv[12];
+	snprintf(sdrv, 12, "%d:", ffentry->index);
+	f_mount(&ffentry->fs, sdrv, 0);
+	ffmeta_clear();
+	ffinode_invalidate_all(fff_collect_inval, &list);
+	lock_out(ffentry);
+	// Notifications must not be sent with locks held, the kernel may be waiting on one of our replies
+	if (fff_session == NULL)
+		return;
+	while (list != NULL) {
+		struct fffinval *next = list->next;
+		fuse_lowlevel_notify_inval_entry(fff_session, list->parent, list->name, strlen(list->name));
+		fuse_lowlevel_notify_inval_inode(fff_session, list->ino, 0, 0);
+		free(list->name);
+		free(list);
+		list = next;
+	}
+	fuse_lowlevel_notify_inval_inode(fff_session, FFINODE_ROOT, 0, 0);
+}
+
+static void fff_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fftab *ffentry = fuse_req_userdata(req);
+	struct fuse_entry_param e;
+	char path[FFF_PATH_MAX];
+	read_in(ffentry);
+	int len = ffinode_child_path(parent, name, path, sizeof(path));
+	if (len < 0)
+		lock_out_reply_err(ffentry, req, -len);
 	const char fffpath(ffentry->index, path);
-	if ((ffentry->flags & FFFF_RDONLY) && (fi->flags & O_ACCMODE) != O_RDONLY)
-		mutex_out_return(-EROFS);
+	FILINFO fileinfo;
+	FRESULT fres = fff_stat(path, fffpath, &fileinfo);
+	//printf("lookup %s %s -> %d\n", name, fffpath, fres);
+	memset(&e, 0, sizeof(e));
+	e.attr_timeout = FFF_CACHE_TIMEOUT;
+	e.entry_timeout = FFF_CACHE_TIMEOUT;
+	if (fres == FR_NO_FILE || fres == FR_NO_PATH || fres == FR_INVALID_NAME) {
+		lock_out(ffentry);
+		// A zero inode is a negative entry: the kernel caches the ENOENT as well
+		e.entry_timeout = FFF_NEGATIVE_TIMEOUT;
+		if (fres == FR_INVALID_NAME)
+			fuse_reply_err(req, ENOENT);
+		else
+			fuse_reply_entry(req, &e);
+		return;
+	}
+	if (fres != FR_OK)
+		lock_out_reply_err(ffentry, req, -fr2errno(fres));
+	// Key on the name FatFs reports, FAT is case insensitive
+	struct ffinode *node = ffinode_add(parent, fileinfo.fname, 1);
+	if (node == NULL)
+		lock_out_reply_err(ffentry, req, ENOMEM);
+	e.ino = node->ino;
+	fff_fill_stat(e.ino, &fileinfo, &e.attr);
+	ffinode_set_attr(e.ino, &e.attr);
+	fff_open_size(e.ino, &e.attr);
+	lock_out(ffentry);
+	fuse_reply_entry(req, &e);
+}
+
+static void fff_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	ffinode_forget(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void fff_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	size_t i;
+	for (i = 0; i < count; i++)
+		ffinode_forget(forgets[i].ino, forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+// Fetch the attributes of an inode - volume must be locked
+static int fff_stat_ino(struct fftab *ffentry, fuse_ino_t ino, struct stat *stbuf)
+{
+	char path[FFF_PATH_MAX];
+	// f_stat path: The object must not be the root directory */
+	if (ino == FFINODE_ROOT) {
+		fff_root_stat(stbuf);
+		return 0;
+	}
+	// Seeded by lookup and readdirplus, so a listing does not cost a directory scan per entry
+	if (ffinode_get_attr(ino, stbuf) == 0) {
+		fff_open_size(ino, stbuf);
+		return 0;
+	}
+	int len = ffinode_path(ino, path, sizeof(path));
+	if (len < 0)
+		return len;
+	const char fffpath(ffentry->index, path);
+	FILINFO fileinfo;
+	FRESULT fres = fff_stat(path, fffpath, &fileinfo);
+	if (fres != FR_OK)
+		return fr2errno(fres);
+	fff_fill_stat(ino, &fileinfo, stbuf);
+	ffinode_set_attr(ino, stbuf);
+	fff_open_size(ino, stbuf);
+	return 0;
+}
+
+static void fff_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void) fi;
+	struct fftab *ffentry = fuse_req_userdata(req);
+	struct stat stbuf;
+	read_in(ffentry);
+	int err = fff_stat_ino(ffentry, ino, &stbuf);
+	lock_out(ffentry);
+	if (err < 0)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_attr(req, &stbuf, FFF_CACHE_TIMEOUT);
+}
+
+// Truncate through the open handle so its size and cluster position stay consistent
+static FRESULT fff_truncate_file(struct ffffile *file, off_t size) {
+	FIL *fp = &file->fp;
+	fff_drop_clmt(file);
+	FRESULT fres = f_lseek(fp, size);
+	if (fres != FR_OK) return fres;
+	fres = f_truncate(fp);
+	if (fres != FR_OK) return fres;
+	fff_mark_dirty(file);
+	if (!fff_writeback) {
+		fres = f_sync(fp);
+		if (fres == FR_OK) fff_mark_synced(file);
+	}
+	return fres;
+}
+
+static FRESULT fff_truncate_path(const char *fffpath, off_t size) {
 	FIL fp;
-	FRESULT fres = f_open(&fp, fffpath, flags2ffmode(fi->flags));
+	memset(&fp, 0, sizeof(fp));
+	FRESULT fres = f_open(&fp, fffpath, FA_WRITE);
+	if (fres != FR_OK) return fres;
+	fres = f_lseek(&fp, size);
 	if (fres == FR_OK)
+		fres = f_truncate(&fp);
+	if (fres != FR_OK) {
 		f_close(&fp);
-	mutex_out_return(fr2errno(fres));
+		return fres;
+	}
+	fres = f_close(&fp);
+	if (fres == FR_OK) fff_mark_dirty(NULL);
+	return fres;
 }
 
-static int fff_create(const char *path, mode_t mode, struct fuse_file_info *fi){
-	(void) fi;
-	(void) mode; // XXX set readonly?
-	mutex_in();
-	struct fuse_context *cntx=fuse_get_context();
-	struct fftab *ffentry = cntx->private_data;
+// Only size and modification time can be represented, mode and ownership changes are ignored
+static void fff_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+	struct fftab *ffentry = fuse_req_userdata(req);
+	struct stat stbuf;
+	char path[FFF_PATH_MAX];
+	FRESULT fres = FR_OK;
+	write_in(ffentry);
+	if ((ffentry->flags & FFFF_RDONLY) &&
+			(to_set & (FUSE_SET_ATTR_SIZE | FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_MTIME_NOW)))
+		lock_out_reply_err(ffentry, req, EROFS);
+	int len = ffinode_path(ino, path, sizeof(path));
+	if (len < 0)
+		lock_out_reply_err(ffentry, req, -len);
 	const char fffpath(ffentry->index, path);
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		if (ino == FFINODE_ROOT)
+			lock_out_reply_err(ffentry, req, EISDIR);
+		struct ffffile *file = (fi != NULL) ? (struct ffffile *) (uintptr_t) fi->fh : fff_open_writer(ino);
+		if (file != NULL)
+			fres = fff_truncate_file(file, attr->st_size);
+		else
+			fres = fff_truncate_path(fffpath, attr->st_size);
+		if (fres != FR_OK)
+			lock_out_reply_err(ffentry, req, -fr2errno(fres));
+	}
+	if (to_set & (FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_MTIME_NOW)) {
+		FILINFO fno;
+		time_t newtime = (to_set & FUSE_SET_ATTR_MTIME_NOW) ? time(NULL) : attr->st_mtime;
+		if (ino == FFINODE_ROOT)
+			lock_out_reply_err(ffentry, req, EPERM);
+		if (time2fftime(newtime, &fno) < 0)
+			lock_out_reply_err(ffentry, req, EINVAL);
+		fres = f_utime(fffpath, &fno);
+		if (fres != FR_OK)
+			lock_out_reply_err(ffentry, req, -fr2errno(fres));
+		fff_mark_dirty(NULL);
+	}
+	fff_invalidate_ino(ino);
+	int err = fff_stat_ino(ffentry, ino, &stbuf);
+	lock_out(ffentry);
+	if (err < 0)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_attr(req, &stbuf, FFF_CACHE_TIMEOUT);
+}
+
+static void fff_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct fftab *ffentry = fuse_req_userdata(req);
+	char path[FFF_PATH_MAX];
+	if ((fi->flags & O_ACCMODE) == O_RDONLY)
+		read_in(ffentry);
+	else
+		write_in(ffentry);
+	if ((ffentry->flags & FFFF_RDONLY) && (fi->flags & O_ACCMODE) != O_RDONLY)
+		lock_out_reply_err(ffentry, req, EROFS);
+	int len = ffinode_path(ino, path, sizeof(path));
+	if (len < 0)
+		lock_out_reply_err(ffentry, req, -len);
+	const char fffpath(ffentry->index, path);
+	// The FIL stays open until release, so read/write keep the cluster position
+	struct ffffile *file = fff_file_new(ino);
+	if (file == NULL)
+		lock_out_reply_err(ffentry, req, ENOMEM);
+	FRESULT fres = f_open(&file->fp, fffpath, flags2ffmode(fi->flags));
+	if (fres != FR_OK) {
+		fff_file_free(file);
+		lock_out_reply_err(ffentry, req, -fr2errno(fres));
+	}
+	fi->fh = (uintptr_t) file;
+	// The page cache stays valid until the disk changes
+	fi->keep_cache = 1;
+	lock_out(ffentry);
+	fuse_reply_open(req, fi);
+}
+
+static void fff_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
+{
+	(void) mode; // XXX set readonly?
+	struct fftab *ffentry = fuse_req_userdata(req);
+	struct fuse_entry_param e;
+	char path[FFF_PATH_MAX];
+	write_in(ffentry);
 	if (ffentry->flags & FFFF_RDONLY)
-		mutex_out_return(-EROFS);
-	FIL fp;
-	FRESULT fres = f_open(&fp, fffpath, flags2ffmode(fi->flags | O_CREAT));
+		lock_out_reply_err(ffentry, req, EROFS);
+	int len = ffinode_child_path(parent, name, path, sizeof(path));
+	if (len < 0)
+		lock_out_reply_err(ffentry, req, -len);
+	const char fffpath(ffentry->index, path);
+	struct ffffile *file = fff_file_new(0);
+	if (file == NULL)
+		lock_out_reply_err(ffentry, req, ENOMEM);
+	FRESULT fres = f_open(&file->fp, fffpath, flags2ffmode(fi->flags | O_CREAT));
+	if (fres != FR_OK) {
+		fff_file_free(file);
+		lock_out_reply_err(ffentry, req, -fr2errno(fres));
+	}
+	fff_mark_dirty(file);
+	ffmeta_drop_noent();
+	FILINFO fileinfo;
+	fres = f_sync(&file->fp);
 	if (fres == FR_OK)
-		f_close(&fp);
-	mutex_out_return(fr2errno(fres));
+		fres = f_stat(fffpath, &fileinfo);
+	if (fres == FR_OK)
+		fff_meta_store(path, &fileinfo);
+	struct ffinode *node = (fres == FR_OK) ? ffinode_add(parent, fileinfo.fname, 1) : NULL;
+	if (node == NULL) {
+		f_close(&file->fp);
+		fff_file_free(file);
+		lock_out_reply_err(ffentry, req, (fres == FR_OK) ? ENOMEM : -fr2errno(fres));
+	}
+	file->ino = node->ino;
+	memset(&e, 0, sizeof(e));
+	e.ino = node->ino;
+	e.attr_timeout = FFF_CACHE_TIMEOUT;
+	e.entry_timeout = FFF_CACHE_TIMEOUT;
+	fff_fill_stat(e.ino, &fileinfo, &e.attr);
+	ffinode_set_attr(e.ino, &e.attr);
+	fi->fh = (uintptr_t) file;
+	lock_out(ffentry);
+	fuse_reply_create(req, &e, fi);
 }
 
-static int fff_release(const char *path, struct fuse_file_info *fi){
-	(void) path;
-	(void) fi;
-	return 0;
+static void fff_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void) ino;
+	struct fftab *ffentry = fuse_req_userdata(req);
+	struct ffffile *file = (struct ffffile *) (uintptr_t) fi->fh;
+	// Closing only writes if there is something left to sync
+	if (file->dirty)
+		write_in(ffentry);
+	else
+		read_in(ffentry);
+	FRESULT fres = f_close(&file->fp);
+	if (fres == FR_OK && file->dirty) {
+		fff_mark_dirty(NULL);
+		fff_invalidate_ino(file->ino);
+	}
+	fff_file_free(file);
+	fi->fh = 0;
+	lock_out(ffentry);
+	fuse_reply_err(req, -fr2errno(fres));
 }
 
-static int fff_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
-	mutex_in();
-	struct fuse_context *cntx=fuse_get_context();
-	struct fftab *ffentry = cntx->private_data;
-	const char fffpath(ffentry->index, path);
-	FIL fp;
-	UINT br;
-	FRESULT fres = f_open(&fp, fffpath, flags2ffmode(fi->flags));
+static void fff_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	(void) ino;
+	struct fftab *ffentry = fuse_req_userdata(req);
+	struct ffffile *file = (struct ffffile *) (uintptr_t) fi->fh;
+	FIL *fp = &file->fp;
+	UINT br = 0;
+	char *buf = malloc(size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	read_in(ffentry);
+	FRESULT fres = FR_OK;
+	pthread_mutex_lock(&file->lock);
+	// Sequential access continues from the current cluster, no chain walk needed
+	if (f_tell(fp) != offset)
+		fres = fff_fast_seek(file, offset);
+	if (fres == FR_OK)
+		fres = f_read(fp, buf, size, &br);
+	pthread_mutex_unlock(&file->lock);
+	lock_out(ffentry);
 	if (fres != FR_OK)
-		goto earlyerr;
-	fres = f_lseek(&fp, offset);
-	if (fres != FR_OK) goto err;
-	fres = f_read(&fp, buf, size, &br);
-	if (fres != FR_OK) goto err;
-	f_close(&fp);
-	mutex_out_return(br);
-err:
-	f_close(&fp);
-earlyerr:
-	mutex_out_return(fr2errno(fres));
+		fuse_reply_err(req, -fr2errno(fres));
+	else
+		fuse_reply_buf(req, buf, br);
+	free(buf);
 }
 
-static int fff_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
-	mutex_in();
-	struct fuse_context *cntx=fuse_get_context();
-	struct fftab *ffentry = cntx->private_data;
-	const char fffpath(ffentry->index, path);
-	FIL fp;
+static void fff_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	(void) ino;
+	struct fftab *ffentry = fuse_req_userdata(req);
+	struct ffffile *file = (struct ffffile *) (uintptr_t) fi->fh;
+	FIL *fp = &file->fp;
 	UINT bw;
+	write_in(ffentry);
 	if (ffentry->flags & FFFF_RDONLY)
-		mutex_out_return(-EROFS);
-	FRESULT fres = f_open(&fp, fffpath, flags2ffmode(fi->flags));
-	if (fres != FR_OK)
-		goto earlyerr;
-	fres = f_lseek(&fp, offset);
-	if (fres != FR_OK) goto err;
-	fres = f_write(&fp, buf, size, &bw);
+		lock_out_reply_err(ffentry, req, EROFS);
+	FRESULT fres = FR_OK;
+	fff_drop_clmt(file);
+	if (f_tell(fp) != offset)
+		fres = f_lseek(fp, offset);
 	if (fres != FR_OK) goto err;
-	fres = f_sync(&fp);
+	fres = f_write(fp, buf, size, &bw);
 	if (fres != FR_OK) goto err;
-	f_close(&fp);
-	mutex_out_return(bw);
+	fff_mark_dirty(file);
+	// In write-back mode the directory entry and FAT are updated on flush/fsync/release or when idle
+	if (!fff_writeback) {
+		fres = f_sync(fp);
+		if (fres != FR_OK) goto err;
+		fff_mark_synced(file);
+	}
+	lock_out(ffentry);
+	fuse_reply_write(req, bw);
+	return;
 err:
-	f_close(&fp);
-earlyerr:
-	mutex_out_return(fr2errno(fres));
+	lock_out_reply_err(ffentry, req, -fr2errno(fres));
 }
 
-static int fff_opendir(const char *path, struct fuse_file_info *fi){
-	(void) fi;
-	mutex_in();
-	struct fuse_context *cntx=fuse_get_context();
-	struct fftab *ffentry = cntx->private_data;
-	const char fffpath(ffentry->index, path);
-	DIR dp;
-	FRESULT fres = f_opendir(&dp, fffpath);
-	f_closedir(&dp);
-	mutex_out_return(fr2errno(fres));
+static void fff_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void) ino;
+	struct fftab *ffentry = fuse_req_userdata(req);
+	struct ffffile *file = (struct ffffile *) (uintptr_t) fi->fh;
+	FRESULT fres = FR_OK;
+	write_in(ffentry);
+	// Only brings the FatFs metadata up to date, the tracks stay pending until fsync or idle
+	if (file->dirty) {
+		fres = f_sync(&file->fp);
+		if (fres == FR_OK)
+			fff_mark_synced(file);
+	}
+	lock_out_reply_err(ffentry, req, -fr2errno(fres));
 }
 
-static int fff_releasedir(const char *path, struct fuse_file_info *fi){
-	(void) path;
-	(void) fi;
-	return 0;
+static void fff_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	(void) ino;
+	(void) datasync;
+	struct fftab *ffentry = fuse_req_userdata(req);
+	struct ffffile *file = (struct ffffile *) (uintptr_t) fi->fh;
+	FRESULT fres = FR_OK;
+	write_in(ffentry);
+	if (file->dirty) {
+		fres = f_sync(&file->fp);
+		if (fres != FR_OK)
+			lock_out_reply_err(ffentry, req, -fr2errno(fres));
+		fff_mark_synced(file);
+	}
+	if (fff_writeback && sync_drive() < 0)
+		lock_out_reply_err(ffentry, req, EIO);
+	lock_out_reply_err(ffentry, req, 0);
 }
 
-static int fff_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		off_t offset, struct fuse_file_info *fi){
-	(void) offset;
-	(void) fi;
-	mutex_in();
-	struct fuse_context *cntx=fuse_get_context();
-	struct fftab *ffentry = cntx->private_data;
+static void fff_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct fftab *ffentry = fuse_req_userdata(req);
+	char path[FFF_PATH_MAX];
+	read_in(ffentry);
+	int len = ffinode_path(ino, path, sizeof(path));
+	if (len < 0)
+		lock_out_reply_err(ffentry, req, -len);
 	const char fffpath(ffentry->index, path);
-	DIR dp;
-	FRESULT fres = f_opendir(&dp, fffpath);
-	if (fres != FR_OK)
-		goto mutexout_leave;
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
-	while(1) {
-		FILINFO fileinfo;
-		fres = f_readdir(&dp, &fileinfo);
-		if (fres != FR_OK) break;
-		if (fileinfo.fname[0] == 0) break;
-		filler(buf, fileinfo.fname, NULL, 0);
-	}
-	f_closedir(&dp);
-mutexout_leave:
-	mutex_out_return(fr2errno(fres));
-}
-
-static int fff_mkdir(const char *path, mode_t mode) {
+	struct fffdir *dir = malloc(sizeof(struct fffdir));
+	if (dir == NULL)
+		lock_out_reply_err(ffentry, req, ENOMEM);
+	dir->path = strdup(path);
+	if (dir->path == NULL) {
+		free(dir);
+		lock_out_reply_err(ffentry, req, ENOMEM);
+	}
+	FRESULT fres = f_opendir(&dir->dp, fffpath);
+	if (fres != FR_OK) {
+		free(dir->path);
+		free(dir);
+		lock_out_reply_err(ffentry, req, -fr2errno(fres));
+	}
+	dir->off = 0;
+	dir->pending = 0;
+	fi->fh = (uintptr_t) dir;
+	fi->cache_readdir = 1;
+	fi->keep_cache = 1;
+	lock_out(ffentry);
+	fuse_reply_open(req, fi);
+}
+
+static void fff_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void) ino;
+	struct fftab *ffentry = fuse_req_userdata(req);
+	struct fffdir *dir = (struct fffdir *) (uintptr_t) fi->fh;
+	read_in(ffentry);
+	f_closedir(&dir->dp);
+	lock_out(ffentry);
+	free(dir->path);
+	free(dir);
+	fuse_reply_err(req, 0);
+}
+
+// Offsets 1 and 2 are "." and "..", FAT entry n ends at offset n + 3.
+// With plus set every entry carries its attributes, straight from the FILINFO f_readdir returned
+static void fff_do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi, int plus)
+{
+	struct fftab *ffentry = fuse_req_userdata(req);
+	struct fffdir *dir = (struct fffdir *) (uintptr_t) fi->fh;
+	FRESULT fres = FR_OK;
+	size_t pos = 0;
+	char *buf = malloc(size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	read_in(ffentry);
+	// Seeking backwards means starting the directory again
+	if (offset != dir->off) {
+		if (offset < dir->off || offset < 2) {
+			fres = f_rewinddir(&dir->dp);
+			dir->off = (offset < 2) ? offset : 2;
+			dir->pending = 0;
+		}
+		while (fres == FR_OK && dir->off < offset) {
+			if (dir->off < 2) {
+				dir->off++;
+				continue;
+			}
+			if (dir->pending)
+				dir->pending = 0;
+			else {
+				fres = f_readdir(&dir->dp, &dir->fileinfo);
+				if (fres != FR_OK || dir->fileinfo.fname[0] == 0)
+					break;
+			}
+			dir->off++;
+		}
+	}
+	while (fres == FR_OK) {
+		struct fuse_entry_param e;
+		struct ffinode *node = NULL;
+		const char *name;
+		size_t entsize;
+		memset(&e, 0, sizeof(e));
+		if (dir->off < 2) {
+			// The kernel does not take a reference on these two
+			name = (dir->off == 0) ? "." : "..";
+			struct ffinode *self = (dir->off == 0) ? NULL : ffinode_get(ino);
+			e.attr.st_ino = e.ino = (self == NULL) ? ino : self->parent;
+			e.attr.st_mode = S_IFDIR;
+		} else {
+			if (!dir->pending) {
+				char path[FFF_PATH_MAX];
+				fres = f_readdir(&dir->dp, &dir->fileinfo);
+				if (fres != FR_OK || dir->fileinfo.fname[0] == 0)
+					break;
+				// Later lookups and getattrs of this entry need no directory scan
+				if (fff_join_path(dir->path, dir->fileinfo.fname, path, sizeof(path)) >= 0)
+					ffmeta_set(path, &dir->fileinfo);
+			}
+			node = ffinode_add(ino, dir->fileinfo.fname, plus);
+			if (node == NULL) {
+				fres = FR_NOT_ENOUGH_CORE;
+				break;
+			}
+			name = dir->fileinfo.fname;
+			e.ino = node->ino;
+			if (plus) {
+				e.attr_timeout = FFF_CACHE_TIMEOUT;
+				e.entry_timeout = FFF_CACHE_TIMEOUT;
+				fff_fill_stat(e.ino, &dir->fileinfo, &e.attr);
+				ffinode_set_attr(e.ino, &e.attr);
+				fff_open_size(e.ino, &e.attr);
+			} else {
+				e.attr.st_ino = node->ino;
+				e.attr.st_mode = (dir->fileinfo.fattrib & AM_DIR) ? S_IFDIR : S_IFREG;
+			}
+		}
+		if (plus)
+			entsize = fuse_add_direntry_plus(req, buf + pos, size - pos, name, &e, dir->off + 1);
+		else
+			entsize = fuse_add_direntry(req, buf + pos, size - pos, name, &e.attr, dir->off + 1);
+		if (entsize > size - pos) {
+			// Not sent, so the kernel never saw the reference taken above
+			if (plus && node != NULL)
+				ffinode_forget(node->ino, 1);
+			dir->pending = (dir->off >= 2);
+			break;
+		}
+		dir->pending = 0;
+		dir->off++;
+		pos += entsize;
+	}
+	lock_out(ffentry);
+	if (fres != FR_OK && pos == 0)
+		fuse_reply_err(req, -fr2errno(fres));
+	else
+		fuse_reply_buf(req, buf, pos);
+	free(buf);
+}
+
+static void fff_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	fff_do_readdir(req, ino, size, offset, fi, 0);
+}
+
+static void fff_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	fff_do_readdir(req, ino, size, offset, fi, 1);
+}
+
+static void fff_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
 	(void) mode;  // XXX set readonly
-	mutex_in();
-	struct fuse_context *cntx=fuse_get_context();
-	struct fftab *ffentry = cntx->private_data;
-	const char fffpath(ffentry->index, path);
+	struct fftab *ffentry = fuse_req_userdata(req);
+	struct fuse_entry_param e;
+	char path[FFF_PATH_MAX];
+	write_in(ffentry);
 	if (ffentry->flags & FFFF_RDONLY)
-		mutex_out_return(-EROFS);
+		lock_out_reply_err(ffentry, req, EROFS);
+	int len = ffinode_child_path(parent, name, path, sizeof(path));
+	if (len < 0)
+		lock_out_reply_err(ffentry, req, -len);
+	const char fffpath(ffentry->index, path);
 	FRESULT fres = f_mkdir(fffpath);
-	if (fres != FR_OK) return fr2errno(fres);
+	if (fres != FR_OK)
+		lock_out_reply_err(ffentry, req, -fr2errno(fres));
+	fff_mark_dirty(NULL);
+	// Anything cached as missing might be this directory or live below it now
+	ffmeta_drop_noent();
 	// XXX mode?
-	mutex_out_return(0);
+	FILINFO fileinfo;
+	fres = fff_stat(path, fffpath, &fileinfo);
+	if (fres != FR_OK)
+		lock_out_reply_err(ffentry, req, -fr2errno(fres));
+	struct ffinode *node = ffinode_add(parent, fileinfo.fname, 1);
+	if (node == NULL)
+		lock_out_reply_err(ffentry, req, ENOMEM);
+	memset(&e, 0, sizeof(e));
+	e.ino = node->ino;
+	e.attr_timeout = FFF_CACHE_TIMEOUT;
+	e.entry_timeout = FFF_CACHE_TIMEOUT;
+	fff_fill_stat(e.ino, &fileinfo, &e.attr);
+	ffinode_set_attr(e.ino, &e.attr);
+	lock_out(ffentry);
+	fuse_reply_entry(req, &e);
 }
 
-static int fff_unlink(const char *path) {
-	mutex_in();
-	struct fuse_context *cntx=fuse_get_context();
-	struct fftab *ffentry = cntx->private_data;
-	const char fffpath(ffentry->index, path);
+// f_unlink removes files and empty directories alike
+static void fff_remove(fuse_req_t req, fuse_ino_t parent, const char *name, int isdir)
+{
+	struct fftab *ffentry = fuse_req_userdata(req);
+	char path[FFF_PATH_MAX];
+	write_in(ffentry);
 	if (ffentry->flags & FFFF_RDONLY)
-		mutex_out_return(-EROFS);
-	// XXX ck is it reg file ?
-	FRESULT fres = f_unlink(fffpath);
-	mutex_out_return(fr2errno(fres));
-}
-
-static int fff_rmdir(const char *path) {
-	mutex_in();
-	struct fuse_context *cntx=fuse_get_context();
-	struct fftab *ffentry = cntx->private_data;
+		lock_out_reply_err(ffentry, req, EROFS);
+	int len = ffinode_child_path(parent, name, path, sizeof(path));
+	if (len < 0)
+		lock_out_reply_err(ffentry, req, -len);
 	const char fffpath(ffentry->index, path);
-	if (ffentry->flags & FFFF_RDONLY)
-		mutex_out_return(-EROFS);
-	// XXX ck is it a dir ?
-	FRESULT fres = f_unlink(fffpath);
-	mutex_out_return(fr2errno(fres));
+	FILINFO fileinfo;
+	FRESULT fres = fff_stat(path, fffpath, &fileinfo);
+	if (fres != FR_OK)
+		lock_out_reply_err(ffentry, req, -fr2errno(fres));
+	if (isdir && !(fileinfo.fattrib & AM_DIR))
+		lock_out_reply_err(ffentry, req, ENOTDIR);
+	if (!isdir && (fileinfo.fattrib & AM_DIR))
+		lock_out_reply_err(ffentry, req, EISDIR);
+	fres = f_unlink(fffpath);
+	if (fres == FR_DENIED && isdir)
+		lock_out_reply_err(ffentry, req, ENOTEMPTY);
+	if (fres == FR_OK) {
+		char canonical[FFF_PATH_MAX];
+		fff_mark_dirty(NULL);
+		if (ffinode_child_path(parent, fileinfo.fname, canonical, sizeof(canonical)) >= 0) {
+			ffmeta_invalidate(canonical, isdir);
+			ffmeta_set_noent(canonical);
+		}
+		ffinode_remove(parent, fileinfo.fname);
+	}
+	lock_out_reply_err(ffentry, req, -fr2errno(fres));
 }
 
-static int fff_rename(const char *path, const char *newpath) {
-	mutex_in();
-	struct fuse_context *cntx=fuse_get_context();
-	struct fftab *ffentry = cntx->private_data;
-	const char fffpath(ffentry->index, path);
-	if (ffentry->flags & FFFF_RDONLY)
-		mutex_out_return(-EROFS);
-	FRESULT fres = f_rename(fffpath, newpath);
-	mutex_out_return(fr2errno(fres));
+static void fff_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	fff_remove(req, parent, name, 0);
 }
 
-static int fff_truncate(const char *path, off_t size) {
-	mutex_in();
-	struct fuse_context *cntx=fuse_get_context();
-	struct fftab *ffentry = cntx->private_data;
-	const char fffpath(ffentry->index, path);
-	if (ffentry->flags & FFFF_RDONLY)
-		mutex_out_return(-EROFS);
-	FIL fp;
-	memset(&fp, 0, sizeof(fp));
-	FRESULT fres = f_open(&fp, fffpath, FA_WRITE);
-	if (fres != FR_OK) goto openerr;
-	fres = f_lseek(&fp, size);
-	if (fres != FR_OK) goto err;
-	fres = f_truncate(&fp);
-	if (fres != FR_OK) goto err;
-	fres = f_close(&fp);
-openerr:
-	mutex_out_return(fr2errno(fres));
-err:
-	f_close(&fp);
-	mutex_out_return(fr2errno(fres));
+static void fff_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	fff_remove(req, parent, name, 1);
 }
 
-static int fff_utimens(const char *path, const struct timespec tv[2]) {
-	mutex_in();
-	struct fuse_context *cntx=fuse_get_context();
-  struct fftab *ffentry = cntx->private_data;
-  const char fffpath(ffentry->index, path);
+static void fff_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+		fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+	struct fftab *ffentry = fuse_req_userdata(req);
+	char path[FFF_PATH_MAX];
+	char newpath[FFF_PATH_MAX];
+	if (flags != 0) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	write_in(ffentry);
 	if (ffentry->flags & FFFF_RDONLY)
-		mutex_out_return(-EROFS);
-	FILINFO fno;
-	struct tm tm;
-	time_t newtime = tv[1].tv_sec;
-	if (localtime_r(&newtime, &tm) == NULL)
-		mutex_out_return(-EINVAL);
-	fno.fdate =
-		/* bit15:9: Year origin from the 1980 (0..127, e.g. 37 for 2017) */
-		(((tm.tm_year - 80) & 0x7f) << 9) |
-		/* bit8:5: Month (1..12) */
-		(((tm.tm_mon + 1) & 0xf) << 5) |
-		/* bit4:0: Day of the month (1..31) */
-		(tm.tm_mday & 0x1f);
-	fno.ftime =
-		/* bit15:11: Hour (0..23)) */
-		((tm.tm_hour & 0x1f) << 11) |
-		/* bit10:5: Minute (0..59) */
-		((tm.tm_min & 0x3f) << 5) |
-		/* bit4:0 Second / 2 (0..29, e.g. 25 for 50) */
-		((tm.tm_sec & 0x3f) / 2);
-	FRESULT fres = f_utime(fffpath, &fno);
-	mutex_out_return(fr2errno(fres));
+		lock_out_reply_err(ffentry, req, EROFS);
+	int len = ffinode_child_path(parent, name, path, sizeof(path));
+	if (len >= 0)
+		len = ffinode_child_path(newparent, newname, newpath, sizeof(newpath));
+	if (len < 0)
+		lock_out_reply_err(ffentry, req, -len);
+	const char fffpath(ffentry->index, path);
+	// Built like fffpath, f_rename ignores the volume of the new name but f_stat needs it
+	char fffnewpath[FFF_PATH_MAX + 12];
+	if (ffentry->index != 0)
+		snprintf(fffnewpath, sizeof(fffnewpath), "%d:%s", ffentry->index, newpath);
+	else
+		snprintf(fffnewpath, sizeof(fffnewpath), "%s", newpath);
+	FILINFO oldinfo;
+	FILINFO newinfo;
+	FRESULT fres = fff_stat(path, fffpath, &oldinfo);
+	if (fres == FR_OK)
+		fres = f_rename(fffpath, newpath);
+	if (fres != FR_OK)
+		lock_out_reply_err(ffentry, req, -fr2errno(fres));
+	fff_mark_dirty(NULL);
+	char canonical[FFF_PATH_MAX];
+	if (ffinode_child_path(parent, oldinfo.fname, canonical, sizeof(canonical)) >= 0)
+		ffmeta_invalidate(canonical, 1);
+	ffmeta_invalidate(newpath, 1);
+	ffmeta_drop_noent();
+	// The inode follows the entry, children keep their numbers as paths are built from parents
+	if (f_stat(fffnewpath, &newinfo) == FR_OK)
+		ffinode_rename(parent, oldinfo.fname, newparent, newinfo.fname);
+	else
+		ffinode_remove(parent, oldinfo.fname);
+	lock_out_reply_err(ffentry, req, 0);
 }
 
-static int fff_statfs(const char *path, struct statvfs *buf) {
-	(void) path;
-	mutex_in();
-  struct fuse_context *cntx=fuse_get_context();
-  struct fftab *ffentry = cntx->private_data;
-  const char fffpath(ffentry->index, "");
-	memset(buf, 0, sizeof(*buf));
+static void fff_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	(void) ino;
+	struct fftab *ffentry = fuse_req_userdata(req);
+	struct statvfs buf;
+	read_in(ffentry);
+	const char fffpath(ffentry->index, "");
+	memset(&buf, 0, sizeof(buf));
 	FATFS *fs;
 	uint32_t fre_clust;
-  FRESULT fres = f_getfree(fffpath, &fre_clust, &fs);
+	FRESULT fres = f_getfree(fffpath, &fre_clust, &fs);
 	if (fres == FR_OK) {
 		WORD ssize =
 #if FF_MAX_SS != FF_MIN_SS
@@ -401,12 +1148,16 @@ static int fff_statfs(const char *path, struct statvfs *buf) {
 			FF_MAX_SS
 #endif
 			;
-		buf->f_bsize = buf->f_frsize = fs->csize * ssize;
-		buf->f_blocks = ((fs->n_fatent - 2) * ssize) / S_BLKSIZE;
-		buf->f_bfree = buf->f_bavail = (fre_clust * ssize) / S_BLKSIZE;
-		buf->f_namemax = 255;
+		buf.f_bsize = buf.f_frsize = fs->csize * ssize;
+		buf.f_blocks = ((fs->n_fatent - 2) * ssize) / S_BLKSIZE;
+		buf.f_bfree = buf.f_bavail = (fre_clust * ssize) / S_BLKSIZE;
+		buf.f_namemax = 255;
 	}
-  mutex_out_return(fr2errno(fres));
+	lock_out(ffentry);
+	if (fres != FR_OK)
+		fuse_reply_err(req, -fr2errno(fres));
+	else
+		fuse_reply_statfs(req, &buf);
 }
 
 static struct fftab *fff_init (int codepage, int flags)
@@ -416,7 +1167,6 @@ static struct fftab *fff_init (int codepage, int flags)
 		struct fftab *ffentry = fftab_get(index);
 		char sdrv[12];
 		snprintf(sdrv, 12, "%d:", index);
-		FRESULT fres = f_mount(&ffentry->fs, sdrv, 1);
 		//
 		/*
 		 * autoCache = (i & 1) != 0; -> 0
@@ -428,6 +1178,8 @@ static struct fftab *fff_init (int codepage, int flags)
 		char floppy_profile[255];
 		snprintf (floppy_profile, 254, "[1|%d|/dev/ttyACM0|0|0]", drive_mask);
 		int mount_drive_res = mount_drive(floppy_profile);
+		// The drive has to be there before FatFs can mount the volume
+		FRESULT fres = (mount_drive_res < 0) ? FR_NOT_READY : f_mount(&ffentry->fs, sdrv, 1);
 
 		if (fres != FR_OK || mount_drive_res < 0) {
 			fftab_del(index);
@@ -455,30 +1207,77 @@ static void fff_destroy(struct fftab *ffentry) {
 	fftab_del(ffentry->index);
 }
 
-int fff_access (const char *path, int mode) {
-	(void) path;
-	(void) mode;
-	return 0;
+static void fff_fuse_init(void *userdata, struct fuse_conn_info *conn) {
+	struct fftab *ffentry = userdata;
+	// Always list with attributes, "ls -l" then needs no lookup or getattr per entry
+	if (conn->capable & FUSE_CAP_READDIRPLUS)
+		conn->want |= FUSE_CAP_READDIRPLUS;
+	conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+	// Started here rather than in main, fuse_daemonize forks into the background
+	if (fff_writeback && fff_sync_idle > 0 && !(ffentry->flags & FFFF_RDONLY)) {
+		fff_idle_stop = 0;
+		if (pthread_create(&fff_idle_tid, NULL, fff_idle_thread, ffentry) == 0)
+			fff_idle_running = 1;
+	}
+}
+
+static void fff_fuse_destroy(void *userdata) {
+	struct fftab *ffentry = userdata;
+	if (fff_idle_running) {
+		pthread_mutex_lock(&fff_idle_mutex);
+		fff_idle_stop = 1;
+		pthread_cond_signal(&fff_idle_cond);
+		pthread_mutex_unlock(&fff_idle_mutex);
+		pthread_join(fff_idle_tid, NULL);
+		fff_idle_running = 0;
+	}
+	write_in(ffentry);
+	fff_sync_all();
+	lock_out(ffentry);
+	if (fff_debug) {
+		struct ffmeta_stats stats;
+		ffmeta_get_stats(&stats);
+		fprintf(stderr, "metadata cache: %llu hits, %llu negative hits, %llu misses, %llu entries\n",
+				(unsigned long long) stats.hits, (unsigned long long) stats.neg_hits,
+				(unsigned long long) stats.misses, (unsigned long long) stats.entries);
+		fprintf(stderr, "drive: %llu cylinders stepped, %u unreadable sectors\n", drive_seek_distance(), drive_bad_sectors());
+		unsigned long long latency[16];
+		int buckets = drive_read_latency(latency, 16);
+		for (int i = 0; i < buckets; i++) {
+			if (latency[i] == 0)
+				continue;
+			if (i == buckets - 1)
+				fprintf(stderr, "drive reads >= %d ms: %llu\n", 1 << (i - 1), latency[i]);
+			else
+				fprintf(stderr, "drive reads < %d ms: %llu\n", 1 << i, latency[i]);
+		}
+	}
 }
 
-static const struct fuse_operations fusefat_ops = {
-	.getattr  = fff_getattr,
+static const struct fuse_lowlevel_ops fusefat_ops = {
+	.init           = fff_fuse_init,
+	.destroy        = fff_fuse_destroy,
+	.lookup         = fff_lookup,
+	.forget         = fff_forget,
+	.forget_multi   = fff_forget_multi,
+	.getattr        = fff_getattr,
+	.setattr        = fff_setattr,
 	.open           = fff_open,
 	.create         = fff_create,
 	.read           = fff_read,
 	.write          = fff_write,
 	.release        = fff_release,
+	.flush          = fff_flush,
+	.fsync          = fff_fsync,
 	.opendir        = fff_opendir,
 	.readdir        = fff_readdir,
+	.readdirplus    = fff_readdirplus,
 	.releasedir     = fff_releasedir,
 	.mkdir          = fff_mkdir,
 	.unlink         = fff_unlink,
 	.rmdir          = fff_rmdir,
 	.rename         = fff_rename,
-	.truncate       = fff_truncate,
-	.utimens        = fff_utimens,
 	.statfs         = fff_statfs,
-	.access         = fff_access,
 };
 
 static void usage(void)
@@ -497,18 +1296,63 @@ static void usage(void)
 			"    -o rw     enable write support only together with -force\n"
 			"    -o force  enable write support only together with -rw\n"
 			"    -o codepage=XXX  set codepage (default 850)\n"
+			"    -o writeback     keep changes in memory until fsync, unmount or idle\n"
+			"    -o sync_idle=N   write-back: sync after N idle seconds, 0 disables (default 2)\n"
+			"    -o cache_kb=N    decoded sector cache size in KiB, 0 disables (default 2048)\n"
+			"    -o resident      keep every decoded sector of the disk in memory\n"
+			"    -o motor_idle=N  flush and stop the motor after N idle ms (default 2000)\n"
+			"    -o read_deadline_ms=N  give up on unreadable sectors after N ms, 0 for no limit (default 5000)\n"
+			"    -o retries=N     extra track reads before giving up on a sector (default 10)\n"
+			"    -o read_fill     return unreadable sectors as the best copy found instead of EIO\n"
+			"    -o badmap=FILE   remember unreadable sectors per disk in FILE, empty disables\n"
+			"                     (default $XDG_CACHE_HOME/gwmount-badsectors)\n"
+			"    -o recover       forget the unreadable sectors remembered and retry them on every read\n"
+			"    -o disk_cache=DIR  keep decoded tracks of each disk in DIR, disks seen before mount at once\n"
 			"\n"
 			"    this software is still experimental\n"
 			"\n");
 }
 
+// $XDG_CACHE_HOME/gwmount-badsectors, or ~/.cache if that isn't set. NULL if there's no home either
+static char *default_bad_sector_file(void)
+{
+	static const char name[] = "/gwmount-badsectors";
+	const char *cache = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	const char *sub = "";
+	if (cache == NULL || *cache == 0) {
+		if (home == NULL || *home == 0)
+			return NULL;
+		cache = home;
+		sub = "/.cache";
+	}
+	size_t size = strlen(cache) + strlen(sub) + sizeof(name);
+	char *path = malloc(size);
+	if (path == NULL)
+		return NULL;
+	snprintf(path, size, "%s%s", cache, sub);
+	mkdir(path, 0700);
+	strcat(path, name);
+	return path;
+}
+
 struct options {
-	const char *mountpoint;
 	int ro;
 	int rw;
 	int rwplus;
 	int force;
 	int codepage;
+	int writeback;
+	int sync_idle;
+	int cache_kb;
+	int resident;
+	int motor_idle;
+	int read_deadline_ms;
+	int retries;
+	int read_fill;
+	char *badmap;
+	int recover;
+	char *disk_cache;
 };
 
 #define FFF_OPT(t, p, v) { t, offsetof(struct options, p), v }
@@ -520,56 +1364,55 @@ static struct fuse_opt fff_opts[] =
 	FFF_OPT("rw+", rwplus, 1),
 	FFF_OPT("force", force, 1),
 	FFF_OPT("codepage=%u", codepage, 1),
-
-	FUSE_OPT_KEY("-V", 'V'),
-	FUSE_OPT_KEY("--version", 'V'),
-	FUSE_OPT_KEY("-h", 'h'),
-	FUSE_OPT_KEY("--help", 'h'),
+	FFF_OPT("writeback", writeback, 1),
+	FFF_OPT("sync_idle=%u", sync_idle, 0),
+	FFF_OPT("cache_kb=%u", cache_kb, 0),
+	FFF_OPT("resident", resident, 1),
+	FFF_OPT("motor_idle=%u", motor_idle, 0),
+	FFF_OPT("read_deadline_ms=%u", read_deadline_ms, 0),
+	FFF_OPT("retries=%u", retries, 0),
+	FFF_OPT("read_fill", read_fill, 1),
+	FFF_OPT("badmap=%s", badmap, 0),
+	FFF_OPT("recover", recover, 1),
+	FFF_OPT("disk_cache=%s", disk_cache, 0),
 	FUSE_OPT_END
 };
 
-	static int
-fff_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
-{
-	struct options *options = data;
-	switch(key) {
-		case FUSE_OPT_KEY_OPT:
-			return 1;
-		case FUSE_OPT_KEY_NONOPT:
-			if(!options->mountpoint) {
-				options->mountpoint = arg;
-				return 1;
-			} else
-				return -1;
-			break;
-		case 'h':
-			usage();
-			fuse_opt_add_arg(outargs, "-ho");
-			fuse_main(outargs->argc, outargs->argv, &fusefat_ops, NULL);
-			return -1;
-
-		case 'V':
-			fprintf(stderr, PROGNAME " version %s -- FatFS %s\n", VERSION, FF_VERSION);
-			fuse_opt_add_arg(outargs, "--version");
-			fuse_main(outargs->argc, outargs->argv, &fusefat_ops, NULL);
-			return -1;
-
-		default:
-			return -1;
-	}
-}
-
 int main(int argc, char *argv[])
 {
-	int err;
+	int err = -1;
 	struct options options = {0};
+	options.sync_idle = FFF_DEFAULT_SYNC_IDLE;
+	options.cache_kb = -1;
+	options.motor_idle = -1;
+	options.read_deadline_ms = -1;
+	options.retries = -1;
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_cmdline_opts opts;
+	struct fuse_session *se;
 	struct fftab *ffentry;
 	int flags = 0;
-	if (fuse_opt_parse(&args, &options, fff_opts, fff_opt_proc) == -1) {
+	if (fuse_opt_parse(&args, &options, fff_opts, NULL) == -1) {
 		fuse_opt_free_args(&args);
 		return -1;
 	}
+	if (fuse_parse_cmdline(&args, &opts) != 0) {
+		fuse_opt_free_args(&args);
+		return -1;
+	}
+	if (opts.show_help) {
+		usage();
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		err = 0;
+		goto returnerr;
+	}
+	if (opts.show_version) {
+		fprintf(stderr, PROGNAME " version %s -- FatFS %s\n", VERSION, FF_VERSION);
+		fuse_lowlevel_version();
+		err = 0;
+		goto returnerr;
+	}
 	if (options.rw == 0 && options.rwplus == 0)
 		options.ro = 1;
 	if (options.rw == 1 && options.force == 0) {
@@ -581,23 +1424,71 @@ int main(int argc, char *argv[])
 		options.ro = 1;
 	}
 
-	if (options.mountpoint == NULL) {
+	if (opts.mountpoint == NULL) {
 		usage();
 		goto returnerr;
 	}
 
 
 	if (options.ro) flags |= FFFF_RDONLY;
+	if (options.writeback && !options.ro) {
+		fff_writeback = 1;
+		fff_sync_idle = options.sync_idle;
+		set_drive_writeback(1);
+	}
+	set_drive_cache(options.cache_kb, options.resident);
+	set_drive_idle(options.motor_idle);
+	set_drive_read_policy(options.read_deadline_ms, options.retries, options.read_fill);
+	if (options.badmap == NULL)
+		options.badmap = default_bad_sector_file();
+	set_drive_bad_sector_file((options.badmap && *options.badmap) ? options.badmap : NULL, options.recover);
+	free(options.badmap);
+	if (options.disk_cache && *options.disk_cache) {
+		mkdir(options.disk_cache, 0700);
+		set_drive_disk_cache(options.disk_cache);
+	}
+	free(options.disk_cache);
 	if ((ffentry = fff_init (options.codepage, flags)) == NULL) {
 		fprintf(stderr, "Fuse init error\n");
 		goto returnerr;
 	}
-	err = fuse_main(args.argc, args.argv, &fusefat_ops, ffentry);
+	ffinode_init();
+	ffmeta_init();
+	fff_debug = opts.debug;
+	se = fuse_session_new(&args, &fusefat_ops, sizeof(fusefat_ops), ffentry);
+	if (se == NULL)
+		goto destroy;
+	fff_session = se;
+	fff_volume = ffentry;
+	set_disk_change_callback(fff_disk_changed);
+	if (fuse_set_signal_handlers(se) != 0)
+		goto session;
+	if (fuse_session_mount(se, opts.mountpoint) != 0)
+		goto signals;
+	fuse_daemonize(opts.foreground);
+	if (opts.singlethread)
+		err = fuse_session_loop(se);
+	else {
+		struct fuse_loop_config config;
+		config.clone_fd = opts.clone_fd;
+		config.max_idle_threads = opts.max_idle_threads;
+		err = fuse_session_loop_mt(se, &config);
+	}
+	fuse_session_unmount(se);
+signals:
+	fuse_remove_signal_handlers(se);
+session:
+	set_disk_change_callback(NULL);
+	fff_session = NULL;
+	fff_volume = NULL;
+	fuse_session_destroy(se);
+destroy:
 	fff_destroy(ffentry);
-	fuse_opt_free_args(&args);
+	ffmeta_fini();
+	ffinode_fini();
 	if (err) fprintf(stderr, "Fuse error %d\n", err);
-	return err;
 returnerr:
+	free(opts.mountpoint);
 	fuse_opt_free_args(&args);
-	return -1;
+	return err;
 }
@@ -0,0 +1,102 @@
+// Times how long waitForEvent takes to return after the drive state changes, against a pretend drive that takes
+// 200ms a revolution like a real 300rpm one. Not run by ctest as it takes a couple of minutes and the numbers
+// depend on the machine: run bridge_event_bench by hand
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+#include "CommonBridgeTemplate.h"
+
+using namespace std::chrono;
+
+static std::atomic<bool> diskPresent = false;
+static std::atomic<int64_t> lastRevolutionAt = 0;
+
+static int64_t nowUs() {
+	return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static void report(const char* name, std::vector<double>& samples) {
+	std::sort(samples.begin(), samples.end());
+	double sum = 0;
+	for (const double sample : samples) sum += sample;
+	printf("%-38s min %6.1f ms  median %6.1f ms  mean %6.1f ms  p90 %6.1f ms  max %6.1f ms\n", name, samples.front(),
+		samples[samples.size() / 2], sum / samples.size(), samples[samples.size() * 9 / 10], samples.back());
+}
+
+// A drive with a disk change line, whose every revolution is blank
+class PretendDrive : public CommonBridgeTemplate {
+public:
+	PretendDrive() : CommonBridgeTemplate(FloppyBridge::BridgeMode::bmFast, FloppyBridge::BridgeDensityMode::bdmDDOnly, false, false) {}
+
+protected:
+	const unsigned int getDriveSpinupTime() override { return 100; }
+	bool supportsDiskChange() override { return true; }
+	bool getDiskChangeStatus(const bool) override { return diskPresent; }
+	void closeInterface() override {}
+	bool openInterface(std::string&) override { return true; }
+	bool checkWriteProtectStatus(const bool) override { return false; }
+	const BridgeDriver* _getDriverInfo() override {
+		static const BridgeDriver info = { "Pretend drive", "", "", "", 0 };
+		return &info;
+	}
+	const DriveTypeID _getDriveTypeID() override { return DriveTypeID::dti35DD; }
+	bool setActiveSurface(const DiskSurface) override { return true; }
+	bool setMotorStatus(const bool) override { return true; }
+	bool setCurrentCylinder(const unsigned int) override { return true; }
+	bool performNoClickSeek() override { return true; }
+	ReadResponse readData(PLL::BridgePLL&, const unsigned int, RotationExtractor::MFMSample* buffer, RotationExtractor::IndexSequenceMarker&,
+		std::function<bool(RotationExtractor::MFMSample* mfmData, const unsigned int dataLengthInBits)> onRotation) override {
+		for (;;) {
+			std::this_thread::sleep_for(milliseconds(200));
+			if (!diskPresent) return ReadResponse::rrNoDiskInDrive;
+			lastRevolutionAt = nowUs();
+			if (!onRotation(buffer, 100000)) return ReadResponse::rrOK;
+		}
+	}
+	ReadResponse readLinearData(PLL::BridgePLL&) override { return ReadResponse::rrError; }
+	bool writeData(const unsigned char*, const unsigned int, const bool, const bool) override { return true; }
+	bool attemptToDetectDiskChange() override { return diskPresent; }
+};
+
+int main() {
+	// Far too big for the stack
+	PretendDrive* drive = new PretendDrive();
+	FloppyDiskBridge& bridge = *drive;
+	if (!bridge.initialise()) {
+		printf("Pretend drive didn't start\n");
+		return 1;
+	}
+	unsigned int generation = 0;
+	std::vector<double> samples;
+
+	// Disk inserted or removed while the motor runs, so the main thread is busy reading
+	for (int i = 0; i < 40; i++) {
+		bridge.setMotorStatus(false, true);
+		std::this_thread::sleep_for(milliseconds(150 + (i * 37) % 200));
+		const bool inserted = !diskPresent;
+		const auto start = steady_clock::now();
+		diskPresent = inserted;
+		while (bridge.isDiskInDrive() != inserted) bridge.waitForEvent(generation, 1000);
+		samples.push_back(duration_cast<microseconds>(steady_clock::now() - start).count() / 1000.0);
+	}
+	report("Disk change seen by waitForEvent", samples);
+
+	// Seek somewhere that isn't cached, timed from the revolution being handed over
+	diskPresent = true;
+	bridge.setMotorStatus(false, true);
+	while (!bridge.isReady()) bridge.waitForEvent(generation, 1000);
+	samples.clear();
+	for (int cylinder = 1; cylinder <= 40; cylinder++) {
+		bridge.gotoCylinder(cylinder, false);
+		while (!bridge.isMFMDataAvailable()) bridge.waitForEvent(generation, 1000);
+		samples.push_back((nowUs() - lastRevolutionAt) / 1000.0);
+	}
+	report("Track data seen by waitForEvent", samples);
+
+	bridge.shutdown();
+	delete drive;
+	return 0;
+}
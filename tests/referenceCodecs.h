@@ -0,0 +1,147 @@
+#pragma once
+
+// The bit-by-bit sector codecs as they were before the table driven and word-at-a-time versions replaced
+// them. The tests check the new code gives the same answers and the benchmark times it against these
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "amiga_sectors.h"
+
+// The original bit-serial CRC16
+inline uint16_t referenceCrc16(const char* pData, int length, uint32_t wCrc = 0xFFFF) {
+	uint8_t i;
+	while (length--) {
+		wCrc ^= *(const unsigned char*)pData++ << 8;
+		for (i = 0; i < 8; i++)
+			wCrc = wCrc & 0x8000 ? (wCrc << 1) ^ 0x1021 : wCrc << 1;
+	}
+	return wCrc & 0xffff;
+}
+
+// The original bit-at-a-time copy out of a track
+inline void referenceExtractBits(const uint8_t* inTrack, const uint32_t dataLengthInBits, const uint32_t bitPos, const uint32_t numBytes, uint8_t* output) {
+	uint32_t realBitPos = bitPos;
+	for (uint32_t byteOutPos = 0; byteOutPos < numBytes; byteOutPos++) {
+		output[byteOutPos] = 0;
+		for (uint32_t bit = 0; bit <= 7; bit++) {
+			output[byteOutPos] <<= 1;
+			if (inTrack[realBitPos >> 3] & (1 << (7 - (realBitPos & 7)))) output[byteOutPos] |= 1;
+			realBitPos = (realBitPos + 1) % dataLengthInBits;
+		}
+	}
+}
+
+// The original IBM decode, taking every other bit. The first bit is now wrapped like the rest, the
+// original read one bit past the end of the track when bitPos was the last bit
+inline void referenceExtractMFMDecodeRaw(const uint8_t* inTrack, const uint32_t dataLengthInBits, const uint32_t bitPos, const uint32_t outputBytes, uint8_t* output) {
+	uint32_t realBitPos = (bitPos + 1) % dataLengthInBits;
+	for (uint32_t byteOutPos = 0; byteOutPos < outputBytes; byteOutPos++) {
+		output[byteOutPos] = 0;
+		for (uint32_t bit = 0; bit <= 7; bit++) {
+			output[byteOutPos] <<= 1;
+			if (inTrack[realBitPos >> 3] & (1 << (7 - (realBitPos & 7)))) output[byteOutPos] |= 1;
+			realBitPos = (realBitPos + 2) % dataLengthInBits;
+		}
+	}
+}
+
+// The original Amiga MFM decode, a long at a time
+inline uint32_t referenceDecodeMFMdata(const uint32_t* input, uint32_t* output, const unsigned int data_size) {
+	uint32_t odd_bits, even_bits;
+	uint32_t chksum = 0L;
+	for (unsigned int count = 0; count < data_size / 4; count++) {
+		odd_bits = *input;
+		even_bits = *(const uint32_t*)(((const unsigned char*)input) + data_size);
+		chksum ^= odd_bits;
+		chksum ^= even_bits;
+		*output = ((even_bits & MFM_MASK) | ((odd_bits & MFM_MASK) << 1));
+		input++;
+		output++;
+	}
+	return chksum & MFM_MASK;
+}
+
+// The original Amiga MFM encode, splitting the data then taking the checksum in a second pass
+inline uint32_t referenceEncodeMFMdata(const uint32_t* input, uint32_t* output, const unsigned int data_size) {
+	uint32_t chksum = 0L;
+	uint32_t* outputOdd = output;
+	uint32_t* outputEven = (uint32_t*)(((unsigned char*)output) + data_size);
+	for (unsigned int count = 0; count < data_size / 4; count++) {
+		*outputEven = *input & MFM_MASK;
+		*outputOdd = ((*input) >> 1) & MFM_MASK;
+		outputEven++;
+		outputOdd++;
+		input++;
+	}
+	for (unsigned int count = 0; count < (data_size / 4) * 2; count++) {
+		chksum ^= *output;
+		output++;
+	}
+	return chksum & MFM_MASK;
+}
+
+// The original clock bit fill from encodeSector, a bit at a time over everything after the sync
+inline void referenceFillClockBits(RawEncodedSector& encodedSector) {
+	bool lastBit = encodedSector[7] & (1 << 0);
+	bool thisBit = lastBit;
+	for (int count = 8; count < RAW_SECTOR_SIZE; count++) {
+		for (int bit = 7; bit >= 1; bit -= 2) {
+			lastBit = thisBit;
+			thisBit = encodedSector[count] & (1 << (bit - 1));
+			if (!(lastBit || thisBit)) encodedSector[count] |= (1 << bit);
+		}
+	}
+}
+
+// The original IBM MFM encode, two bits at a time. inputSize must be at least 1
+inline uint32_t referenceEncodeMFM_IBM(const uint8_t* input, uint8_t* output, const uint32_t inputSize, uint8_t& lastByte, uint8_t* memOverflow) {
+	bool lastBit = lastByte & 1;
+	for (uint32_t b = 0; b < inputSize; b++) {
+		if (output >= memOverflow) return std::max(((int32_t)b) - 1, 0) << 1;
+		uint8_t byte = *input++;
+		for (uint32_t bit = 0; bit < 8; bit++) {
+			*output <<= 2;
+			if (byte & 0x80) {
+				*output |= 1;
+				lastBit = true;
+			}
+			else {
+				if (!lastBit) *output |= 2;
+				lastBit = false;
+			}
+			byte <<= 1;
+			if (bit == 3) {
+				output++;
+				if (output >= memOverflow) return b << 1;
+			}
+		}
+		output++;
+	}
+	lastByte = *(input - 1);
+	return inputSize << 1;
+}
+
+// The original gap fill, encoding a vector of the fill byte
+inline uint32_t referenceGapFillMFM(uint8_t* mem, const uint32_t size, const uint8_t value, uint8_t& lastByte, uint8_t* memOverflow) {
+	if (size < 1) return 0;
+	std::vector<uint8_t> data(size, value);
+	return referenceEncodeMFM_IBM(data.data(), mem, (uint32_t)data.size(), lastByte, memOverflow);
+}
+
+// findSectors_AMIGA as it was: the sync compared at every bit of the track
+inline void referenceFindSectors_AMIGA(const uint8_t* track, const uint32_t dataLengthInBits, const uint32_t trackNumber, const uint32_t expectedNumSectors, DecodedTrack& decodedTrack) {
+	const uint32_t search = 0x44894489;
+	const uint32_t totalBitsToSearch = dataLengthInBits + (RAW_SECTOR_SIZE * 8 * 3);
+	RawEncodedSector alignedSector;
+	uint32_t decoded = 0;
+	for (uint32_t bit = 0; bit < totalBitsToSearch; bit++) {
+		const uint32_t realBitPos = bit % dataLengthInBits;
+		decoded <<= 1;
+		if (track[realBitPos >> 3] & (1 << (7 - (realBitPos & 7)))) decoded |= 1;
+		if (decoded == search) {
+			extractRawSector(track, dataLengthInBits, (bit + 1) % dataLengthInBits, alignedSector);
+			decodeSector(alignedSector, trackNumber, expectedNumSectors, decodedTrack, nullptr);
+		}
+	}
+}
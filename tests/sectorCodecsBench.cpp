@@ -0,0 +1,157 @@
+// Times the sector codecs against the bit-by-bit code they replaced, on the same data, and checks both give
+// the same answer. Not run by ctest as the numbers depend on the machine: run sector_codecs_bench by hand.
+// The codecs are plain C++ on purpose, no SSE/AVX/NEON intrinsics or CPU detection, so every platform
+// the tree builds for runs the same code that is measured here
+
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <vector>
+#include "amiga_sectors.h"
+#include "ibm_sectors.h"
+#include "referenceCodecs.h"
+
+// Average time of one call of f, in nanoseconds
+template<typename F>
+static double nsPerRun(const uint32_t runs, F&& f) {
+	const auto start = std::chrono::steady_clock::now();
+	for (uint32_t run = 0; run < runs; run++) f();
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / runs;
+}
+
+static void report(const char* name, const double reference, const double current, const bool same) {
+	printf("%-36s reference %10.0f ns   current %8.0f ns   %5.1fx  %s\n", name, reference, current, reference / current, same ? "same" : "DIFFERENT");
+}
+
+// CRC16 over a sector's data, as every IBM sector read and write does
+static void benchCrc16(std::mt19937& rng) {
+	static volatile int sectorBytes = DEFAULT_SECTOR_BYTES;
+	char data[DEFAULT_SECTOR_BYTES];
+	for (char& c : data) c = (char)rng();
+	uint32_t reference = 0, current = 0;
+
+	const double referenceNs = nsPerRun(20000, [&]() { reference += referenceCrc16(data, sectorBytes); });
+	const double currentNs = nsPerRun(20000, [&]() { current += crc16(data, sectorBytes); });
+	report("CRC16 of 512 bytes", referenceNs, currentNs, reference == current);
+}
+
+// Whole Amiga track: sync scan, extraction and decode together
+static void benchAmigaTrack(std::mt19937& rng) {
+	static DecodedTrack source, reference, current;
+	static uint8_t mfm[MAX_TRACK_SIZE];
+	const uint32_t trackNumber = 40;
+	source.clear();
+	for (uint32_t sec = 0; sec < 11; sec++) {
+		uint8_t* data = source.add(sec, DEFAULT_SECTOR_BYTES, 0);
+		for (uint32_t i = 0; i < DEFAULT_SECTOR_BYTES; i++) data[i] = (uint8_t)rng();
+	}
+	const uint32_t lengthInBits = encodeSectorsIntoMFM_AMIGA(false, source, trackNumber, sizeof(mfm), mfm) * 8 - 3;
+
+	const double referenceNs = nsPerRun(50, [&]() { reference.clear(); referenceFindSectors_AMIGA(mfm, lengthInBits, trackNumber, 11, reference); });
+	const double currentNs = nsPerRun(50, [&]() { current.clear(); findSectors_AMIGA(mfm, lengthInBits, false, trackNumber, 11, current); });
+	bool same = (reference.present == current.present) && (current.count() == 11);
+	for (uint32_t sec = 0; (sec < 11) && same; sec++)
+		same = (reference.numErrors[sec] == current.numErrors[sec]) && (memcmp(reference.data(sec), current.data(sec), DEFAULT_SECTOR_BYTES) == 0);
+	report("Amiga DD track, find and decode", referenceNs, currentNs, same);
+
+	// A blank track, MFM zeros with no sync in it, so only the scan itself is timed. The current
+	// version fills in all 11 sectors as missing
+	memset(mfm, 0xAA, sizeof(mfm));
+	const double referenceScanNs = nsPerRun(50, [&]() { reference.clear(); referenceFindSectors_AMIGA(mfm, lengthInBits, trackNumber, 11, reference); });
+	const double currentScanNs = nsPerRun(50, [&]() { current.clear(); findSectors_AMIGA(mfm, lengthInBits, false, trackNumber, 11, current); });
+	report("Amiga DD track, sync scan only", referenceScanNs, currentScanNs, (reference.count() == 0) && (current.sectorsWithErrors == 11));
+}
+
+// Copying sectors out of a track, at positions spread over the revolution
+static void benchExtraction(std::mt19937& rng) {
+	std::vector<uint8_t> track(12600);
+	for (uint8_t& b : track) b = (uint8_t)rng();
+	const uint32_t lengthInBits = 100000;
+	uint32_t positions[64];
+	for (uint32_t& pos : positions) pos = rng() % lengthInBits;
+	static uint8_t reference[64][RAW_SECTOR_SIZE], current[64][RAW_SECTOR_SIZE];
+
+	uint32_t next = 0;
+	double referenceNs = nsPerRun(640, [&]() { referenceExtractBits(track.data(), lengthInBits, positions[next % 64], RAW_SECTOR_SIZE, reference[next % 64]); next++; });
+	next = 0;
+	double currentNs = nsPerRun(640, [&]() { extractRawSector(track.data(), lengthInBits, positions[next % 64], current[next % 64]); next++; });
+	report("Amiga raw sector extraction", referenceNs, currentNs, memcmp(reference, current, sizeof(current)) == 0);
+
+	next = 0;
+	referenceNs = nsPerRun(640, [&]() { referenceExtractMFMDecodeRaw(track.data(), lengthInBits, positions[next % 64], DEFAULT_SECTOR_BYTES, reference[next % 64]); next++; });
+	next = 0;
+	currentNs = nsPerRun(640, [&]() { extractMFMDecodeRaw(track.data(), lengthInBits, positions[next % 64], DEFAULT_SECTOR_BYTES, current[next % 64]); next++; });
+	bool same = true;
+	for (uint32_t i = 0; i < 64; i++) same &= memcmp(reference[i], current[i], DEFAULT_SECTOR_BYTES) == 0;
+	report("IBM 512 byte MFM decode", referenceNs, currentNs, same);
+}
+
+// Amiga MFM split and merge of one sector's data. The size is read back each time so the inline reference
+// versions can't be specialised for a constant the real callers don't give them
+static void benchAmigaMFM(std::mt19937& rng) {
+	static volatile unsigned int sectorBytes = DEFAULT_SECTOR_BYTES;
+	static uint32_t data[DEFAULT_SECTOR_BYTES / 4], reference[DEFAULT_SECTOR_BYTES / 2], current[DEFAULT_SECTOR_BYTES / 2];
+	for (uint32_t& value : data) value = rng();
+
+	uint32_t referenceSum = 0, currentSum = 0;
+	double referenceNs = nsPerRun(20000, [&]() { referenceSum ^= referenceEncodeMFMdata(data, reference, sectorBytes); });
+	double currentNs = nsPerRun(20000, [&]() { currentSum ^= encodeMFMdata(data, current, sectorBytes); });
+	report("Amiga 512 byte MFM encode", referenceNs, currentNs, (referenceSum == currentSum) && (memcmp(reference, current, sizeof(current)) == 0));
+
+	static uint32_t referenceOut[DEFAULT_SECTOR_BYTES / 4], currentOut[DEFAULT_SECTOR_BYTES / 4];
+	for (uint32_t& value : reference) value = rng();
+	referenceSum = currentSum = 0;
+	referenceNs = nsPerRun(20000, [&]() { referenceSum ^= referenceDecodeMFMdata(reference, referenceOut, sectorBytes); });
+	currentNs = nsPerRun(20000, [&]() { currentSum ^= decodeMFMdata(reference, currentOut, sectorBytes); });
+	report("Amiga 512 byte MFM decode", referenceNs, currentNs, (referenceSum == currentSum) && (memcmp(referenceOut, currentOut, sizeof(currentOut)) == 0));
+}
+
+// A whole Amiga sector. The old encode is timed as the new one plus the old clock bit fill over its output,
+// as the split into odd and even longs is timed above
+static void benchAmigaSectorEncode(std::mt19937& rng) {
+	uint8_t input[DEFAULT_SECTOR_BYTES];
+	for (uint8_t& b : input) b = (uint8_t)rng();
+	static RawEncodedSector reference, current;
+	unsigned char lastByte = 0;
+
+	const double referenceNs = nsPerRun(2000, [&]() {
+		encodeSector(12, 3, 11, input, reference, lastByte);
+		for (uint32_t i = 8; i < RAW_SECTOR_SIZE; i++) reference[i] &= 0x55;
+		referenceFillClockBits(reference);
+		lastByte = reference[RAW_SECTOR_SIZE - 1];
+	});
+	lastByte = 0;
+	const double currentNs = nsPerRun(2000, [&]() { encodeSector(12, 3, 11, input, current, lastByte); });
+	report("Amiga sector encode with clock bits", referenceNs, currentNs, memcmp(reference, current, sizeof(current)) == 0);
+}
+
+// IBM MFM encode of a sector's data and of a gap
+static void benchIBMEncode(std::mt19937& rng) {
+	static volatile uint32_t sectorBytes = DEFAULT_SECTOR_BYTES, gapBytes = 84;
+	uint8_t input[DEFAULT_SECTOR_BYTES];
+	for (uint8_t& b : input) b = (uint8_t)rng();
+	static uint8_t reference[DEFAULT_SECTOR_BYTES * 2], current[DEFAULT_SECTOR_BYTES * 2];
+	uint8_t referenceLast = 0, currentLast = 0;
+
+	double referenceNs = nsPerRun(20000, [&]() { referenceEncodeMFM_IBM(input, reference, sectorBytes, referenceLast, reference + sizeof(reference)); });
+	double currentNs = nsPerRun(20000, [&]() { encodeMFMdata(input, current, sectorBytes, currentLast, current + sizeof(current)); });
+	report("IBM 512 byte MFM encode", referenceNs, currentNs, (referenceLast == currentLast) && (memcmp(reference, current, sizeof(current)) == 0));
+
+	referenceNs = nsPerRun(20000, [&]() { referenceGapFillMFM(reference, gapBytes, 0x4E, referenceLast, reference + sizeof(reference)); });
+	currentNs = nsPerRun(20000, [&]() { gapFillMFM(current, gapBytes, 0x4E, currentLast, current + sizeof(current)); });
+	report("IBM 84 byte gap fill", referenceNs, currentNs, (referenceLast == currentLast) && (memcmp(reference, current, 84 * 2) == 0));
+}
+
+int main() {
+	std::mt19937 rng(20241013);
+
+	benchCrc16(rng);
+	benchAmigaTrack(rng);
+	benchExtraction(rng);
+	benchAmigaMFM(rng);
+	benchAmigaSectorEncode(rng);
+	benchIBMEncode(rng);
+	return 0;
+}
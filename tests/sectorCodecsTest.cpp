@@ -0,0 +1,315 @@
+// Checks the table driven and word-at-a-time sector codecs against the bit-by-bit code they replaced.
+// The reference versions in referenceCodecs.h are kept as they were so a wrong table or shift shows up as a mismatch
+// Sector fusion is checked against copies of a known sector damaged in known places
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <vector>
+#include "amiga_sectors.h"
+#include "ibm_sectors.h"
+#include "sectorFusion.h"
+#include "referenceCodecs.h"
+
+static uint32_t failures = 0;
+
+#define CHECK(condition, ...) do { if (!(condition)) { failures++; fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); } } while (0)
+
+// Slice-by-8 CRC16 against the bit-serial loop, every length and seed
+static void testCrc16(std::mt19937& rng) {
+	char check[] = "123456789";
+	CHECK(crc16(check, 9) == 0x29B1, "CRC16 check value %04x", crc16(check, 9));
+
+	std::vector<char> buffer(4200);
+	for (uint32_t run = 0; run < 20000; run++) {
+		const int length = (run & 1) ? 512 : (int)(rng() % buffer.size());
+		for (int i = 0; i < length; i++) buffer[i] = (char)rng();
+		const uint32_t seed = (run % 3) ? 0xFFFF : (rng() & 0xFFFF);
+		const uint16_t expected = referenceCrc16(buffer.data(), length, seed);
+		const uint16_t actual = crc16(buffer.data(), length, seed);
+		CHECK(expected == actual, "CRC16 of %d bytes seed %04x: %04x, expected %04x", length, seed, actual, expected);
+	}
+
+	// Continuing a CRC across calls gives the same as one call
+	for (int i = 0; i < 1000; i++) buffer[i] = (char)rng();
+	const uint16_t whole = crc16(buffer.data(), 1000);
+	CHECK(crc16(buffer.data() + 333, 667, crc16(buffer.data(), 333)) == whole, "CRC16 split at 333");
+}
+
+// Shifted 64-bit extraction against the bit-by-bit copy, at every position including across the end of the track
+static void testExtraction(std::mt19937& rng) {
+	std::vector<uint8_t> track(2600), expected(1100), actual(1100);
+	for (uint32_t run = 0; run < 5000; run++) {
+		const uint32_t lengthInBits = 20000 + rng() % 800;
+		for (uint8_t& b : track) b = (uint8_t)rng();
+		// Near the end of the track a good part of the time
+		const uint32_t bitPos = (run & 1) ? lengthInBits - 1 - rng() % 2000 : rng() % lengthInBits;
+
+		const uint32_t numBytes = (run % 3) ? RAW_SECTOR_SIZE : 1 + rng() % 1100;
+		referenceExtractBits(track.data(), lengthInBits, bitPos, numBytes, expected.data());
+		extractTrackBits(track.data(), lengthInBits, bitPos, numBytes, actual.data());
+		CHECK(memcmp(expected.data(), actual.data(), numBytes) == 0, "extractTrackBits %u bytes at %u of %u bits", numBytes, bitPos, lengthInBits);
+
+		const uint32_t outputBytes = (run % 3) ? DEFAULT_SECTOR_BYTES : 1 + rng() % 600;
+		referenceExtractMFMDecodeRaw(track.data(), lengthInBits, bitPos, outputBytes, expected.data());
+		extractMFMDecodeRaw(track.data(), lengthInBits, bitPos, outputBytes, actual.data());
+		CHECK(memcmp(expected.data(), actual.data(), outputBytes) == 0, "extractMFMDecodeRaw %u bytes at %u of %u bits", outputBytes, bitPos, lengthInBits);
+	}
+}
+
+// Two-longs-at-a-time Amiga MFM split and merge against the long-at-a-time loops, and the clock bits
+// encodeSector fills in a long at a time against the bit-by-bit fill
+static void testAmigaMFM(std::mt19937& rng) {
+	static uint32_t data[DEFAULT_SECTOR_BYTES / 4], expected[DEFAULT_SECTOR_BYTES / 2], actual[DEFAULT_SECTOR_BYTES / 2];
+	for (uint32_t run = 0; run < 2000; run++) {
+		// Odd numbers of longs too, so the single long after the pairs is covered
+		const uint32_t size = (run & 1) ? DEFAULT_SECTOR_BYTES : 4 * (1 + rng() % (DEFAULT_SECTOR_BYTES / 4));
+		for (uint32_t& value : data) value = rng();
+		for (uint32_t& value : actual) value = rng();
+
+		uint32_t expectedSum = referenceEncodeMFMdata(data, expected, size);
+		uint32_t actualSum = encodeMFMdata(data, actual, size);
+		CHECK(expectedSum == actualSum, "encodeMFMdata %u bytes checksum %08x, expected %08x", size, actualSum, expectedSum);
+		CHECK(memcmp(expected, actual, size * 2) == 0, "encodeMFMdata %u bytes output", size);
+
+		// Decode random MFM so the clock bits are junk and must be ignored
+		for (uint32_t& value : expected) value = rng();
+		expectedSum = referenceDecodeMFMdata(expected, data, size);
+		actualSum = decodeMFMdata(expected, actual, size);
+		CHECK(expectedSum == actualSum, "decodeMFMdata %u bytes checksum %08x, expected %08x", size, actualSum, expectedSum);
+		CHECK(memcmp(data, actual, size) == 0, "decodeMFMdata %u bytes output", size);
+	}
+
+	static DecodedTrack decoded;
+	RawEncodedSector encoded, unclocked, afterSync = {};
+	uint8_t input[DEFAULT_SECTOR_BYTES];
+	for (uint32_t run = 0; run < 200; run++) {
+		// Runs of zeros as well as random data, that's where clock bits get set
+		for (uint8_t& b : input) b = (run & 1) ? (uint8_t)rng() : (uint8_t)(rng() & rng() & rng());
+		unsigned char lastByte = (unsigned char)rng();
+		const uint32_t sector = run % 11;
+		encodeSector(5, sector, 11, input, encoded, lastByte);
+		CHECK(lastByte == encoded[RAW_SECTOR_SIZE - 1], "encodeSector lastByte");
+
+		memcpy(unclocked, encoded, sizeof(encoded));
+		for (uint32_t i = 8; i < RAW_SECTOR_SIZE; i++) unclocked[i] &= 0x55;
+		referenceFillClockBits(unclocked);
+		CHECK(memcmp(unclocked, encoded, sizeof(encoded)) == 0, "encodeSector clock bits, run %u", run);
+
+		// decodeSector takes what follows the sync, as findSectors_AMIGA extracts it
+		memcpy(afterSync, encoded + 8, RAW_SECTOR_SIZE - 8);
+		decoded.clear();
+		decodeSector(afterSync, 5, 11, decoded, nullptr);
+		CHECK(decoded.has(sector) && (decoded.numErrors[sector] == 0) && (memcmp(decoded.data(sector), input, sizeof(input)) == 0), "encodeSector run %u doesn't decode", run);
+	}
+}
+
+// Table driven IBM MFM encode and gap fill against the two-bits-at-a-time encode, with room to spare. Running
+// out of room isn't compared, the old code gave back a count that didn't match what it had written
+static void testIBMEncode(std::mt19937& rng) {
+	std::vector<uint8_t> input(600), expected(1300), actual(1300);
+	for (uint32_t run = 0; run < 20000; run++) {
+		const uint32_t size = (run & 1) ? DEFAULT_SECTOR_BYTES : 1 + rng() % input.size();
+		for (uint8_t& b : input) b = (uint8_t)rng();
+		const uint8_t previous = (uint8_t)rng();
+		uint8_t expectedLast = previous, actualLast = previous;
+
+		uint32_t expectedSize = referenceEncodeMFM_IBM(input.data(), expected.data(), size, expectedLast, expected.data() + expected.size());
+		uint32_t actualSize = encodeMFMdata(input.data(), actual.data(), size, actualLast, actual.data() + actual.size());
+		CHECK((expectedSize == actualSize) && (expectedLast == actualLast) && (memcmp(expected.data(), actual.data(), expectedSize) == 0), "IBM encodeMFMdata %u bytes after %02x", size, previous);
+
+		// The gaps are mostly 0x4E, but any value will do
+		const uint8_t value = (run % 3) ? 0x4E : (uint8_t)rng();
+		const uint32_t gap = rng() % 100;
+		expectedLast = actualLast = previous;
+		expectedSize = referenceGapFillMFM(expected.data(), gap, value, expectedLast, expected.data() + expected.size());
+		actualSize = gapFillMFM(actual.data(), gap, value, actualLast, actual.data() + actual.size());
+		CHECK((expectedSize == actualSize) && (expectedLast == actualLast) && (memcmp(expected.data(), actual.data(), expectedSize) == 0), "IBM gapFillMFM %u of %02x after %02x", gap, value, previous);
+	}
+}
+
+// Copy of a track started rotateBits bits in, as if the read had started somewhere else on the revolution
+static std::vector<uint8_t> rotateTrack(const uint8_t* track, const uint32_t lengthInBits, const uint32_t rotateBits) {
+	std::vector<uint8_t> rotated((lengthInBits + 7) / 8, 0);
+	for (uint32_t bit = 0; bit < lengthInBits; bit++) {
+		const uint32_t from = (bit + rotateBits) % lengthInBits;
+		if (track[from >> 3] & (0x80 >> (from & 7))) rotated[bit >> 3] |= 0x80 >> (bit & 7);
+	}
+	return rotated;
+}
+
+// Encode an Amiga track and find every sector again, wherever the revolution starts, so sectors
+// across the end of the track and syncs at every bit phase get found
+static void testAmigaSyncScan(std::mt19937& rng) {
+	static DecodedTrack source, found;
+	static uint8_t mfm[MAX_TRACK_SIZE];
+	const uint32_t trackNumber = 17;
+	source.clear();
+	for (uint32_t sec = 0; sec < 11; sec++) {
+		uint8_t* data = source.add(sec, DEFAULT_SECTOR_BYTES, 0);
+		for (uint32_t i = 0; i < DEFAULT_SECTOR_BYTES; i++) data[i] = (uint8_t)rng();
+	}
+	const uint32_t bytes = encodeSectorsIntoMFM_AMIGA(false, source, trackNumber, sizeof(mfm), mfm);
+	CHECK(bytes > 0, "Amiga track didn't encode");
+	if (!bytes) return;
+
+	for (uint32_t run = 0; run < 200; run++) {
+		// Odd lengths too, a real revolution is rarely a whole number of bytes
+		const uint32_t lengthInBits = bytes * 8 - (run % 8);
+		const std::vector<uint8_t> track = rotateTrack(mfm, lengthInBits, (run < 16) ? run : (uint32_t)(rng() % lengthInBits));
+		found.clear();
+		findSectors_AMIGA(track.data(), lengthInBits, false, trackNumber, 11, found);
+		CHECK(found.count() == 11, "Amiga run %u found %u sectors", run, found.count());
+		for (uint32_t sec = 0; sec < 11; sec++) {
+			if (!found.has(sec)) continue;
+			CHECK(found.numErrors[sec] == 0, "Amiga run %u sector %u has %u errors", run, sec, found.numErrors[sec]);
+			CHECK(memcmp(found.data(sec), source.data(sec), DEFAULT_SECTOR_BYTES) == 0, "Amiga run %u sector %u differs", run, sec);
+		}
+	}
+}
+
+// Encode an IBM track and find every sector again from anywhere on the revolution
+static void testIBMRoundTrip(std::mt19937& rng) {
+	static DecodedTrack source, found;
+	static uint8_t mfm[MAX_TRACK_SIZE];
+	const uint32_t trackNumber = 33;
+	source.clear();
+	for (uint32_t sec = 0; sec < 9; sec++) {
+		uint8_t* data = source.add(sec, DEFAULT_SECTOR_BYTES, 0);
+		for (uint32_t i = 0; i < DEFAULT_SECTOR_BYTES; i++) data[i] = (uint8_t)rng();
+	}
+	const uint32_t bytes = encodeSectorsIntoMFM_IBM(false, false, &source, trackNumber, sizeof(mfm), mfm);
+	CHECK(bytes > 0, "IBM track didn't encode");
+	if (!bytes) return;
+
+	for (uint32_t run = 0; run < 100; run++) {
+		const uint32_t lengthInBits = bytes * 8 - (run % 8);
+		const std::vector<uint8_t> track = rotateTrack(mfm, lengthInBits, (run < 16) ? run : (uint32_t)(rng() % lengthInBits));
+		found.clear();
+		findSectors_IBM(track.data(), lengthInBits, false, trackNumber, 9, found);
+		// The search doesn't wrap round, so the sector cut in two by the start of the read may only be the blank
+		// dummy that stands in for a missing sector
+		uint32_t real = 0;
+		for (uint32_t sec = 0; sec < 9; sec++) {
+			if ((!found.has(sec)) || (found.numErrors[sec] == 0xFFFF)) continue;
+			real++;
+			CHECK(found.numErrors[sec] == 0, "IBM run %u sector %u has %u errors", run, sec, found.numErrors[sec]);
+			CHECK(memcmp(found.data(sec), source.data(sec), DEFAULT_SECTOR_BYTES) == 0, "IBM run %u sector %u differs", run, sec);
+		}
+		CHECK(real >= 8, "IBM run %u found %u sectors", run, real);
+	}
+}
+
+// An IBM data field as fusion sees it: data mark, 512 bytes, then the CRC high byte first
+static const uint32_t FUSION_SIZE = 4 + DEFAULT_SECTOR_BYTES + 2;
+
+static bool fusionCheck(const uint8_t* raw, const uint32_t size) {
+	return crc16((char*)raw, size - 2) == ((raw[size - 2] << 8) | raw[size - 1]);
+}
+
+static std::vector<uint8_t> fusionSector(std::mt19937& rng) {
+	std::vector<uint8_t> raw(FUSION_SIZE);
+	raw[0] = raw[1] = raw[2] = 0xA1;
+	raw[3] = 0xFB;
+	for (uint32_t i = 4; i < FUSION_SIZE - 2; i++) raw[i] = (uint8_t)rng();
+	const uint16_t crc = crc16((char*)raw.data(), FUSION_SIZE - 2);
+	raw[FUSION_SIZE - 2] = crc >> 8;
+	raw[FUSION_SIZE - 1] = crc & 0xFF;
+	return raw;
+}
+
+static void flipBit(std::vector<uint8_t>& raw, const uint32_t bit) {
+	raw[bit >> 3] ^= 1 << (bit & 7);
+}
+
+// Rebuilding a sector from bad reads: voting, flipping the one weak bit left, and not passing off a wrong sector
+static void testSectorFusion(std::mt19937& rng) {
+	static SectorFusion fusion;
+	std::vector<uint8_t> result(FUSION_SIZE);
+	const uint32_t dataBits = (FUSION_SIZE - 2) * 8;
+
+	// Three copies, each damaged in different places. Two can't outvote each other, the third settles every bit
+	for (uint32_t run = 0; run < 50; run++) {
+		fusion.begin(run);
+		const std::vector<uint8_t> good = fusionSector(rng);
+		std::vector<uint8_t> copies[3] = { good, good, good };
+		for (uint32_t c = 0; c < 3; c++)
+			for (uint32_t damage = 0; damage < 6; damage++)
+				copies[c][(c * 170 + damage * 28 + rng() % 20) % FUSION_SIZE] ^= (uint8_t)(1 + rng() % 255);
+		CHECK(!fusion.fuse(3, copies[0].data(), FUSION_SIZE, fusionCheck, result.data()), "fusion run %u passed with one copy", run);
+		CHECK(!fusion.fuse(3, copies[1].data(), FUSION_SIZE, fusionCheck, result.data()), "fusion run %u passed with two copies", run);
+		const bool repaired = fusion.fuse(3, copies[2].data(), FUSION_SIZE, fusionCheck, result.data());
+		CHECK(repaired, "fusion run %u didn't vote three copies", run);
+		CHECK((!repaired) || (result == good), "fusion run %u voted the wrong sector", run);
+	}
+
+	// A weak bit read wrongly more often than not. The vote gets it wrong, only flipping it passes the CRC
+	for (uint32_t run = 0; run < 50; run++) {
+		fusion.begin(1000 + run);
+		const std::vector<uint8_t> good = fusionSector(rng);
+		const uint32_t weak = rng() % dataBits;
+		std::vector<uint8_t> wrong = good;
+		flipBit(wrong, weak);
+		// Different noise in each wrong copy so they count as separate reads
+		std::vector<uint8_t> first = wrong, second = wrong, third = good;
+		const uint32_t noise = (weak + 1 + rng() % (dataBits - 1)) % dataBits;
+		flipBit(first, noise);
+		CHECK(!fusion.fuse(0, first.data(), FUSION_SIZE, fusionCheck, result.data()), "weak bit run %u passed with one copy", run);
+		CHECK(!fusion.fuse(0, second.data(), FUSION_SIZE, fusionCheck, result.data()), "weak bit run %u passed with two copies", run);
+		const bool repaired = fusion.fuse(0, third.data(), FUSION_SIZE, fusionCheck, result.data());
+		CHECK(repaired, "weak bit run %u wasn't flipped", run);
+		CHECK((!repaired) || (result == good), "weak bit run %u flipped the wrong bit", run);
+	}
+
+	// Two bits voted wrong. CRC16 catches every error of three bits or fewer in a sector this size, so no single
+	// flip, whether of one of those two or of another weak bit, can make it pass
+	for (uint32_t run = 0; run < 50; run++) {
+		fusion.begin(2000 + run);
+		const std::vector<uint8_t> good = fusionSector(rng);
+		const uint32_t bitA = rng() % dataBits;
+		const uint32_t bitB = (bitA + 1 + rng() % (dataBits - 1)) % dataBits;
+		std::vector<uint8_t> first = good, second = good, third = good;
+		flipBit(first, bitA);
+		flipBit(first, bitB);
+		flipBit(second, bitA);
+		flipBit(second, bitB);
+		// More weak bits for the flips to try, each only wrong once
+		for (uint32_t extra = 0; extra < 4; extra++) {
+			uint32_t bit = rng() % dataBits;
+			while ((bit == bitA) || (bit == bitB)) bit = rng() % dataBits;
+			flipBit((extra & 1) ? third : second, bit);
+		}
+		fusion.fuse(7, first.data(), FUSION_SIZE, fusionCheck, result.data());
+		fusion.fuse(7, second.data(), FUSION_SIZE, fusionCheck, result.data());
+		const bool repaired = fusion.fuse(7, third.data(), FUSION_SIZE, fusionCheck, result.data());
+		CHECK(!repaired, "fusion run %u passed a sector with two bad bits", run);
+	}
+
+	// The same read twice is no new evidence
+	fusion.begin(3000);
+	const std::vector<uint8_t> good = fusionSector(rng);
+	std::vector<uint8_t> bad = good;
+	flipBit(bad, 100);
+	fusion.fuse(1, bad.data(), FUSION_SIZE, fusionCheck, result.data());
+	CHECK(!fusion.fuse(1, bad.data(), FUSION_SIZE, fusionCheck, result.data()), "fusion used a repeated copy");
+}
+
+int main() {
+	std::mt19937 rng(20241013);
+
+	testCrc16(rng);
+	testAmigaSyncScan(rng);
+	testExtraction(rng);
+	testIBMRoundTrip(rng);
+	testAmigaMFM(rng);
+	testIBMEncode(rng);
+	testSectorFusion(rng);
+
+	if (failures) {
+		fprintf(stderr, "%u checks failed\n", failures);
+		return 1;
+	}
+	printf("All sector codec checks passed\n");
+	return 0;
+}